@@ -0,0 +1,208 @@
+#include "main.h"
+#include "pathpool.h"
+#include "backupindex.h"
+
+static constexpr size_t kInitialSlotCount = 1024;
+
+size_t BackupIndex::FindSlot(PathId originalPathId) const
+{
+	if (m_slots.empty() || originalPathId == kInvalidPathId)
+	{
+		return SIZE_MAX;
+	}
+
+	size_t slotMask = m_slots.size() - 1;
+
+	for (size_t slotIndex = (size_t)(uint32_t)GetPathHash(originalPathId) & slotMask; ; slotIndex = (slotIndex + 1) & slotMask)
+	{
+		const HashSlot& slot = m_slots[slotIndex];
+
+		if (slot.handle == kInvalidBackupEntry)
+		{
+			return SIZE_MAX;
+		}
+
+		if (slot.pathId == originalPathId)
+		{
+			return slotIndex;
+		}
+	}
+}
+
+void BackupIndex::InsertSlot(uint32_t pathHash, PathId originalPathId, BackupEntryHandle handle)
+{
+	// Kept at most three quarters full so probe runs stay short
+	if ((m_usedSlots + 1) * 4 > m_slots.size() * 3)
+	{
+		GrowSlots();
+	}
+
+	size_t slotMask = m_slots.size() - 1;
+	size_t slotIndex = (size_t)pathHash & slotMask;
+
+	while (m_slots[slotIndex].handle != kInvalidBackupEntry)
+	{
+		slotIndex = (slotIndex + 1) & slotMask;
+	}
+
+	m_slots[slotIndex].pathHash = pathHash;
+	m_slots[slotIndex].pathId = originalPathId;
+	m_slots[slotIndex].handle = handle;
+	++m_usedSlots;
+}
+
+// Backward shift deletion: later slots of the probe run move up into the hole, so lookups never need
+// tombstones to keep going
+void BackupIndex::EraseSlot(size_t slotIndex)
+{
+	size_t slotMask = m_slots.size() - 1;
+	size_t holeIndex = slotIndex;
+
+	m_slots[holeIndex] = HashSlot();
+	--m_usedSlots;
+
+	for (size_t nextIndex = (holeIndex + 1) & slotMask; m_slots[nextIndex].handle != kInvalidBackupEntry; nextIndex = (nextIndex + 1) & slotMask)
+	{
+		size_t homeIndex = (size_t)m_slots[nextIndex].pathHash & slotMask;
+
+		// The slot can move into the hole unless its home lies cyclically after the hole
+		bool isHomeAfterHole = (holeIndex <= nextIndex)
+			? (homeIndex > holeIndex && homeIndex <= nextIndex)
+			: (homeIndex > holeIndex || homeIndex <= nextIndex);
+
+		if (!isHomeAfterHole)
+		{
+			m_slots[holeIndex] = m_slots[nextIndex];
+			m_slots[nextIndex] = HashSlot();
+			holeIndex = nextIndex;
+		}
+	}
+}
+
+void BackupIndex::GrowSlots()
+{
+	std::vector<HashSlot> oldSlots;
+	oldSlots.swap(m_slots);
+
+	m_slots.resize(oldSlots.empty() ? kInitialSlotCount : oldSlots.size() * 2);
+	m_usedSlots = 0;
+
+	for (const HashSlot& slot : oldSlots)
+	{
+		if (slot.handle != kInvalidBackupEntry)
+		{
+			InsertSlot(slot.pathHash, slot.pathId, slot.handle);
+		}
+	}
+}
+
+BackupFile* BackupIndex::Find(PathId originalPathId)
+{
+	return Get(FindHandle(originalPathId));
+}
+
+const BackupFile* BackupIndex::Find(PathId originalPathId) const
+{
+	return Get(FindHandle(originalPathId));
+}
+
+BackupEntryHandle BackupIndex::FindHandle(PathId originalPathId) const
+{
+	size_t slotIndex = FindSlot(originalPathId);
+	return slotIndex != SIZE_MAX ? m_slots[slotIndex].handle : kInvalidBackupEntry;
+}
+
+BackupFile& BackupIndex::FindOrAdd(PathId originalPathId)
+{
+	size_t slotIndex = FindSlot(originalPathId);
+	if (slotIndex != SIZE_MAX)
+	{
+		return m_entries[m_slots[slotIndex].handle];
+	}
+
+	BackupEntryHandle handle;
+
+	if (!m_freeHandles.empty())
+	{
+		handle = m_freeHandles.back();
+		m_freeHandles.pop_back();
+		m_isLive[handle] = true;
+	}
+	else
+	{
+		handle = (BackupEntryHandle)m_entries.size();
+
+		m_entries.emplace_back();
+		m_isLive.push_back(true);
+	}
+
+	BackupFile& entry = m_entries[handle];
+	entry.originalPathId = originalPathId;
+
+	InsertSlot((uint32_t)GetPathHash(originalPathId), originalPathId, handle);
+	m_order.push_back(handle);
+	return entry;
+}
+
+BackupFile* BackupIndex::Get(BackupEntryHandle handle)
+{
+	return (handle < m_entries.size() && m_isLive[handle]) ? &m_entries[handle] : nullptr;
+}
+
+const BackupFile* BackupIndex::Get(BackupEntryHandle handle) const
+{
+	return (handle < m_entries.size() && m_isLive[handle]) ? &m_entries[handle] : nullptr;
+}
+
+void BackupIndex::Remove(const std::vector<BackupEntryHandle>& handles)
+{
+	bool isAnyRemoved = false;
+
+	for (BackupEntryHandle handle : handles)
+	{
+		BackupFile* entry = Get(handle);
+		if (!entry)
+		{
+			continue;
+		}
+
+		size_t slotIndex = FindSlot(entry->originalPathId);
+		if (slotIndex != SIZE_MAX)
+		{
+			EraseSlot(slotIndex);
+		}
+
+		*entry = BackupFile();
+		m_isLive[handle] = false;
+		m_freeHandles.push_back(handle);
+		isAnyRemoved = true;
+	}
+
+	if (isAnyRemoved)
+	{
+		m_order.erase(std::remove_if(m_order.begin(), m_order.end(), [this](BackupEntryHandle handle)
+		{
+			return !m_isLive[handle];
+		}), m_order.end());
+	}
+}
+
+void BackupIndex::Clear()
+{
+	m_entries.clear();
+	m_isLive.clear();
+	m_freeHandles.clear();
+	m_order.clear();
+
+	// A rescan refills the index to about the same size, the table keeps its capacity
+	std::fill(m_slots.begin(), m_slots.end(), HashSlot());
+	m_usedSlots = 0;
+}
+
+void BackupIndex::Sort(const EntryLess& isLess)
+{
+	std::sort(m_order.begin(), m_order.end(), [&](BackupEntryHandle left, BackupEntryHandle right)
+	{
+		return isLess(m_entries[left], m_entries[right]);
+	});
+}
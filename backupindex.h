@@ -0,0 +1,120 @@
+#ifndef BACKUPINDEX_H
+#define BACKUPINDEX_H
+
+// The in-memory index of the backup root: every original file that has backups, with its versions
+// oldest first. Entries sit in one dense array and are found through an open addressing hash table on
+// the interned id of the original path, so a lookup costs a probe or two however many files are indexed.
+// An entry is referred to by its handle, its slot in the array, which stays put while entries are
+// added; the slot of a removed entry is reused by later ones. Display order is a separate array of
+// handles, so sorting the UI table never moves an entry.
+
+typedef std::chrono::system_clock::time_point TimePoint;
+
+// One backup of an original file. sourceSize and sourceWriteTime describe the original as it was
+// copied; the copy carries the write time over to the backup, so a rescan of the backup folder gets
+// them back from the backup file itself. The content hash is taken while copying; versions found by a
+// rescan get theirs the first time it is needed.
+struct BackupVersion
+{
+	TimePoint					timePoint = {};
+	uint64_t					sourceSize = 0;
+
+	// What the stored form takes: the copy, the delta, the compressed file or the pack record. A
+	// deduplicated copy shares its bytes with others, so it counts them all the same.
+	uint64_t					storedBytes = 0;
+
+	std::fs::file_time_type		sourceWriteTime = {};
+	uint64_t					contentHash = 0;
+	bool						hasContentHash = false;
+
+	// The original kept changing while it was copied, even after retrying
+	bool						possiblyTorn = false;
+};
+
+struct BackupFile
+{
+	std::vector<BackupVersion>	backups;
+	PathId						originalPathId = kInvalidPathId;
+
+	void SortBackupTimes()
+	{
+		std::sort(backups.begin(), backups.end(), [](const BackupVersion& left, const BackupVersion& right)
+		{
+			return left.timePoint < right.timePoint;
+		});
+	}
+};
+
+typedef uint32_t BackupEntryHandle;
+static constexpr BackupEntryHandle kInvalidBackupEntry = UINT32_MAX;
+
+class BackupIndex
+{
+public:
+	typedef std::function<bool(const BackupFile& left, const BackupFile& right)> EntryLess;
+
+	BackupFile*			Find(PathId originalPathId);
+	const BackupFile*	Find(PathId originalPathId) const;
+	BackupEntryHandle	FindHandle(PathId originalPathId) const;
+
+	// Adds an entry without versions if the path has none yet. References to other entries don't
+	// survive an addition, their handles do.
+	BackupFile&			FindOrAdd(PathId originalPathId);
+
+	// nullptr for a removed entry
+	BackupFile*			Get(BackupEntryHandle handle);
+	const BackupFile*	Get(BackupEntryHandle handle) const;
+
+	void				Remove(const std::vector<BackupEntryHandle>& handles);
+	void				Clear();
+
+	size_t				Size() const { return m_order.size(); }
+
+	// Live entries in display order
+	const std::vector<BackupEntryHandle>&	Handles() const { return m_order; }
+	void				Sort(const EntryLess& isLess);
+
+	// Range-for over the live entries in display order
+	template<class IndexType, class EntryType>
+	class EntryIterator
+	{
+	public:
+		EntryIterator(IndexType* index, size_t position) : m_index(index), m_position(position) {}
+
+		EntryType&		operator*() const { return m_index->m_entries[m_index->m_order[m_position]]; }
+		EntryType*		operator->() const { return &**this; }
+		EntryIterator&	operator++() { ++m_position; return *this; }
+		bool			operator!=(const EntryIterator& other) const { return m_position != other.m_position; }
+
+	private:
+		IndexType*	m_index;
+		size_t		m_position;
+	};
+
+	EntryIterator<BackupIndex, BackupFile>					begin() { return { this, 0 }; }
+	EntryIterator<BackupIndex, BackupFile>					end() { return { this, m_order.size() }; }
+	EntryIterator<const BackupIndex, const BackupFile>		begin() const { return { this, 0 }; }
+	EntryIterator<const BackupIndex, const BackupFile>		end() const { return { this, m_order.size() }; }
+
+private:
+	struct HashSlot
+	{
+		uint32_t			pathHash = 0;		// Low bits of the pool's hash of the path, the slot's home
+		PathId				pathId = kInvalidPathId;
+		BackupEntryHandle	handle = kInvalidBackupEntry;	// kInvalidBackupEntry for an empty slot
+	};
+
+	size_t				FindSlot(PathId originalPathId) const;
+	void				InsertSlot(uint32_t pathHash, PathId originalPathId, BackupEntryHandle handle);
+	void				EraseSlot(size_t slotIndex);
+	void				GrowSlots();
+
+	std::vector<BackupFile>			m_entries;
+	std::vector<bool>				m_isLive;
+	std::vector<BackupEntryHandle>	m_freeHandles;
+	std::vector<BackupEntryHandle>	m_order;
+	std::vector<HashSlot>			m_slots;		// Power of two sized, linear probing
+	size_t							m_usedSlots = 0;
+};
+
+#endif // BACKUPINDEX_H
@@ -0,0 +1,140 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+// Fixed capacity lock-free queue (Vyukov style ring of sequenced cells). Any number of threads may push
+// and pop concurrently; a push never blocks and fails when the ring is full so the caller decides how to
+// apply backpressure. Capacity is rounded up to a power of two.
+template<class T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t requestedCapacity)
+	{
+		size_t capacity = 2;
+		while (capacity < requestedCapacity)
+		{
+			capacity <<= 1;
+		}
+
+		cells = std::make_unique<Cell[]>(capacity);
+		capacityMask = capacity - 1;
+
+		for (size_t cellIndex = 0; cellIndex < capacity; ++cellIndex)
+		{
+			cells[cellIndex].sequence.store(cellIndex, std::memory_order_relaxed);
+		}
+	}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	bool TryPush(T&& value)
+	{
+		size_t position = enqueuePos.load(std::memory_order_relaxed);
+		Cell* cell = nullptr;
+
+		while (true)
+		{
+			cell = &cells[position & capacityMask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+			if (difference == 0)
+			{
+				if (enqueuePos.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (difference < 0)
+			{
+				rejectedCount.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			else
+			{
+				position = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		// Counted before the cell is published, so the consumer that pops it can never take the count
+		// below zero
+		size_t depth = queuedCount.fetch_add(1) + 1;
+
+		cell->value = std::move(value);
+		cell->sequence.store(position + 1, std::memory_order_release);
+
+		pushedCount.fetch_add(1, std::memory_order_relaxed);
+
+		size_t highWater = highWaterCount.load(std::memory_order_relaxed);
+		while (depth > highWater && !highWaterCount.compare_exchange_weak(highWater, depth, std::memory_order_relaxed))
+		{
+		}
+
+		return true;
+	}
+
+	bool TryPop(T& outValue)
+	{
+		size_t position = dequeuePos.load(std::memory_order_relaxed);
+		Cell* cell = nullptr;
+
+		while (true)
+		{
+			cell = &cells[position & capacityMask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+			if (difference == 0)
+			{
+				if (dequeuePos.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (difference < 0)
+			{
+				return false;
+			}
+			else
+			{
+				position = dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		outValue = std::move(cell->value);
+		cell->value = T();
+		cell->sequence.store(position + capacityMask + 1, std::memory_order_release);
+
+		queuedCount.fetch_sub(1);
+		return true;
+	}
+
+	// Number of items pushed but not yet popped. Sequentially consistent so it can be paired with a
+	// sleeper count to decide whether a consumer needs waking.
+	size_t		Depth() const			{ return queuedCount.load(); }
+	size_t		Capacity() const		{ return capacityMask + 1; }
+	size_t		HighWater() const		{ return highWaterCount.load(std::memory_order_relaxed); }
+	uint64_t	PushedCount() const		{ return pushedCount.load(std::memory_order_relaxed); }
+	uint64_t	RejectedCount() const	{ return rejectedCount.load(std::memory_order_relaxed); }
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t>	sequence = 0;
+		T					value = {};
+	};
+
+	// Producer and consumer cursors live on separate cache lines so they don't false share
+	alignas(64) std::atomic<size_t>		enqueuePos = 0;
+	alignas(64) std::atomic<size_t>		dequeuePos = 0;
+	alignas(64) std::atomic<size_t>		queuedCount = 0;
+	std::atomic<size_t>					highWaterCount = 0;
+	std::atomic<uint64_t>				pushedCount = 0;
+	std::atomic<uint64_t>				rejectedCount = 0;
+
+	std::unique_ptr<Cell[]>				cells;
+	size_t								capacityMask = 0;
+};
+
+#endif // BOUNDEDQUEUE_H
@@ -0,0 +1,479 @@
+#include "main.h"
+#include "compressedstore.h"
+#include "contenthash.h"
+#include "copyengine.h"
+#include "iothrottle.h"
+#include "util.h"
+
+#include <cstring>
+#include <fstream>
+
+static constexpr size_t		kCompressionBlockSize = 256 * 1024;
+static constexpr uint32_t	kCompressedFormatVersion = 1;
+static constexpr char		kCompressedMagic[8] = { 'L', 'S', 'C', 'B', 'L', 'O', 'C', 'K' };
+
+// Set in a block's size word when the block is stored uncompressed
+static constexpr uint32_t	kStoredRawFlag = 0x80000000u;
+
+// The first block has to shrink by at least 1/kMinSavingDivisor for the file to be stored compressed
+static constexpr size_t		kMinSavingDivisor = 16;
+
+// LZ4 block format parameters
+static constexpr uint32_t	kLz4HashLog = 14;
+static constexpr size_t		kLz4MinMatch = 4;
+static constexpr size_t		kLz4LastLiterals = 5;		// The block always ends with this many literals
+static constexpr size_t		kLz4MatchStartLimit = 12;	// and no match starts within this many bytes of its end
+static constexpr size_t		kLz4MaxOffset = 65535;
+
+static const wchar_t* const kIncompressibleExtensions[] =
+{
+	L".7z", L".apk", L".avi", L".bz2", L".cab", L".docx", L".flac", L".gif", L".gz", L".heic", L".jar",
+	L".jpeg", L".jpg", L".lz4", L".m4a", L".mkv", L".mov", L".mp3", L".mp4", L".nupkg", L".ogg", L".pdb",
+	L".png", L".pptx", L".rar", L".tgz", L".webm", L".webp", L".whl", L".xlsx", L".xz", L".zip", L".zst",
+};
+
+struct CompressedFileHeader
+{
+	char		magic[8];
+	uint32_t	formatVersion;
+	uint32_t	blockSize;
+	uint64_t	contentSize;
+	uint64_t	contentHash;
+};
+
+std::fs::path MakeCompressedBackupPath(const std::fs::path& backupPath)
+{
+	std::fs::path compressedPath = backupPath;
+	compressedPath += kCompressedFileExtension;
+	return compressedPath;
+}
+
+bool IsWorthCompressing(const std::fs::path& originalPath)
+{
+	std::wstring extension = ToLower(originalPath.extension().wstring());
+
+	for (const wchar_t* incompressibleExtension : kIncompressibleExtensions)
+	{
+		if (extension == incompressibleExtension)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------------------------------
+// LZ4 block codec
+//-----------------------------------------------------------------------------------------------------
+
+static uint32_t Read32(const uint8_t* data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static size_t Lz4CompressBound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+static uint8_t* WriteLz4Length(uint8_t* out, size_t length)
+{
+	while (length >= 255)
+	{
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = (uint8_t)length;
+	return out;
+}
+
+// out must hold Lz4CompressBound(size) bytes. Returns the compressed size.
+static size_t Lz4CompressBlock(const uint8_t* data, size_t size, uint8_t* out)
+{
+	std::vector<uint32_t> positionsByHash((size_t)1 << kLz4HashLog, 0);
+
+	uint8_t* outCursor = out;
+	size_t literalStart = 0;
+	size_t position = 0;
+
+	auto emitSequence = [&](size_t literalLength, size_t matchOffset, size_t matchLength)
+	{
+		uint8_t* token = outCursor++;
+		*token = (uint8_t)((literalLength >= 15 ? 15 : literalLength) << 4);
+
+		if (literalLength >= 15)
+		{
+			outCursor = WriteLz4Length(outCursor, literalLength - 15);
+		}
+
+		memcpy(outCursor, data + literalStart, literalLength);
+		outCursor += literalLength;
+
+		if (matchLength == 0)
+		{
+			return;
+		}
+
+		*outCursor++ = (uint8_t)(matchOffset & 0xff);
+		*outCursor++ = (uint8_t)(matchOffset >> 8);
+
+		size_t matchCode = matchLength - kLz4MinMatch;
+		*token |= (uint8_t)(matchCode >= 15 ? 15 : matchCode);
+
+		if (matchCode >= 15)
+		{
+			outCursor = WriteLz4Length(outCursor, matchCode - 15);
+		}
+	};
+
+	if (size > kLz4MatchStartLimit)
+	{
+		size_t matchStartEnd = size - kLz4MatchStartLimit;
+		size_t matchEnd = size - kLz4LastLiterals;
+
+		while (position < matchStartEnd)
+		{
+			uint32_t sequence = Read32(data + position);
+			uint32_t hash = (sequence * 2654435761u) >> (32 - kLz4HashLog);
+
+			size_t candidate = positionsByHash[hash];
+			positionsByHash[hash] = (uint32_t)position;
+
+			if (candidate >= position || position - candidate > kLz4MaxOffset || Read32(data + candidate) != sequence)
+			{
+				// Step further the longer nothing matched, so incompressible data is skimmed quickly
+				position += 1 + ((position - literalStart) >> 6);
+				continue;
+			}
+
+			while (position > literalStart && candidate > 0 && data[position - 1] == data[candidate - 1])
+			{
+				--position;
+				--candidate;
+			}
+
+			size_t matchLength = kLz4MinMatch;
+			while (position + matchLength < matchEnd && data[position + matchLength] == data[candidate + matchLength])
+			{
+				++matchLength;
+			}
+
+			emitSequence(position - literalStart, position - candidate, matchLength);
+
+			position += matchLength;
+			literalStart = position;
+		}
+	}
+
+	emitSequence(size - literalStart, 0, 0);
+	return (size_t)(outCursor - out);
+}
+
+static bool ReadLz4Length(const uint8_t*& cursor, const uint8_t* end, size_t& inOutLength)
+{
+	uint8_t byte = 0;
+
+	do
+	{
+		if (cursor == end)
+		{
+			return false;
+		}
+
+		byte = *cursor++;
+		inOutLength += byte;
+	}
+	while (byte == 255);
+
+	return true;
+}
+
+static bool Lz4DecompressBlock(const uint8_t* data, size_t size, uint8_t* out, size_t outSize)
+{
+	const uint8_t* cursor = data;
+	const uint8_t* end = data + size;
+	size_t outPosition = 0;
+
+	while (cursor < end)
+	{
+		uint8_t token = *cursor++;
+
+		size_t literalLength = token >> 4;
+		if (literalLength == 15 && !ReadLz4Length(cursor, end, literalLength))
+		{
+			return false;
+		}
+
+		if (literalLength > (size_t)(end - cursor) || literalLength > outSize - outPosition)
+		{
+			return false;
+		}
+
+		memcpy(out + outPosition, cursor, literalLength);
+		cursor += literalLength;
+		outPosition += literalLength;
+
+		// The last sequence has no match
+		if (cursor == end)
+		{
+			break;
+		}
+
+		if (end - cursor < 2)
+		{
+			return false;
+		}
+
+		size_t matchOffset = (size_t)cursor[0] | ((size_t)cursor[1] << 8);
+		cursor += 2;
+
+		size_t matchLength = token & 15;
+		if (matchLength == 15 && !ReadLz4Length(cursor, end, matchLength))
+		{
+			return false;
+		}
+		matchLength += kLz4MinMatch;
+
+		if (matchOffset == 0 || matchOffset > outPosition || matchLength > outSize - outPosition)
+		{
+			return false;
+		}
+
+		uint8_t* matchDestination = out + outPosition;
+		const uint8_t* matchSource = matchDestination - matchOffset;
+
+		if (matchOffset >= matchLength)
+		{
+			memcpy(matchDestination, matchSource, matchLength);
+		}
+		else
+		{
+			// Overlapping match repeats the last matchOffset bytes
+			for (size_t byteIndex = 0; byteIndex < matchLength; ++byteIndex)
+			{
+				matchDestination[byteIndex] = matchSource[byteIndex];
+			}
+		}
+
+		outPosition += matchLength;
+	}
+
+	return outPosition == outSize;
+}
+
+//-----------------------------------------------------------------------------------------------------
+// Container
+//-----------------------------------------------------------------------------------------------------
+
+static bool ReadCompressedHeader(std::ifstream& stream, CompressedFileHeader& outHeader)
+{
+	stream.read((char*)&outHeader, sizeof(outHeader));
+
+	return stream.gcount() == (std::streamsize)sizeof(outHeader)
+		&& memcmp(outHeader.magic, kCompressedMagic, sizeof(kCompressedMagic)) == 0
+		&& outHeader.formatVersion == kCompressedFormatVersion
+		&& outHeader.blockSize > 0 && outHeader.blockSize <= kCompressionBlockSize;
+}
+
+bool StoreBackupCompressed(const std::fs::path& sourcePath, const std::fs::path& backupPath, uint64_t& outContentHash, bool& outStoredCompressed, uint64_t& outStoredBytes)
+{
+	outStoredCompressed = false;
+	outStoredBytes = 0;
+
+	std::error_code errorCode;
+	std::fs::path compressedPath = MakeCompressedBackupPath(backupPath);
+
+	std::fs::file_time_type sourceWriteTime = std::fs::last_write_time(sourcePath, errorCode);
+	if (errorCode)
+	{
+		return false;
+	}
+
+	std::vector<uint8_t> block(kCompressionBlockSize);
+	std::vector<uint8_t> compressedBlock(Lz4CompressBound(kCompressionBlockSize));
+	ContentHasher hasher;
+	bool isCompressedWritten = false;
+
+	{
+		std::ifstream sourceStream(sourcePath, std::ios::binary);
+		if (!sourceStream.is_open())
+		{
+			return false;
+		}
+
+		std::ofstream compressedStream;
+
+		CompressedFileHeader header = {};
+		memcpy(header.magic, kCompressedMagic, sizeof(kCompressedMagic));
+		header.formatVersion = kCompressedFormatVersion;
+		header.blockSize = (uint32_t)kCompressionBlockSize;
+
+		for (uint64_t blockIndex = 0; ; ++blockIndex)
+		{
+			sourceStream.read((char*)block.data(), (std::streamsize)block.size());
+			size_t blockSize = (size_t)sourceStream.gcount();
+
+			if (sourceStream.bad())
+			{
+				return false;
+			}
+
+			if (blockSize == 0)
+			{
+				break;
+			}
+
+			hasher.Update(block.data(), blockSize);
+			header.contentSize += blockSize;
+
+			size_t compressedSize = Lz4CompressBlock(block.data(), blockSize, compressedBlock.data());
+
+			if (blockIndex == 0)
+			{
+				// Judge the file by its first block, it isn't worth decompressing on every read for a few percent
+				if (compressedSize > blockSize - blockSize / kMinSavingDivisor)
+				{
+					break;
+				}
+
+				compressedStream.open(compressedPath, std::ios::binary | std::ios::trunc);
+				if (!compressedStream.is_open())
+				{
+					return false;
+				}
+
+				compressedStream.write((const char*)&header, sizeof(header));
+				isCompressedWritten = true;
+			}
+
+			// Charged once it is known to be written here; an incompressible first block goes through the
+			// plain copy below instead, which charges the whole file itself
+			ThrottleBackupBytes(blockSize);
+
+			uint32_t sizeWord = (uint32_t)compressedSize;
+			const uint8_t* blockData = compressedBlock.data();
+
+			if (compressedSize >= blockSize)
+			{
+				sizeWord = (uint32_t)blockSize | kStoredRawFlag;
+				blockData = block.data();
+				compressedSize = blockSize;
+			}
+
+			compressedStream.write((const char*)&sizeWord, sizeof(sizeWord));
+			compressedStream.write((const char*)blockData, (std::streamsize)compressedSize);
+		}
+
+		if (isCompressedWritten)
+		{
+			// Size and hash are only known now
+			header.contentHash = hasher.Finish();
+			compressedStream.seekp(0);
+			compressedStream.write((const char*)&header, sizeof(header));
+			compressedStream.flush();
+
+			if (!compressedStream)
+			{
+				compressedStream.close();
+				std::fs::remove(compressedPath, errorCode);
+				return false;
+			}
+
+			outContentHash = header.contentHash;
+		}
+	}
+
+	if (!isCompressedWritten)
+	{
+		std::fs::remove(compressedPath, errorCode);
+		if (!CopyFileFast(sourcePath, backupPath, nullptr, &outContentHash))
+		{
+			return false;
+		}
+
+		outStoredBytes = (uint64_t)std::fs::file_size(backupPath, errorCode);
+		return true;
+	}
+
+	// A retried copy may have left a plain copy from an earlier attempt
+	std::fs::remove(backupPath, errorCode);
+	std::fs::last_write_time(compressedPath, sourceWriteTime, errorCode);
+
+	outStoredCompressed = true;
+	outStoredBytes = (uint64_t)std::fs::file_size(compressedPath, errorCode);
+	return true;
+}
+
+bool GetCompressedBackupInfo(const std::fs::path& compressedPath, uint64_t& outContentSize, uint64_t& outContentHash)
+{
+	std::ifstream stream(compressedPath, std::ios::binary);
+	CompressedFileHeader header = {};
+
+	if (!stream.is_open() || !ReadCompressedHeader(stream, header))
+	{
+		return false;
+	}
+
+	outContentSize = header.contentSize;
+	outContentHash = header.contentHash;
+	return true;
+}
+
+bool ReadCompressedBackup(const std::fs::path& compressedPath, std::vector<uint8_t>& outContents)
+{
+	std::ifstream stream(compressedPath, std::ios::binary);
+	CompressedFileHeader header = {};
+
+	if (!stream.is_open() || !ReadCompressedHeader(stream, header))
+	{
+		return false;
+	}
+
+	outContents.resize((size_t)header.contentSize);
+
+	std::vector<uint8_t> compressedBlock(Lz4CompressBound(header.blockSize));
+	uint64_t outPosition = 0;
+
+	while (outPosition < header.contentSize)
+	{
+		uint32_t sizeWord = 0;
+		stream.read((char*)&sizeWord, sizeof(sizeWord));
+
+		if (stream.gcount() != (std::streamsize)sizeof(sizeWord))
+		{
+			return false;
+		}
+
+		bool isRaw = (sizeWord & kStoredRawFlag) != 0;
+		size_t storedSize = sizeWord & ~kStoredRawFlag;
+		size_t blockSize = (size_t)(std::min)((uint64_t)header.blockSize, header.contentSize - outPosition);
+
+		if (storedSize > compressedBlock.size() || (isRaw && storedSize != blockSize))
+		{
+			return false;
+		}
+
+		stream.read((char*)compressedBlock.data(), (std::streamsize)storedSize);
+
+		if ((size_t)stream.gcount() != storedSize)
+		{
+			return false;
+		}
+
+		if (isRaw)
+		{
+			memcpy(outContents.data() + outPosition, compressedBlock.data(), blockSize);
+		}
+		else if (!Lz4DecompressBlock(compressedBlock.data(), storedSize, outContents.data() + outPosition, blockSize))
+		{
+			return false;
+		}
+
+		outPosition += blockSize;
+	}
+
+	return HashBytes(outContents.data(), outContents.size()) == header.contentHash;
+}
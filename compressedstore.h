@@ -0,0 +1,28 @@
+#ifndef COMPRESSEDSTORE_H
+#define COMPRESSEDSTORE_H
+
+// Compressed backup versions. A version can be stored as <backup path>.lscz: the file split into
+// independent 256 KB blocks, each compressed with an LZ4 block format codec (a block that doesn't
+// shrink is kept raw). LZ4 decodes at memory speed, so opening or diffing a compressed version costs
+// little more than reading a plain one. Already compressed formats are recognised by extension and
+// copied as they are.
+
+static constexpr const wchar_t*	kCompressedFileExtension = L".lscz";
+
+std::fs::path	MakeCompressedBackupPath(const std::fs::path& backupPath);
+
+// False for formats that are compressed already (images, archives, media, ...)
+bool			IsWorthCompressing(const std::fs::path& originalPath);
+
+// Stores sourcePath as the version at backupPath, compressed if its first block shrinks enough and as
+// a plain copy otherwise. The stored file keeps the source's write time. outContentHash is the
+// ContentHasher hash of the uncompressed bytes.
+bool			StoreBackupCompressed(const std::fs::path& sourcePath, const std::fs::path& backupPath, uint64_t& outContentHash, bool& outStoredCompressed, uint64_t& outStoredBytes);
+
+// Uncompressed size and hash recorded in a .lscz file
+bool			GetCompressedBackupInfo(const std::fs::path& compressedPath, uint64_t& outContentSize, uint64_t& outContentHash);
+
+// Decompresses a .lscz file, checking the result against its recorded size and hash
+bool			ReadCompressedBackup(const std::fs::path& compressedPath, std::vector<uint8_t>& outContents);
+
+#endif // COMPRESSEDSTORE_H
@@ -0,0 +1,384 @@
+#include "main.h"
+#include "contenthash.h"
+
+#include <cstring>
+#include <fstream>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define CONTENTHASH_X64 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CONTENTHASH_TARGET_AVX2
+#else
+#define CONTENTHASH_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define CONTENTHASH_NEON 1
+#include <arm_neon.h>
+#endif
+
+static constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+static constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+static constexpr uint64_t kPrime3 = 0x165667B19E3779F9ull;
+
+// Stripes accumulated per lane before the lanes are scrambled, so long inputs keep mixing
+static constexpr uint32_t kStripesPerScramble = 16;
+
+static constexpr size_t kHashReadChunkSize = 1024 * 1024;
+
+static inline uint64_t RotateLeft(uint64_t value, uint32_t bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t ReadU64(const uint8_t* data)
+{
+	uint64_t value = 0;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static inline uint64_t LaneKey(size_t laneIndex)
+{
+	return kPrime3 * (uint64_t)(laneIndex + 1);
+}
+
+static inline uint64_t Avalanche(uint64_t value)
+{
+	value ^= value >> 33;
+	value *= kPrime2;
+	value ^= value >> 29;
+	value *= kPrime3;
+	value ^= value >> 32;
+	return value;
+}
+
+// Each lane accumulates the product of the two 32 bit halves of its keyed input, and the raw input is
+// also added to the neighbouring lane so every byte ends up affecting two lanes. The vector versions
+// below do exactly the same arithmetic, so every path produces the same hash.
+static void AccumulateStripesScalar(uint64_t* lanes, const uint8_t* data, size_t stripeCount)
+{
+	for (size_t stripeIndex = 0; stripeIndex < stripeCount; ++stripeIndex)
+	{
+		const uint8_t* stripe = data + stripeIndex * ContentHasher::kStripeSize;
+
+		for (size_t laneIndex = 0; laneIndex < ContentHasher::kLaneCount; ++laneIndex)
+		{
+			uint64_t input = ReadU64(stripe + laneIndex * sizeof(uint64_t));
+			uint64_t keyed = input ^ LaneKey(laneIndex);
+
+			lanes[laneIndex ^ 1] += input;
+			lanes[laneIndex] += (keyed & 0xFFFFFFFFull) * (keyed >> 32);
+		}
+	}
+}
+
+#if defined(CONTENTHASH_X64)
+
+static void AccumulateStripesSse2(uint64_t* lanes, const uint8_t* data, size_t stripeCount)
+{
+	static constexpr size_t kVectorCount = ContentHasher::kStripeSize / sizeof(__m128i);
+
+	__m128i accumulators[kVectorCount];
+	__m128i keys[kVectorCount];
+
+	for (size_t vectorIndex = 0; vectorIndex < kVectorCount; ++vectorIndex)
+	{
+		accumulators[vectorIndex] = _mm_loadu_si128((const __m128i*)(lanes + vectorIndex * 2));
+		keys[vectorIndex] = _mm_set_epi64x((long long)LaneKey(vectorIndex * 2 + 1), (long long)LaneKey(vectorIndex * 2));
+	}
+
+	for (size_t stripeIndex = 0; stripeIndex < stripeCount; ++stripeIndex)
+	{
+		const uint8_t* stripe = data + stripeIndex * ContentHasher::kStripeSize;
+
+		for (size_t vectorIndex = 0; vectorIndex < kVectorCount; ++vectorIndex)
+		{
+			__m128i input = _mm_loadu_si128((const __m128i*)(stripe + vectorIndex * sizeof(__m128i)));
+			__m128i keyed = _mm_xor_si128(input, keys[vectorIndex]);
+			__m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+			__m128i swapped = _mm_shuffle_epi32(input, _MM_SHUFFLE(1, 0, 3, 2));
+
+			accumulators[vectorIndex] = _mm_add_epi64(accumulators[vectorIndex], _mm_add_epi64(product, swapped));
+		}
+	}
+
+	for (size_t vectorIndex = 0; vectorIndex < kVectorCount; ++vectorIndex)
+	{
+		_mm_storeu_si128((__m128i*)(lanes + vectorIndex * 2), accumulators[vectorIndex]);
+	}
+}
+
+CONTENTHASH_TARGET_AVX2 static void AccumulateStripesAvx2(uint64_t* lanes, const uint8_t* data, size_t stripeCount)
+{
+	static constexpr size_t kVectorCount = ContentHasher::kStripeSize / sizeof(__m256i);
+
+	__m256i accumulators[kVectorCount];
+	__m256i keys[kVectorCount];
+
+	for (size_t vectorIndex = 0; vectorIndex < kVectorCount; ++vectorIndex)
+	{
+		accumulators[vectorIndex] = _mm256_loadu_si256((const __m256i*)(lanes + vectorIndex * 4));
+		keys[vectorIndex] = _mm256_set_epi64x(
+			(long long)LaneKey(vectorIndex * 4 + 3), (long long)LaneKey(vectorIndex * 4 + 2),
+			(long long)LaneKey(vectorIndex * 4 + 1), (long long)LaneKey(vectorIndex * 4));
+	}
+
+	for (size_t stripeIndex = 0; stripeIndex < stripeCount; ++stripeIndex)
+	{
+		const uint8_t* stripe = data + stripeIndex * ContentHasher::kStripeSize;
+
+		for (size_t vectorIndex = 0; vectorIndex < kVectorCount; ++vectorIndex)
+		{
+			__m256i input = _mm256_loadu_si256((const __m256i*)(stripe + vectorIndex * sizeof(__m256i)));
+			__m256i keyed = _mm256_xor_si256(input, keys[vectorIndex]);
+			__m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+			__m256i swapped = _mm256_shuffle_epi32(input, _MM_SHUFFLE(1, 0, 3, 2));
+
+			accumulators[vectorIndex] = _mm256_add_epi64(accumulators[vectorIndex], _mm256_add_epi64(product, swapped));
+		}
+	}
+
+	for (size_t vectorIndex = 0; vectorIndex < kVectorCount; ++vectorIndex)
+	{
+		_mm256_storeu_si256((__m256i*)(lanes + vectorIndex * 4), accumulators[vectorIndex]);
+	}
+}
+
+static bool CpuSupportsAvx2()
+{
+#if defined(_MSC_VER)
+	int cpuInfo[4] = {};
+
+	__cpuid(cpuInfo, 0);
+	if (cpuInfo[0] < 7)
+	{
+		return false;
+	}
+
+	// The OS has to save the YMM registers as well
+	__cpuid(cpuInfo, 1);
+	bool hasOsxsave = (cpuInfo[2] & (1 << 27)) != 0;
+	if (!hasOsxsave || (_xgetbv(0) & 0x6) != 0x6)
+	{
+		return false;
+	}
+
+	__cpuidex(cpuInfo, 7, 0);
+	return (cpuInfo[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#elif defined(CONTENTHASH_NEON)
+
+static void AccumulateStripesNeon(uint64_t* lanes, const uint8_t* data, size_t stripeCount)
+{
+	static constexpr size_t kVectorCount = ContentHasher::kStripeSize / sizeof(uint64x2_t);
+
+	uint64x2_t accumulators[kVectorCount];
+	uint64x2_t keys[kVectorCount];
+
+	for (size_t vectorIndex = 0; vectorIndex < kVectorCount; ++vectorIndex)
+	{
+		uint64_t laneKeys[2] = { LaneKey(vectorIndex * 2), LaneKey(vectorIndex * 2 + 1) };
+		accumulators[vectorIndex] = vld1q_u64(lanes + vectorIndex * 2);
+		keys[vectorIndex] = vld1q_u64(laneKeys);
+	}
+
+	for (size_t stripeIndex = 0; stripeIndex < stripeCount; ++stripeIndex)
+	{
+		const uint8_t* stripe = data + stripeIndex * ContentHasher::kStripeSize;
+
+		for (size_t vectorIndex = 0; vectorIndex < kVectorCount; ++vectorIndex)
+		{
+			uint64x2_t input = vreinterpretq_u64_u8(vld1q_u8(stripe + vectorIndex * sizeof(uint64x2_t)));
+			uint64x2_t keyed = veorq_u64(input, keys[vectorIndex]);
+			uint64x2_t product = vmull_u32(vmovn_u64(keyed), vshrn_n_u64(keyed, 32));
+			uint64x2_t swapped = vextq_u64(input, input, 1);
+
+			accumulators[vectorIndex] = vaddq_u64(accumulators[vectorIndex], vaddq_u64(product, swapped));
+		}
+	}
+
+	for (size_t vectorIndex = 0; vectorIndex < kVectorCount; ++vectorIndex)
+	{
+		vst1q_u64(lanes + vectorIndex * 2, accumulators[vectorIndex]);
+	}
+}
+
+#endif
+
+typedef void (*AccumulateStripesFunction)(uint64_t* lanes, const uint8_t* data, size_t stripeCount);
+
+struct HashImplementation
+{
+	AccumulateStripesFunction	accumulate = AccumulateStripesScalar;
+	const char*					name = "scalar";
+};
+
+static HashImplementation SelectHashImplementation()
+{
+	HashImplementation implementation = {};
+
+#if defined(CONTENTHASH_X64)
+	if (CpuSupportsAvx2())
+	{
+		implementation.accumulate = AccumulateStripesAvx2;
+		implementation.name = "AVX2";
+	}
+	else
+	{
+		implementation.accumulate = AccumulateStripesSse2;
+		implementation.name = "SSE2";
+	}
+#elif defined(CONTENTHASH_NEON)
+	implementation.accumulate = AccumulateStripesNeon;
+	implementation.name = "NEON";
+#endif
+
+	return implementation;
+}
+
+static const HashImplementation& GetHashImplementation()
+{
+	static const HashImplementation implementation = SelectHashImplementation();
+	return implementation;
+}
+
+const char* GetContentHashImplementationName()
+{
+	return GetHashImplementation().name;
+}
+
+ContentHasher::ContentHasher()
+{
+	for (size_t laneIndex = 0; laneIndex < kLaneCount; ++laneIndex)
+	{
+		lanes[laneIndex] = kPrime1 ^ LaneKey(laneIndex);
+	}
+}
+
+void ContentHasher::ConsumeStripes(const uint8_t* data, size_t stripeCount)
+{
+	AccumulateStripesFunction accumulate = GetHashImplementation().accumulate;
+
+	while (stripeCount > 0)
+	{
+		// Accumulate up to the next scramble point in one vectorised run
+		size_t runStripes = (std::min)(stripeCount, (size_t)(kStripesPerScramble - stripesSinceScramble));
+		accumulate(lanes, data, runStripes);
+
+		data += runStripes * kStripeSize;
+		stripeCount -= runStripes;
+		stripesSinceScramble += (uint32_t)runStripes;
+
+		if (stripesSinceScramble == kStripesPerScramble)
+		{
+			stripesSinceScramble = 0;
+
+			for (size_t laneIndex = 0; laneIndex < kLaneCount; ++laneIndex)
+			{
+				uint64_t lane = lanes[laneIndex];
+				lane ^= lane >> 47;
+				lane ^= LaneKey(laneIndex);
+				lanes[laneIndex] = lane * kPrime1;
+			}
+		}
+	}
+}
+
+void ContentHasher::Update(const void* data, size_t size)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	totalSize += size;
+
+	if (pendingSize > 0)
+	{
+		size_t fillSize = (std::min)(size, kStripeSize - pendingSize);
+		memcpy(pendingBytes + pendingSize, bytes, fillSize);
+		pendingSize += fillSize;
+		bytes += fillSize;
+		size -= fillSize;
+
+		if (pendingSize < kStripeSize)
+		{
+			return;
+		}
+
+		ConsumeStripes(pendingBytes, 1);
+		pendingSize = 0;
+	}
+
+	size_t stripeCount = size / kStripeSize;
+	ConsumeStripes(bytes, stripeCount);
+
+	size_t tailSize = size - stripeCount * kStripeSize;
+	memcpy(pendingBytes, bytes + stripeCount * kStripeSize, tailSize);
+	pendingSize = tailSize;
+}
+
+uint64_t ContentHasher::Finish() const
+{
+	// Work on a copy so Finish can be called mid stream
+	ContentHasher finalState = *this;
+
+	if (finalState.pendingSize > 0)
+	{
+		uint8_t lastStripe[kStripeSize] = {};
+		memcpy(lastStripe, finalState.pendingBytes, finalState.pendingSize);
+		finalState.ConsumeStripes(lastStripe, 1);
+	}
+
+	uint64_t result = totalSize * kPrime1;
+
+	for (size_t laneIndex = 0; laneIndex < kLaneCount; laneIndex += 2)
+	{
+		uint64_t left = finalState.lanes[laneIndex] ^ LaneKey(laneIndex);
+		uint64_t right = finalState.lanes[laneIndex + 1] ^ LaneKey(laneIndex + 1);
+		result += (RotateLeft(left, 31) * kPrime2) ^ right;
+		result = RotateLeft(result, 27) * kPrime1;
+	}
+
+	return Avalanche(result);
+}
+
+uint64_t HashBytes(const void* data, size_t size)
+{
+	ContentHasher hasher;
+	hasher.Update(data, size);
+	return hasher.Finish();
+}
+
+bool HashFileContents(const std::fs::path& filePath, uint64_t& outHash)
+{
+	std::ifstream stream(filePath, std::ios::binary);
+	if (!stream.is_open())
+	{
+		return false;
+	}
+
+	std::vector<char> chunk(kHashReadChunkSize);
+	ContentHasher hasher;
+
+	while (stream)
+	{
+		stream.read(chunk.data(), (std::streamsize)chunk.size());
+		std::streamsize bytesRead = stream.gcount();
+
+		if (bytesRead > 0)
+		{
+			hasher.Update(chunk.data(), (size_t)bytesRead);
+		}
+	}
+
+	if (stream.bad())
+	{
+		return false;
+	}
+
+	outHash = hasher.Finish();
+	return true;
+}
@@ -0,0 +1,37 @@
+#ifndef CONTENTHASH_H
+#define CONTENTHASH_H
+
+// Fast non cryptographic 64 bit content hash, used to tell whether a file's bytes actually changed.
+// Input is consumed in 64 byte stripes across 8 independent lanes (in the style of XXH3), accumulated
+// with AVX2 or SSE2 on x64 and NEON on ARM64 (picked at runtime, scalar otherwise). Every path gives the
+// same result, which only depends on the bytes, never on how they were split across Update calls.
+class ContentHasher
+{
+public:
+	static constexpr size_t kStripeSize = 64;
+	static constexpr size_t kLaneCount = kStripeSize / sizeof(uint64_t);
+
+	ContentHasher();
+
+	void		Update(const void* data, size_t size);
+	uint64_t	Finish() const;
+
+private:
+	void		ConsumeStripes(const uint8_t* data, size_t stripeCount);
+
+	uint64_t	lanes[kLaneCount] = {};
+	uint8_t		pendingBytes[kStripeSize] = {};
+	size_t		pendingSize = 0;
+	uint32_t	stripesSinceScramble = 0;
+	uint64_t	totalSize = 0;
+};
+
+uint64_t	HashBytes(const void* data, size_t size);
+
+// Name of the accumulate path in use ("AVX2", "SSE2", "NEON" or "scalar")
+const char*	GetContentHashImplementationName();
+
+// Streams the file through a ContentHasher. Returns false if it couldn't be opened or read.
+bool		HashFileContents(const std::fs::path& filePath, uint64_t& outHash);
+
+#endif // CONTENTHASH_H
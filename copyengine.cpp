@@ -0,0 +1,572 @@
+#include "main.h"
+#include "copyengine.h"
+#include "contenthash.h"
+#include "iothrottle.h"
+
+#if defined(_WIN32)
+#include <winioctl.h>
+#elif defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+enum class CopyAttempt
+{
+	Copied,
+	Unsupported,	// The strategy can't work between these devices, try the next one
+	Failed,			// The copy itself failed (missing file, access denied, disk full...)
+};
+
+static std::atomic<uint64_t>						g_copyStrategyCounts[(size_t)CopyStrategy::Count] = {};
+
+// Strategies found not to work, per (source device, destination device), as a bit per CopyStrategy
+static std::mutex									g_unsupportedStrategiesMutex;
+static std::map<std::pair<uint64_t, uint64_t>, uint32_t>	g_unsupportedStrategies;
+
+const char* GetCopyStrategyName(CopyStrategy strategy)
+{
+	switch (strategy)
+	{
+		case CopyStrategy::Clone:			return "clone";
+		case CopyStrategy::KernelCopy:		return "copy_file_range";
+		case CopyStrategy::SendFile:		return "sendfile";
+		case CopyStrategy::ReadWriteLoop:	return "read/write";
+		default:							return "?";
+	}
+}
+
+void GetCopyStrategyCounts(uint64_t (&outCounts)[(size_t)CopyStrategy::Count])
+{
+	for (size_t strategyIndex = 0; strategyIndex < (size_t)CopyStrategy::Count; ++strategyIndex)
+	{
+		outCounts[strategyIndex] = g_copyStrategyCounts[strategyIndex].load(std::memory_order_relaxed);
+	}
+}
+
+static constexpr size_t kCopyChunkSize = 1024 * 1024;
+static constexpr size_t kCopyBufferAlignment = 4096;
+
+struct AlignedBufferFree
+{
+	void operator()(uint8_t* buffer) const
+	{
+#if defined(_WIN32)
+		_aligned_free(buffer);
+#else
+		free(buffer);
+#endif
+	}
+};
+
+// One page aligned chunk buffer per copy thread, kept for the life of the thread
+static uint8_t* GetCopyBuffer()
+{
+#if defined(_WIN32)
+	thread_local std::unique_ptr<uint8_t, AlignedBufferFree> copyBuffer((uint8_t*)_aligned_malloc(kCopyChunkSize, kCopyBufferAlignment));
+#else
+	thread_local std::unique_ptr<uint8_t, AlignedBufferFree> copyBuffer((uint8_t*)aligned_alloc(kCopyBufferAlignment, kCopyChunkSize));
+#endif
+	return copyBuffer.get();
+}
+
+#if defined(_WIN32)
+
+static constexpr CopyStrategy kStrategyOrder[] = { CopyStrategy::Clone, CopyStrategy::ReadWriteLoop };
+
+// FSCTL_DUPLICATE_EXTENTS_TO_FILE is limited to just under 4 GB per call
+static constexpr uint64_t kCloneChunkSize = 1024ull * 1024 * 1024;
+
+static bool GetVolumeRoot(const std::fs::path& path, std::wstring& outVolumeRoot)
+{
+	wchar_t volumeRoot[MAX_PATH] = {};
+	if (!GetVolumePathNameW(path.c_str(), volumeRoot, (DWORD)std::size(volumeRoot)))
+	{
+		return false;
+	}
+
+	outVolumeRoot = volumeRoot;
+	return true;
+}
+
+static bool GetDeviceId(const std::fs::path& path, uint64_t& outDeviceId)
+{
+	std::wstring volumeRoot;
+	if (!GetVolumeRoot(path, volumeRoot))
+	{
+		return false;
+	}
+
+	DWORD volumeSerial = 0;
+	if (!GetVolumeInformationW(volumeRoot.c_str(), nullptr, 0, &volumeSerial, nullptr, nullptr, nullptr, 0))
+	{
+		return false;
+	}
+
+	outDeviceId = volumeSerial;
+	return true;
+}
+
+static bool IsUnsupportedCloneError(DWORD errorCode)
+{
+	return errorCode == ERROR_INVALID_FUNCTION || errorCode == ERROR_NOT_SUPPORTED || errorCode == ERROR_NOT_SAME_DEVICE
+		|| errorCode == ERROR_INVALID_PARAMETER || errorCode == ERROR_BLOCK_TOO_MANY_REFERENCES;
+}
+
+// ReFS block cloning: the destination shares the source's clusters until either side is written
+static CopyAttempt CloneFile(const std::fs::path& sourcePath, const std::fs::path& destinationPath)
+{
+	HANDLE sourceHandle = CreateFileW(sourcePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (sourceHandle == INVALID_HANDLE_VALUE)
+	{
+		return CopyAttempt::Failed;
+	}
+
+	DWORD fileSystemFlags = 0;
+	BY_HANDLE_FILE_INFORMATION sourceInfo = {};
+	std::wstring volumeRoot;
+	DWORD sectorsPerCluster = 0;
+	DWORD bytesPerSector = 0;
+	DWORD freeClusters = 0;
+	DWORD totalClusters = 0;
+
+	if (!GetVolumeInformationByHandleW(sourceHandle, nullptr, 0, nullptr, nullptr, &fileSystemFlags, nullptr, 0)
+		|| !(fileSystemFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING)
+		|| !GetFileInformationByHandle(sourceHandle, &sourceInfo)
+		|| !GetVolumeRoot(sourcePath, volumeRoot)
+		|| !GetDiskFreeSpaceW(volumeRoot.c_str(), &sectorsPerCluster, &bytesPerSector, &freeClusters, &totalClusters))
+	{
+		CloseHandle(sourceHandle);
+		return CopyAttempt::Unsupported;
+	}
+
+	HANDLE destinationHandle = CreateFileW(destinationPath.c_str(), GENERIC_READ | GENERIC_WRITE | DELETE, 0, nullptr, CREATE_ALWAYS, 0, nullptr);
+	if (destinationHandle == INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(sourceHandle);
+		return CopyAttempt::Failed;
+	}
+
+	uint64_t fileSize = ((uint64_t)sourceInfo.nFileSizeHigh << 32) | sourceInfo.nFileSizeLow;
+	uint64_t clusterSize = (uint64_t)sectorsPerCluster * bytesPerSector;
+	DWORD bytesReturned = 0;
+	CopyAttempt attempt = CopyAttempt::Copied;
+
+	// Both files have to agree on sparseness, and the destination must already be full size
+	if (sourceInfo.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)
+	{
+		DeviceIoControl(destinationHandle, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytesReturned, nullptr);
+	}
+
+	FILE_END_OF_FILE_INFO endOfFileInfo = {};
+	endOfFileInfo.EndOfFile.QuadPart = (LONGLONG)fileSize;
+	if (!SetFileInformationByHandle(destinationHandle, FileEndOfFileInfo, &endOfFileInfo, sizeof(endOfFileInfo)))
+	{
+		attempt = CopyAttempt::Failed;
+	}
+
+	for (uint64_t offset = 0; offset < fileSize && attempt == CopyAttempt::Copied; offset += kCloneChunkSize)
+	{
+		// Ranges are whole clusters, the last one may run past the end of file
+		uint64_t byteCount = (std::min)(kCloneChunkSize, fileSize - offset);
+		byteCount = (byteCount + clusterSize - 1) / clusterSize * clusterSize;
+
+		DUPLICATE_EXTENTS_DATA duplicateExtents = {};
+		duplicateExtents.FileHandle = sourceHandle;
+		duplicateExtents.SourceFileOffset.QuadPart = (LONGLONG)offset;
+		duplicateExtents.TargetFileOffset.QuadPart = (LONGLONG)offset;
+		duplicateExtents.ByteCount.QuadPart = (LONGLONG)byteCount;
+
+		if (!DeviceIoControl(destinationHandle, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &duplicateExtents, sizeof(duplicateExtents), nullptr, 0, &bytesReturned, nullptr))
+		{
+			attempt = IsUnsupportedCloneError(GetLastError()) ? CopyAttempt::Unsupported : CopyAttempt::Failed;
+		}
+	}
+
+	if (attempt == CopyAttempt::Copied)
+	{
+		SetFileTime(destinationHandle, nullptr, nullptr, &sourceInfo.ftLastWriteTime);
+	}
+	else
+	{
+		FILE_DISPOSITION_INFO dispositionInfo = {};
+		dispositionInfo.DeleteFile = TRUE;
+		SetFileInformationByHandle(destinationHandle, FileDispositionInfo, &dispositionInfo, sizeof(dispositionInfo));
+	}
+
+	CloseHandle(destinationHandle);
+	CloseHandle(sourceHandle);
+	return attempt;
+}
+
+// Replaces CopyFileW so the bytes can be hashed while they are in hand
+static CopyAttempt ReadWriteCopyFile(const std::fs::path& sourcePath, const std::fs::path& destinationPath, ContentHasher* hasher)
+{
+	uint8_t* copyBuffer = GetCopyBuffer();
+	if (!copyBuffer)
+	{
+		return CopyAttempt::Failed;
+	}
+
+	HANDLE sourceHandle = CreateFileW(sourcePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (sourceHandle == INVALID_HANDLE_VALUE)
+	{
+		return CopyAttempt::Failed;
+	}
+
+	BY_HANDLE_FILE_INFORMATION sourceInfo = {};
+	if (!GetFileInformationByHandle(sourceHandle, &sourceInfo))
+	{
+		CloseHandle(sourceHandle);
+		return CopyAttempt::Failed;
+	}
+
+	HANDLE destinationHandle = CreateFileW(destinationPath.c_str(), GENERIC_WRITE | DELETE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (destinationHandle == INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(sourceHandle);
+		return CopyAttempt::Failed;
+	}
+
+	// Reserve the whole file up front so it is laid out in as few extents as possible
+	FILE_ALLOCATION_INFO allocationInfo = {};
+	allocationInfo.AllocationSize.QuadPart = (LONGLONG)(((uint64_t)sourceInfo.nFileSizeHigh << 32) | sourceInfo.nFileSizeLow);
+	SetFileInformationByHandle(destinationHandle, FileAllocationInfo, &allocationInfo, sizeof(allocationInfo));
+
+	CopyAttempt attempt = CopyAttempt::Copied;
+
+	while (true)
+	{
+		DWORD bytesRead = 0;
+		if (!ReadFile(sourceHandle, copyBuffer, (DWORD)kCopyChunkSize, &bytesRead, nullptr))
+		{
+			attempt = CopyAttempt::Failed;
+			break;
+		}
+
+		if (bytesRead == 0)
+		{
+			break;
+		}
+
+		if (hasher)
+		{
+			hasher->Update(copyBuffer, bytesRead);
+		}
+
+		DWORD bytesWritten = 0;
+		if (!WriteFile(destinationHandle, copyBuffer, bytesRead, &bytesWritten, nullptr) || bytesWritten != bytesRead)
+		{
+			attempt = CopyAttempt::Failed;
+			break;
+		}
+
+		ThrottleBackupBytes(bytesRead);
+	}
+
+	if (attempt == CopyAttempt::Copied)
+	{
+		SetFileTime(destinationHandle, nullptr, nullptr, &sourceInfo.ftLastWriteTime);
+	}
+	else
+	{
+		FILE_DISPOSITION_INFO dispositionInfo = {};
+		dispositionInfo.DeleteFile = TRUE;
+		SetFileInformationByHandle(destinationHandle, FileDispositionInfo, &dispositionInfo, sizeof(dispositionInfo));
+	}
+
+	CloseHandle(destinationHandle);
+	CloseHandle(sourceHandle);
+	return attempt;
+}
+
+static CopyAttempt TryCopyStrategy(CopyStrategy strategy, const std::fs::path& sourcePath, const std::fs::path& destinationPath, ContentHasher* hasher)
+{
+	switch (strategy)
+	{
+		case CopyStrategy::Clone:			return CloneFile(sourcePath, destinationPath);
+		case CopyStrategy::ReadWriteLoop:	return ReadWriteCopyFile(sourcePath, destinationPath, hasher);
+		default:							return CopyAttempt::Unsupported;
+	}
+}
+
+#elif defined(__linux__)
+
+static constexpr CopyStrategy kStrategyOrder[] = { CopyStrategy::Clone, CopyStrategy::KernelCopy, CopyStrategy::SendFile, CopyStrategy::ReadWriteLoop };
+
+static bool GetDeviceId(const std::fs::path& path, uint64_t& outDeviceId)
+{
+	struct stat fileStat = {};
+	if (stat(path.c_str(), &fileStat) != 0)
+	{
+		return false;
+	}
+
+	outDeviceId = (uint64_t)fileStat.st_dev;
+	return true;
+}
+
+static bool IsUnsupportedCopyError(int errorNumber)
+{
+	return errorNumber == EOPNOTSUPP || errorNumber == ENOTTY || errorNumber == EXDEV || errorNumber == EINVAL || errorNumber == ENOSYS;
+}
+
+// Copies between already open descriptors. The destination is truncated first, so a strategy that gives
+// up half way leaves nothing behind for the next one.
+static CopyAttempt CopyOpenFiles(CopyStrategy strategy, int sourceFd, int destinationFd, uint64_t fileSize, ContentHasher* hasher)
+{
+	if (ftruncate(destinationFd, 0) != 0 || lseek(destinationFd, 0, SEEK_SET) != 0 || lseek(sourceFd, 0, SEEK_SET) != 0)
+	{
+		return CopyAttempt::Failed;
+	}
+
+	if (strategy == CopyStrategy::Clone)
+	{
+		if (ioctl(destinationFd, FICLONE, sourceFd) != 0)
+		{
+			return IsUnsupportedCopyError(errno) ? CopyAttempt::Unsupported : CopyAttempt::Failed;
+		}
+
+		return CopyAttempt::Copied;
+	}
+
+	if (strategy == CopyStrategy::KernelCopy || strategy == CopyStrategy::SendFile)
+	{
+		off_t sourceOffset = 0;
+		off_t destinationOffset = 0;
+
+		while ((uint64_t)sourceOffset < fileSize)
+		{
+			size_t chunkSize = (size_t)(std::min)(fileSize - (uint64_t)sourceOffset, (uint64_t)(64 * kCopyChunkSize));
+			ssize_t bytesCopied = (strategy == CopyStrategy::KernelCopy)
+				? copy_file_range(sourceFd, &sourceOffset, destinationFd, &destinationOffset, chunkSize, 0)
+				: sendfile(destinationFd, sourceFd, &sourceOffset, chunkSize);
+
+			if (bytesCopied < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				return IsUnsupportedCopyError(errno) ? CopyAttempt::Unsupported : CopyAttempt::Failed;
+			}
+
+			// The source shrank under us, what was copied is all there is
+			if (bytesCopied == 0)
+			{
+				break;
+			}
+
+			ThrottleBackupBytes((uint64_t)bytesCopied);
+		}
+
+		return CopyAttempt::Copied;
+	}
+
+	if (strategy == CopyStrategy::ReadWriteLoop)
+	{
+		// Reserve the whole file up front so it is laid out in as few extents as possible
+		if (fileSize > 0)
+		{
+			posix_fallocate(destinationFd, 0, (off_t)fileSize);
+		}
+
+		posix_fadvise(sourceFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		uint8_t* copyBuffer = GetCopyBuffer();
+		if (!copyBuffer)
+		{
+			return CopyAttempt::Failed;
+		}
+
+		uint64_t totalWritten = 0;
+		while (true)
+		{
+			ssize_t bytesRead = read(sourceFd, copyBuffer, kCopyChunkSize);
+			if (bytesRead < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				return CopyAttempt::Failed;
+			}
+
+			if (bytesRead == 0)
+			{
+				break;
+			}
+
+			if (hasher)
+			{
+				hasher->Update(copyBuffer, (size_t)bytesRead);
+			}
+
+			ssize_t bufferOffset = 0;
+			while (bufferOffset < bytesRead)
+			{
+				ssize_t bytesWritten = write(destinationFd, copyBuffer + bufferOffset, (size_t)(bytesRead - bufferOffset));
+				if (bytesWritten < 0)
+				{
+					if (errno == EINTR)
+					{
+						continue;
+					}
+
+					return CopyAttempt::Failed;
+				}
+
+				bufferOffset += bytesWritten;
+			}
+
+			totalWritten += (uint64_t)bytesRead;
+			ThrottleBackupBytes((uint64_t)bytesRead);
+		}
+
+		// Drop any preallocated tail if the source shrank while it was read
+		if (ftruncate(destinationFd, (off_t)totalWritten) != 0)
+		{
+			return CopyAttempt::Failed;
+		}
+
+		return CopyAttempt::Copied;
+	}
+
+	return CopyAttempt::Unsupported;
+}
+
+#endif
+
+bool CopyFileFast(const std::fs::path& sourcePath, const std::fs::path& destinationPath, CopyStrategy* outStrategy, uint64_t* outContentHash)
+{
+	uint64_t sourceDevice = 0;
+	uint64_t destinationDevice = 0;
+	bool knownDevices = GetDeviceId(sourcePath, sourceDevice) && GetDeviceId(destinationPath.parent_path(), destinationDevice);
+
+	std::pair<uint64_t, uint64_t> devicePair(sourceDevice, destinationDevice);
+	uint32_t unsupportedMask = 0;
+
+	if (knownDevices)
+	{
+		std::lock_guard<std::mutex> lock(g_unsupportedStrategiesMutex);
+
+		auto foundPair = g_unsupportedStrategies.find(devicePair);
+		if (foundPair != g_unsupportedStrategies.end())
+		{
+			unsupportedMask = foundPair->second;
+		}
+	}
+
+	// Cloning only ever works within one volume
+	if (!knownDevices || sourceDevice != destinationDevice)
+	{
+		unsupportedMask |= 1u << (uint32_t)CopyStrategy::Clone;
+	}
+
+#if defined(__linux__)
+	int sourceFd = open(sourcePath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (sourceFd < 0)
+	{
+		return false;
+	}
+
+	struct stat sourceStat = {};
+	if (fstat(sourceFd, &sourceStat) != 0)
+	{
+		close(sourceFd);
+		return false;
+	}
+
+	int destinationFd = open(destinationPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, sourceStat.st_mode & 0777);
+	if (destinationFd < 0)
+	{
+		close(sourceFd);
+		return false;
+	}
+#endif
+
+	CopyAttempt attempt = CopyAttempt::Unsupported;
+	CopyStrategy usedStrategy = CopyStrategy::Count;
+	uint32_t newlyUnsupportedMask = 0;
+	ContentHasher hasher;
+
+	for (CopyStrategy strategy : kStrategyOrder)
+	{
+		uint32_t strategyBit = 1u << (uint32_t)strategy;
+		if (unsupportedMask & strategyBit)
+		{
+			continue;
+		}
+
+		// A strategy that gave up part way may have hashed some of the file already
+		hasher = ContentHasher();
+
+#if defined(_WIN32)
+		attempt = TryCopyStrategy(strategy, sourcePath, destinationPath, outContentHash ? &hasher : nullptr);
+#elif defined(__linux__)
+		attempt = CopyOpenFiles(strategy, sourceFd, destinationFd, (uint64_t)sourceStat.st_size, outContentHash ? &hasher : nullptr);
+#endif
+
+		if (attempt != CopyAttempt::Unsupported)
+		{
+			usedStrategy = strategy;
+			break;
+		}
+
+		newlyUnsupportedMask |= strategyBit;
+	}
+
+#if defined(__linux__)
+	if (attempt == CopyAttempt::Copied)
+	{
+		timespec fileTimes[2] = { sourceStat.st_atim, sourceStat.st_mtim };
+		futimens(destinationFd, fileTimes);
+	}
+
+	close(destinationFd);
+	close(sourceFd);
+
+	if (attempt != CopyAttempt::Copied)
+	{
+		unlink(destinationPath.c_str());
+	}
+#endif
+
+	if (knownDevices && newlyUnsupportedMask != 0)
+	{
+		std::lock_guard<std::mutex> lock(g_unsupportedStrategiesMutex);
+		g_unsupportedStrategies[devicePair] |= newlyUnsupportedMask;
+	}
+
+	if (attempt != CopyAttempt::Copied)
+	{
+		return false;
+	}
+
+	g_copyStrategyCounts[(size_t)usedStrategy].fetch_add(1, std::memory_order_relaxed);
+
+	if (outContentHash)
+	{
+		if (usedStrategy == CopyStrategy::ReadWriteLoop)
+		{
+			*outContentHash = hasher.Finish();
+		}
+		else if (!HashFileContents(destinationPath, *outContentHash))
+		{
+			return false;
+		}
+	}
+
+	if (outStrategy)
+	{
+		*outStrategy = usedStrategy;
+	}
+
+	return true;
+}
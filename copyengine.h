@@ -0,0 +1,28 @@
+#ifndef COPYENGINE_H
+#define COPYENGINE_H
+
+enum class CopyStrategy : uint8_t
+{
+	Clone,			// Block clone / reflink, shares the source's extents (ReFS, btrfs, XFS)
+	KernelCopy,		// copy_file_range, data never leaves the kernel
+	SendFile,		// sendfile between the two files
+	ReadWriteLoop,	// Large aligned buffers into a preallocated destination, hashed on the way through
+
+	Count,
+};
+
+const char*	GetCopyStrategyName(CopyStrategy strategy);
+
+// Copies sourcePath to destinationPath (replacing it) with the cheapest strategy that works between the
+// two devices, keeping the source's last write time like CopyFileW does. Each strategy that reports
+// itself unsupported for a source/destination device pair is remembered and skipped for later copies
+// between those devices, so the first copy per pair doubles as the probe.
+// When outContentHash is given it receives the ContentHasher hash of the bytes written. The read/write
+// loop hashes each buffer as it passes; the in-kernel strategies hash the destination afterwards, while
+// its pages are still cached.
+bool		CopyFileFast(const std::fs::path& sourcePath, const std::fs::path& destinationPath, CopyStrategy* outStrategy = nullptr, uint64_t* outContentHash = nullptr);
+
+// Number of successful copies made with each strategy
+void		GetCopyStrategyCounts(uint64_t (&outCounts)[(size_t)CopyStrategy::Count]);
+
+#endif // COPYENGINE_H
@@ -0,0 +1,713 @@
+#include "main.h"
+#include "deltastore.h"
+#include "contenthash.h"
+#include "compressedstore.h"
+#include "packstore.h"
+#include "settings.h"
+#include "durability.h"
+
+#include <cstring>
+#include <fstream>
+
+static constexpr size_t		kDeltaBlockSize = 2048;
+static constexpr uint32_t	kDeltaFormatVersion = 1;
+static constexpr char		kDeltaMagic[8] = { 'L', 'S', 'C', 'D', 'E', 'L', 'T', 'A' };
+
+// A delta larger than this fraction of the full contents isn't worth the rebuild cost
+static constexpr uint64_t	kDeltaMaxSizeDivisor = 2;
+
+// Guards against a damaged (or cyclic) chain; real chains stop at kDeltaKeyframeInterval
+static constexpr uint32_t	kMaxDeltaChainDepth = kDeltaKeyframeInterval * 4;
+
+static constexpr const wchar_t* kMaterializedFolderName = L"LocalSourceControlVersions";
+
+enum DeltaOp : uint8_t
+{
+	DeltaOp_End = 0,
+	DeltaOp_Copy = 1,		// offset, length into the base
+	DeltaOp_Literal = 2,	// length, then that many bytes
+};
+
+struct DeltaFileHeader
+{
+	char		magic[8];
+	uint32_t	formatVersion;
+	uint32_t	chainDepth;		// 1 for a delta against a full copy
+	uint64_t	baseSize;
+	uint64_t	baseHash;
+	uint64_t	contentSize;
+	uint64_t	contentHash;
+	uint32_t	baseNameSize;	// UTF-8 file name of the base version follows the header
+	uint32_t	reserved;
+};
+
+static std::fs::path MakeDeltaPath(const std::fs::path& backupPath)
+{
+	std::fs::path deltaPath = backupPath;
+	deltaPath += kDeltaFileExtension;
+	return deltaPath;
+}
+
+static bool ReadWholeFile(const std::fs::path& filePath, std::vector<uint8_t>& outContents)
+{
+	std::ifstream stream(filePath, std::ios::binary);
+	if (!stream.is_open())
+	{
+		return false;
+	}
+
+	std::error_code errorCode;
+	uint64_t fileSize = std::fs::file_size(filePath, errorCode);
+	if (errorCode)
+	{
+		return false;
+	}
+
+	outContents.resize((size_t)fileSize);
+	stream.read((char*)outContents.data(), (std::streamsize)outContents.size());
+
+	return (uint64_t)stream.gcount() == fileSize;
+}
+
+static bool WriteWholeFile(const std::fs::path& filePath, const void* data, size_t size, std::fs::file_time_type lastWriteTime)
+{
+	{
+		std::ofstream stream(filePath, std::ios::binary | std::ios::trunc);
+		if (!stream.is_open())
+		{
+			return false;
+		}
+
+		stream.write((const char*)data, (std::streamsize)size);
+		stream.flush();
+
+		if (!stream)
+		{
+			return false;
+		}
+	}
+
+	std::error_code errorCode;
+	std::fs::last_write_time(filePath, lastWriteTime, errorCode);
+	return true;
+}
+
+static bool ReadDeltaHeader(const std::vector<uint8_t>& deltaFile, DeltaFileHeader& outHeader, std::string& outBaseName)
+{
+	if (deltaFile.size() < sizeof(DeltaFileHeader))
+	{
+		return false;
+	}
+
+	memcpy(&outHeader, deltaFile.data(), sizeof(DeltaFileHeader));
+
+	if (memcmp(outHeader.magic, kDeltaMagic, sizeof(kDeltaMagic)) != 0 || outHeader.formatVersion != kDeltaFormatVersion)
+	{
+		return false;
+	}
+
+	if (deltaFile.size() - sizeof(DeltaFileHeader) < outHeader.baseNameSize)
+	{
+		return false;
+	}
+
+	outBaseName.assign((const char*)deltaFile.data() + sizeof(DeltaFileHeader), outHeader.baseNameSize);
+	return true;
+}
+
+static bool ReadDeltaHeaderFromFile(const std::fs::path& deltaPath, DeltaFileHeader& outHeader)
+{
+	std::ifstream stream(deltaPath, std::ios::binary);
+	if (!stream.is_open())
+	{
+		return false;
+	}
+
+	stream.read((char*)&outHeader, sizeof(outHeader));
+
+	return stream.gcount() == (std::streamsize)sizeof(outHeader)
+		&& memcmp(outHeader.magic, kDeltaMagic, sizeof(kDeltaMagic)) == 0
+		&& outHeader.formatVersion == kDeltaFormatVersion;
+}
+
+//-----------------------------------------------------------------------------------------------------
+// Encoding
+//-----------------------------------------------------------------------------------------------------
+
+static void AppendVarint(std::vector<uint8_t>& out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((uint8_t)value);
+}
+
+static bool ReadVarint(const uint8_t*& cursor, const uint8_t* end, uint64_t& outValue)
+{
+	outValue = 0;
+
+	for (uint32_t shift = 0; shift < 64; shift += 7)
+	{
+		if (cursor == end)
+		{
+			return false;
+		}
+
+		uint8_t byte = *cursor++;
+		outValue |= (uint64_t)(byte & 0x7f) << shift;
+
+		if ((byte & 0x80) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// rsync's rolling checksum over a kDeltaBlockSize window: two running sums that can slide one byte at a time
+struct RollingChecksum
+{
+	uint32_t	a = 0;
+	uint32_t	b = 0;
+
+	void Reset(const uint8_t* window)
+	{
+		a = 0;
+		b = 0;
+
+		for (size_t byteIndex = 0; byteIndex < kDeltaBlockSize; ++byteIndex)
+		{
+			a += window[byteIndex];
+			b += (uint32_t)(kDeltaBlockSize - byteIndex) * window[byteIndex];
+		}
+	}
+
+	void Roll(uint8_t outgoing, uint8_t incoming)
+	{
+		a += (uint32_t)incoming - (uint32_t)outgoing;
+		b += a - (uint32_t)kDeltaBlockSize * outgoing;
+	}
+
+	uint32_t Value() const
+	{
+		return (a & 0xffff) | (b << 16);
+	}
+};
+
+struct DeltaWriter
+{
+	std::vector<uint8_t>&	out;
+	uint64_t				copyOffset = 0;
+	uint64_t				copyLength = 0;
+
+	explicit DeltaWriter(std::vector<uint8_t>& outOps) : out(outOps) {}
+
+	void FlushCopy()
+	{
+		if (copyLength > 0)
+		{
+			out.push_back(DeltaOp_Copy);
+			AppendVarint(out, copyOffset);
+			AppendVarint(out, copyLength);
+			copyLength = 0;
+		}
+	}
+
+	void Copy(uint64_t offset, uint64_t length)
+	{
+		// Consecutive matching blocks become one op
+		if (copyLength > 0 && copyOffset + copyLength == offset)
+		{
+			copyLength += length;
+			return;
+		}
+
+		FlushCopy();
+		copyOffset = offset;
+		copyLength = length;
+	}
+
+	void Literal(const uint8_t* data, size_t size)
+	{
+		if (size == 0)
+		{
+			return;
+		}
+
+		FlushCopy();
+		out.push_back(DeltaOp_Literal);
+		AppendVarint(out, size);
+		out.insert(out.end(), data, data + size);
+	}
+
+	void Finish()
+	{
+		FlushCopy();
+		out.push_back(DeltaOp_End);
+	}
+};
+
+static void EncodeDelta(const std::vector<uint8_t>& base, const std::vector<uint8_t>& target, std::vector<uint8_t>& outOps)
+{
+	DeltaWriter writer(outOps);
+
+	// Index every whole block of the base by its checksum, keeping the first block for each value
+	std::umap<uint32_t, uint32_t> blocksByChecksum;
+	blocksByChecksum.reserve(base.size() / kDeltaBlockSize + 1);
+
+	RollingChecksum checksum;
+
+	for (size_t blockOffset = 0; blockOffset + kDeltaBlockSize <= base.size(); blockOffset += kDeltaBlockSize)
+	{
+		checksum.Reset(base.data() + blockOffset);
+		blocksByChecksum.emplace(checksum.Value(), (uint32_t)(blockOffset / kDeltaBlockSize));
+	}
+
+	size_t literalStart = 0;
+	size_t position = 0;
+
+	if (target.size() >= kDeltaBlockSize)
+	{
+		checksum.Reset(target.data());
+	}
+
+	while (!blocksByChecksum.empty() && position + kDeltaBlockSize <= target.size())
+	{
+		auto blockIt = blocksByChecksum.find(checksum.Value());
+
+		if (blockIt != blocksByChecksum.end())
+		{
+			size_t baseOffset = (size_t)blockIt->second * kDeltaBlockSize;
+
+			if (memcmp(base.data() + baseOffset, target.data() + position, kDeltaBlockSize) == 0)
+			{
+				// Grow the match both ways past the block edges, an edit rarely lands on a block boundary
+				size_t matchBase = baseOffset;
+				size_t matchTarget = position;
+				size_t matchLength = kDeltaBlockSize;
+
+				while (matchTarget > literalStart && matchBase > 0 && base[matchBase - 1] == target[matchTarget - 1])
+				{
+					--matchBase;
+					--matchTarget;
+					++matchLength;
+				}
+
+				while (matchBase + matchLength < base.size() && matchTarget + matchLength < target.size() && base[matchBase + matchLength] == target[matchTarget + matchLength])
+				{
+					++matchLength;
+				}
+
+				writer.Literal(target.data() + literalStart, matchTarget - literalStart);
+				writer.Copy(matchBase, matchLength);
+
+				position = matchTarget + matchLength;
+				literalStart = position;
+
+				if (position + kDeltaBlockSize <= target.size())
+				{
+					checksum.Reset(target.data() + position);
+				}
+				continue;
+			}
+		}
+
+		if (position + kDeltaBlockSize < target.size())
+		{
+			checksum.Roll(target[position], target[position + kDeltaBlockSize]);
+		}
+		++position;
+	}
+
+	writer.Literal(target.data() + literalStart, target.size() - literalStart);
+	writer.Finish();
+}
+
+static bool ApplyDelta(const std::vector<uint8_t>& base, const uint8_t* ops, const uint8_t* opsEnd, uint64_t contentSize, std::vector<uint8_t>& outContents)
+{
+	outContents.clear();
+	outContents.reserve((size_t)contentSize);
+
+	while (ops < opsEnd)
+	{
+		uint8_t op = *ops++;
+
+		if (op == DeltaOp_End)
+		{
+			return outContents.size() == contentSize;
+		}
+
+		uint64_t length = 0;
+
+		if (op == DeltaOp_Copy)
+		{
+			uint64_t offset = 0;
+			if (!ReadVarint(ops, opsEnd, offset) || !ReadVarint(ops, opsEnd, length) || offset > base.size() || length > base.size() - offset)
+			{
+				return false;
+			}
+
+			outContents.insert(outContents.end(), base.begin() + (ptrdiff_t)offset, base.begin() + (ptrdiff_t)(offset + length));
+		}
+		else if (op == DeltaOp_Literal)
+		{
+			if (!ReadVarint(ops, opsEnd, length) || length > (uint64_t)(opsEnd - ops))
+			{
+				return false;
+			}
+
+			outContents.insert(outContents.end(), ops, ops + length);
+			ops += length;
+		}
+		else
+		{
+			return false;
+		}
+
+		if (outContents.size() > contentSize)
+		{
+			return false;
+		}
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------------------------------
+// Reading
+//-----------------------------------------------------------------------------------------------------
+
+static bool ReadBackupContentsAtDepth(const std::fs::path& backupPath, std::vector<uint8_t>& outContents, uint32_t depth)
+{
+	std::error_code errorCode;
+
+	if (std::fs::exists(backupPath, errorCode))
+	{
+		return ReadWholeFile(backupPath, outContents);
+	}
+
+	std::fs::path compressedPath = MakeCompressedBackupPath(backupPath);
+	if (std::fs::exists(compressedPath, errorCode))
+	{
+		return ReadCompressedBackup(compressedPath, outContents);
+	}
+
+	if (IsPackedBackup(backupPath))
+	{
+		return ReadPackedBackup(backupPath, outContents);
+	}
+
+	if (depth > kMaxDeltaChainDepth)
+	{
+		return false;
+	}
+
+	std::vector<uint8_t> deltaFile;
+	if (!ReadWholeFile(MakeDeltaPath(backupPath), deltaFile))
+	{
+		return false;
+	}
+
+	DeltaFileHeader header = {};
+	std::string baseName;
+	if (!ReadDeltaHeader(deltaFile, header, baseName))
+	{
+		return false;
+	}
+
+	std::vector<uint8_t> base;
+	std::fs::path basePath = backupPath.parent_path() / std::fs::u8path(baseName);
+
+	if (!ReadBackupContentsAtDepth(basePath, base, depth + 1))
+	{
+		return false;
+	}
+
+	if (base.size() != header.baseSize || HashBytes(base.data(), base.size()) != header.baseHash)
+	{
+		return false;
+	}
+
+	const uint8_t* ops = deltaFile.data() + sizeof(DeltaFileHeader) + header.baseNameSize;
+	const uint8_t* opsEnd = deltaFile.data() + deltaFile.size();
+
+	if (!ApplyDelta(base, ops, opsEnd, header.contentSize, outContents))
+	{
+		return false;
+	}
+
+	return HashBytes(outContents.data(), outContents.size()) == header.contentHash;
+}
+
+std::fs::path GetStoredBackupPath(const std::fs::path& backupPath)
+{
+	std::error_code errorCode;
+
+	if (std::fs::exists(backupPath, errorCode))
+	{
+		return backupPath;
+	}
+
+	std::fs::path deltaPath = MakeDeltaPath(backupPath);
+	if (std::fs::exists(deltaPath, errorCode))
+	{
+		return deltaPath;
+	}
+
+	std::fs::path compressedPath = MakeCompressedBackupPath(backupPath);
+	if (std::fs::exists(compressedPath, errorCode))
+	{
+		return compressedPath;
+	}
+
+	return backupPath;
+}
+
+bool GetDeltaBackupInfo(const std::fs::path& backupPath, uint64_t& outContentSize, uint64_t& outContentHash)
+{
+	DeltaFileHeader header = {};
+	if (!ReadDeltaHeaderFromFile(MakeDeltaPath(backupPath), header))
+	{
+		return false;
+	}
+
+	outContentSize = header.contentSize;
+	outContentHash = header.contentHash;
+	return true;
+}
+
+bool ReadBackupContents(const std::fs::path& backupPath, std::vector<uint8_t>& outContents)
+{
+	return ReadBackupContentsAtDepth(backupPath, outContents, 0);
+}
+
+//-----------------------------------------------------------------------------------------------------
+// Writing
+//-----------------------------------------------------------------------------------------------------
+
+bool StoreBackupAsDelta(const std::fs::path& sourcePath, const std::fs::path& backupPath, const std::fs::path& basePath, uint64_t& outContentHash, bool& outStoredAsDelta, uint64_t& outStoredBytes)
+{
+	outStoredAsDelta = false;
+	outStoredBytes = 0;
+
+	std::error_code errorCode;
+	std::fs::file_time_type sourceWriteTime = std::fs::last_write_time(sourcePath, errorCode);
+	if (errorCode)
+	{
+		return false;
+	}
+
+	std::vector<uint8_t> contents;
+	if (!ReadWholeFile(sourcePath, contents))
+	{
+		return false;
+	}
+
+	outContentHash = HashBytes(contents.data(), contents.size());
+
+	std::fs::path deltaPath = MakeDeltaPath(backupPath);
+	std::vector<uint8_t> deltaFile;
+
+	// A delta against a delta extends the chain; past the keyframe interval a full copy starts a new one
+	uint32_t chainDepth = 1;
+	DeltaFileHeader baseHeader = {};
+
+	if (!basePath.empty() && !std::fs::exists(basePath, errorCode) && ReadDeltaHeaderFromFile(MakeDeltaPath(basePath), baseHeader))
+	{
+		chainDepth = baseHeader.chainDepth + 1;
+	}
+
+	std::vector<uint8_t> base;
+
+	if (!basePath.empty() && chainDepth < kDeltaKeyframeInterval && ReadBackupContents(basePath, base))
+	{
+		std::string baseName = basePath.filename().u8string();
+
+		DeltaFileHeader header = {};
+		memcpy(header.magic, kDeltaMagic, sizeof(kDeltaMagic));
+		header.formatVersion = kDeltaFormatVersion;
+		header.chainDepth = chainDepth;
+		header.baseSize = base.size();
+		header.baseHash = HashBytes(base.data(), base.size());
+		header.contentSize = contents.size();
+		header.contentHash = outContentHash;
+		header.baseNameSize = (uint32_t)baseName.size();
+
+		deltaFile.resize(sizeof(header));
+		memcpy(deltaFile.data(), &header, sizeof(header));
+		deltaFile.insert(deltaFile.end(), baseName.begin(), baseName.end());
+
+		EncodeDelta(base, contents, deltaFile);
+	}
+
+	// A retried copy may switch between the two forms, only one may be left
+	if (!deltaFile.empty() && deltaFile.size() <= contents.size() / kDeltaMaxSizeDivisor)
+	{
+		std::fs::remove(backupPath, errorCode);
+
+		if (!WriteWholeFile(deltaPath, deltaFile.data(), deltaFile.size(), sourceWriteTime))
+		{
+			return false;
+		}
+
+		outStoredAsDelta = true;
+		outStoredBytes = deltaFile.size();
+		return true;
+	}
+
+	std::fs::remove(deltaPath, errorCode);
+
+	if (!WriteWholeFile(backupPath, contents.data(), contents.size(), sourceWriteTime))
+	{
+		return false;
+	}
+
+	outStoredBytes = contents.size();
+	return true;
+}
+
+bool RebaseDeltaBackup(const std::fs::path& backupPath, const std::fs::path& removedBasePath, uint64_t& outRebasedBytes)
+{
+	outRebasedBytes = 0;
+
+	std::fs::path deltaPath = MakeDeltaPath(backupPath);
+	std::error_code errorCode;
+
+	if (std::fs::exists(backupPath, errorCode) || !std::fs::exists(deltaPath, errorCode))
+	{
+		return true;
+	}
+
+	std::vector<uint8_t> deltaFile;
+	DeltaFileHeader header = {};
+	std::string baseName;
+
+	if (!ReadWholeFile(deltaPath, deltaFile) || !ReadDeltaHeader(deltaFile, header, baseName))
+	{
+		return false;
+	}
+
+	if (baseName != removedBasePath.filename().u8string())
+	{
+		return true;
+	}
+
+	std::vector<uint8_t> contents;
+	if (!ReadBackupContents(backupPath, contents))
+	{
+		return false;
+	}
+
+	std::fs::file_time_type lastWriteTime = std::fs::last_write_time(deltaPath, errorCode);
+
+	if (errorCode || !WriteWholeFile(backupPath, contents.data(), contents.size(), lastWriteTime))
+	{
+		std::fs::remove(backupPath, errorCode);
+		return false;
+	}
+
+	// The full copy must be on disk before the delta it replaces goes. Versions further down the chain
+	// name this one as their base, which still resolves to the full copy.
+	CommitBackupWrite(backupPath, g_settings.durability);
+	std::fs::remove(deltaPath, errorCode);
+
+	outRebasedBytes = contents.size();
+	return true;
+}
+
+//-----------------------------------------------------------------------------------------------------
+// Materializing for other programs
+//-----------------------------------------------------------------------------------------------------
+
+static std::fs::path GetMaterializedFolderPath()
+{
+	std::error_code errorCode;
+	std::fs::path tempPath = std::fs::temp_directory_path(errorCode);
+
+	if (errorCode)
+	{
+		return {};
+	}
+
+	return tempPath / kMaterializedFolderName;
+}
+
+std::fs::path MaterializeBackupForRead(const std::fs::path& backupPath)
+{
+	std::error_code errorCode;
+
+	if (std::fs::exists(backupPath, errorCode))
+	{
+		return backupPath;
+	}
+
+	std::fs::path materializedFolderPath = GetMaterializedFolderPath();
+	if (materializedFolderPath.empty())
+	{
+		return {};
+	}
+
+	// Same backup file name as the version (diff tools show it), in a folder per backup path so two
+	// files with the same name and timestamp in different folders don't collide
+	std::wstring backupPathText = backupPath.wstring();
+	uint64_t backupPathHash = HashBytes(backupPathText.data(), backupPathText.size() * sizeof(wchar_t));
+
+	std::fs::path materializedPath = materializedFolderPath / fmt::format(L"{:016x}", backupPathHash) / backupPath.filename();
+
+	uint64_t contentSize = 0;
+	uint64_t contentHash = 0;
+
+	std::fs::path storedPath = GetStoredBackupPath(backupPath);
+
+	if (!GetDeltaBackupInfo(backupPath, contentSize, contentHash) &&
+		!GetCompressedBackupInfo(storedPath, contentSize, contentHash) &&
+		!GetPackedBackupInfo(backupPath, contentSize, contentHash))
+	{
+		// Not stored in any form, let the caller fail on the path as it would have before
+		return backupPath;
+	}
+
+	if (std::fs::exists(materializedPath, errorCode) && std::fs::file_size(materializedPath, errorCode) == contentSize && !errorCode)
+	{
+		uint64_t existingHash = 0;
+		if (HashFileContents(materializedPath, existingHash) && existingHash == contentHash)
+		{
+			return materializedPath;
+		}
+	}
+
+	std::vector<uint8_t> contents;
+	if (!ReadBackupContents(backupPath, contents))
+	{
+		return {};
+	}
+
+	std::fs::create_directories(materializedPath.parent_path(), errorCode);
+	// A packed version has no file of its own to take the write time from
+	std::fs::file_time_type lastWriteTime = std::fs::last_write_time(storedPath, errorCode);
+	if (errorCode)
+	{
+		lastWriteTime = std::fs::file_time_type::clock::now();
+	}
+
+	if (!WriteWholeFile(materializedPath, contents.data(), contents.size(), lastWriteTime))
+	{
+		return {};
+	}
+
+	return materializedPath;
+}
+
+void ClearMaterializedBackups()
+{
+	std::fs::path materializedFolderPath = GetMaterializedFolderPath();
+
+	if (!materializedFolderPath.empty())
+	{
+		std::error_code errorCode;
+		std::fs::remove_all(materializedFolderPath, errorCode);
+	}
+}
@@ -0,0 +1,43 @@
+#ifndef DELTASTORE_H
+#define DELTASTORE_H
+
+// Delta encoded backup versions. A version of a large file can be stored as <backup path>.lscdelta,
+// holding only what changed against the version before it (rsync style: blocks of the previous version
+// found again through a rolling hash are referenced, everything else is stored literally). Every
+// kDeltaKeyframeInterval versions a full copy is stored instead, so reading a version never has to walk
+// back through more than that many deltas. Reads go through ReadBackupContents/MaterializeBackupForRead,
+// which rebuild delta and compressed versions transparently.
+
+static constexpr const wchar_t*	kDeltaFileExtension = L".lscdelta";
+static constexpr uint64_t		kDeltaMinFileSize = 1024ull * 1024;
+static constexpr uint64_t		kDeltaMaxFileSize = 512ull * 1024 * 1024;
+static constexpr uint32_t		kDeltaKeyframeInterval = 16;
+
+// Path of the file actually holding the version at backupPath: its .lscdelta or .lscz file, or backupPath for a plain copy
+std::fs::path	GetStoredBackupPath(const std::fs::path& backupPath);
+
+// Size and hash of the version a delta rebuilds to. Returns false if backupPath isn't stored as a delta.
+bool			GetDeltaBackupInfo(const std::fs::path& backupPath, uint64_t& outContentSize, uint64_t& outContentHash);
+
+// Contents of the version at backupPath, rebuilding it if it is a delta. The result is checked against
+// the hash stored with the delta, so a damaged chain fails rather than returning wrong bytes.
+bool			ReadBackupContents(const std::fs::path& backupPath, std::vector<uint8_t>& outContents);
+
+// Stores sourcePath as the version at backupPath, encoded against the version at basePath when that is
+// worthwhile (and the chain is short enough), as a full copy otherwise. The stored file keeps the
+// source's write time. outContentHash is the ContentHasher hash of the bytes stored.
+bool			StoreBackupAsDelta(const std::fs::path& sourcePath, const std::fs::path& backupPath, const std::fs::path& basePath, uint64_t& outContentHash, bool& outStoredAsDelta, uint64_t& outStoredBytes);
+
+// Called before the version at removedBasePath is deleted: if backupPath is a delta against it, it is
+// rewritten as a full copy, whose size goes to outRebasedBytes (0 when nothing was rewritten). Returns
+// false if that was needed and failed, the base must be kept then.
+bool			RebaseDeltaBackup(const std::fs::path& backupPath, const std::fs::path& removedBasePath, uint64_t& outRebasedBytes);
+
+// A path other programs can open for the version at backupPath: backupPath itself, or for a delta a
+// rebuilt copy in the temp folder. Empty if a delta couldn't be rebuilt.
+std::fs::path	MaterializeBackupForRead(const std::fs::path& backupPath);
+
+// Deletes the rebuilt copies left in the temp folder by earlier runs
+void			ClearMaterializedBackups();
+
+#endif // DELTASTORE_H
@@ -0,0 +1,140 @@
+#include "main.h"
+#include "settings.h"
+#include "durability.h"
+
+#if defined(_WIN32)
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Writes committed within this window of the first share its flush
+static constexpr uint32_t kGroupCommitMs = 10;
+
+struct GroupCommit
+{
+	std::mutex					mutex;
+	std::condition_variable		condition;
+	std::vector<std::fs::path>	pendingPaths;
+	uint64_t					pendingBatchId = 1;		// Batch pendingPaths will be flushed with
+	uint64_t					flushedBatchId = 0;		// Latest batch that is on disk
+	bool						isFlushing = false;
+};
+
+static GroupCommit				g_groupCommit;
+static std::atomic<uint64_t>	g_committedWrites = 0;
+static std::atomic<uint64_t>	g_flushes = 0;
+
+// Flushes one file's data, or a directory's entries, to disk
+static bool FlushPath(const std::fs::path& path, bool isDirectory)
+{
+#if defined(_WIN32)
+	HANDLE handle = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, isDirectory ? FILE_FLAG_BACKUP_SEMANTICS : 0, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	bool isFlushed = FlushFileBuffers(handle) != FALSE;
+	CloseHandle(handle);
+	return isFlushed;
+#elif defined(__linux__)
+	int fileDescriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC | (isDirectory ? O_DIRECTORY : 0));
+	if (fileDescriptor < 0)
+	{
+		return false;
+	}
+
+	// A file's data and size are all a read needs back, its other metadata can wait
+	bool isFlushed = (isDirectory ? fsync(fileDescriptor) : fdatasync(fileDescriptor)) == 0;
+	close(fileDescriptor);
+	return isFlushed;
+#else
+	(void)path;
+	(void)isDirectory;
+	return false;
+#endif
+}
+
+static void FlushFileAndDirectory(const std::fs::path& writtenPath)
+{
+	FlushPath(writtenPath, false);
+	FlushPath(writtenPath.parent_path(), true);
+}
+
+// Each file of the batch on its own, then each folder they were written to once. Only the batch's own
+// files: flushing a whole volume would also force out whatever else is writing to it, a build sharing
+// the disk most of all.
+static void FlushBatch(const std::vector<std::fs::path>& writtenPaths)
+{
+	std::set<std::fs::path> filePaths(writtenPaths.begin(), writtenPaths.end());
+	std::set<std::fs::path> directoryPaths;
+
+	for (const std::fs::path& filePath : filePaths)
+	{
+		FlushPath(filePath, false);
+		directoryPaths.insert(filePath.parent_path());
+	}
+
+	for (const std::fs::path& directoryPath : directoryPaths)
+	{
+		FlushPath(directoryPath, true);
+	}
+}
+
+void CommitBackupWrite(const std::fs::path& writtenPath, BackupDurability durability)
+{
+	if (durability == BackupDurability::None || writtenPath.empty())
+	{
+		return;
+	}
+
+	g_committedWrites.fetch_add(1, std::memory_order_relaxed);
+
+	if (durability == BackupDurability::PerFile)
+	{
+		FlushFileAndDirectory(writtenPath);
+		g_flushes.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(g_groupCommit.mutex);
+
+	g_groupCommit.pendingPaths.push_back(writtenPath);
+	uint64_t batchId = g_groupCommit.pendingBatchId;
+
+	while (g_groupCommit.flushedBatchId < batchId)
+	{
+		if (g_groupCommit.isFlushing)
+		{
+			g_groupCommit.condition.wait(lock);
+			continue;
+		}
+
+		// Nobody is flushing: this caller leads the batch, giving the others a moment to join it
+		g_groupCommit.isFlushing = true;
+
+		lock.unlock();
+		std::this_thread::sleep_for(std::chrono::milliseconds(kGroupCommitMs));
+		lock.lock();
+
+		std::vector<std::fs::path> batchPaths;
+		batchPaths.swap(g_groupCommit.pendingPaths);
+		uint64_t flushingBatchId = g_groupCommit.pendingBatchId++;
+
+		lock.unlock();
+		FlushBatch(batchPaths);
+		g_flushes.fetch_add(1, std::memory_order_relaxed);
+		lock.lock();
+
+		g_groupCommit.flushedBatchId = flushingBatchId;
+		g_groupCommit.isFlushing = false;
+		g_groupCommit.condition.notify_all();
+	}
+}
+
+void GetDurabilityCounts(uint64_t& outCommittedWrites, uint64_t& outFlushes)
+{
+	outCommittedWrites = g_committedWrites.load(std::memory_order_relaxed);
+	outFlushes = g_flushes.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,17 @@
+#ifndef DURABILITY_H
+#define DURABILITY_H
+
+// Getting backups onto the disk itself rather than just into the OS cache, so a power loss can't
+// leave empty or missing versions behind. With BackupDurability::Batched, writes committed within a
+// short window of each other are flushed together: the first caller waits out the window, flushes the
+// group's files and each of their folders once, and wakes the others, so a burst of copies into the
+// same folders costs one wait and one folder flush instead of one each.
+
+// Returns once writtenPath (a file just written) and its directory entry are on disk as far as
+// durability asks for, at once for BackupDurability::None
+void	CommitBackupWrite(const std::fs::path& writtenPath, BackupDurability durability);
+
+// Writes committed so far, and the flushes they took
+void	GetDurabilityCounts(uint64_t& outCommittedWrites, uint64_t& outFlushes);
+
+#endif // DURABILITY_H
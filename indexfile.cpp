@@ -0,0 +1,404 @@
+#include "main.h"
+#include "pathpool.h"
+#include "backupindex.h"
+#include "indexfile.h"
+#include "contenthash.h"
+#include "settings.h"
+#include "durability.h"
+
+#if defined(_WIN32)
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+
+static constexpr const wchar_t*	kIndexFileName = L"index.bin";
+static constexpr uint32_t		kIndexFormatVersion = 2;
+static constexpr char			kIndexMagic[8] = { 'L', 'S', 'C', 'I', 'N', 'D', 'E', 'X' };
+
+enum IndexVersionFlags : uint32_t
+{
+	IndexVersion_HasContentHash = 1,
+	IndexVersion_PossiblyTorn = 2,
+};
+
+struct IndexFileHeader
+{
+	char		magic[8];
+	uint32_t	formatVersion;
+	uint32_t	wcharSize;			// Paths are stored as wchar_t, a file only loads where it was written
+	uint64_t	originalCount;
+	uint64_t	versionCount;
+	uint64_t	pathCharCount;
+	uint64_t	sectionsChecksum;	// HashBytes of everything after the header
+	uint64_t	headerChecksum;		// HashBytes of the header up to this field
+	uint64_t	generation;			// Matched by the journal of the changes made after it
+};
+
+struct IndexFileOriginal
+{
+	uint64_t	pathOffset;			// In characters, into the path section
+	uint32_t	pathLength;
+	uint32_t	versionCount;		// Its versions follow those of the original before it
+};
+
+struct IndexFileState
+{
+	std::mutex			mutex;			// Held for the whole of each load, save or removal
+	const uint8_t*		view = nullptr;	// The file last loaded, kept mapped until it is replaced or removed
+	uint64_t			viewSize = 0;
+	std::thread			verifyThread;
+	std::atomic<bool>	isCorrupt = false;
+};
+
+static IndexFileState g_indexFile;
+
+static std::fs::path GetIndexFilePath(const std::fs::path& backupRootPath)
+{
+	return backupRootPath / kIndexFolderName / kIndexFileName;
+}
+
+static const uint8_t* MapIndexFile(const std::fs::path& filePath, uint64_t& outSize)
+{
+	const uint8_t* view = nullptr;
+	outSize = 0;
+
+#if defined(_WIN32)
+	HANDLE fileHandle = CreateFileW(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+	{
+		return nullptr;
+	}
+
+	LARGE_INTEGER fileSize = {};
+	if (GetFileSizeEx(fileHandle, &fileSize) && fileSize.QuadPart > 0)
+	{
+		// The view keeps the file open once the handles are closed
+		HANDLE mappingHandle = CreateFileMappingW(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mappingHandle)
+		{
+			view = (const uint8_t*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mappingHandle);
+		}
+		outSize = (uint64_t)fileSize.QuadPart;
+	}
+
+	CloseHandle(fileHandle);
+#elif defined(__linux__)
+	int fileDescriptor = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fileDescriptor < 0)
+	{
+		return nullptr;
+	}
+
+	struct stat fileStat = {};
+	if (fstat(fileDescriptor, &fileStat) == 0 && fileStat.st_size > 0)
+	{
+		void* mapping = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+		if (mapping != MAP_FAILED)
+		{
+			view = (const uint8_t*)mapping;
+		}
+		outSize = (uint64_t)fileStat.st_size;
+	}
+
+	close(fileDescriptor);
+#endif
+
+	if (!view)
+	{
+		outSize = 0;
+	}
+
+	return view;
+}
+
+static void UnmapIndexFile(const uint8_t* view, uint64_t viewSize)
+{
+#if defined(_WIN32)
+	UnmapViewOfFile(view);
+#elif defined(__linux__)
+	munmap((void*)view, (size_t)viewSize);
+#endif
+}
+
+// Lets go of the file last loaded, once its check is done
+static void CloseIndexFile_Locked()
+{
+	if (g_indexFile.verifyThread.joinable())
+	{
+		g_indexFile.verifyThread.join();
+	}
+
+	if (g_indexFile.view)
+	{
+		UnmapIndexFile(g_indexFile.view, g_indexFile.viewSize);
+		g_indexFile.view = nullptr;
+		g_indexFile.viewSize = 0;
+	}
+}
+
+StoredBackupVersion MakeStoredBackupVersion(const BackupVersion& version)
+{
+	StoredBackupVersion storedVersion = {};
+	storedVersion.timePointTicks = (int64_t)version.timePoint.time_since_epoch().count();
+	storedVersion.sourceWriteTimeTicks = (int64_t)version.sourceWriteTime.time_since_epoch().count();
+	storedVersion.sourceSize = version.sourceSize;
+	storedVersion.storedBytes = version.storedBytes;
+	storedVersion.contentHash = version.contentHash;
+	storedVersion.flags = (version.hasContentHash ? (uint32_t)IndexVersion_HasContentHash : 0u) | (version.possiblyTorn ? (uint32_t)IndexVersion_PossiblyTorn : 0u);
+	return storedVersion;
+}
+
+BackupVersion MakeBackupVersion(const StoredBackupVersion& storedVersion)
+{
+	BackupVersion version = {};
+	version.timePoint = TimePoint(TimePoint::duration(storedVersion.timePointTicks));
+	version.sourceSize = storedVersion.sourceSize;
+	version.storedBytes = storedVersion.storedBytes;
+	version.sourceWriteTime = std::fs::file_time_type(std::fs::file_time_type::duration(storedVersion.sourceWriteTimeTicks));
+	version.contentHash = storedVersion.contentHash;
+	version.hasContentHash = (storedVersion.flags & IndexVersion_HasContentHash) != 0;
+	version.possiblyTorn = (storedVersion.flags & IndexVersion_PossiblyTorn) != 0;
+	return version;
+}
+
+static uint64_t ComputeHeaderChecksum(const IndexFileHeader& header)
+{
+	return HashBytes(&header, offsetof(IndexFileHeader, headerChecksum));
+}
+
+// Everything needed to read the file without going outside it: the header, the section sizes against
+// the file size, and each original's path and versions against their sections
+static bool IsIndexLayoutValid(const uint8_t* view, uint64_t viewSize)
+{
+	if (viewSize < sizeof(IndexFileHeader))
+	{
+		return false;
+	}
+
+	const IndexFileHeader& header = *(const IndexFileHeader*)view;
+
+	if (memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) != 0 ||
+		header.formatVersion != kIndexFormatVersion ||
+		header.wcharSize != sizeof(wchar_t) ||
+		header.headerChecksum != ComputeHeaderChecksum(header))
+	{
+		return false;
+	}
+
+	uint64_t sectionsSize = viewSize - sizeof(IndexFileHeader);
+
+	// Each count on its own already has to fit, so the sum below can't overflow
+	if (header.versionCount > sectionsSize / sizeof(StoredBackupVersion) ||
+		header.originalCount > sectionsSize / sizeof(IndexFileOriginal) ||
+		header.pathCharCount > sectionsSize / sizeof(wchar_t))
+	{
+		return false;
+	}
+
+	if (header.versionCount * sizeof(StoredBackupVersion) + header.originalCount * sizeof(IndexFileOriginal) + header.pathCharCount * sizeof(wchar_t) != sectionsSize)
+	{
+		return false;
+	}
+
+	const IndexFileOriginal* originals = (const IndexFileOriginal*)(view + sizeof(IndexFileHeader) + header.versionCount * sizeof(StoredBackupVersion));
+	uint64_t ownedVersionCount = 0;
+
+	for (uint64_t originalIndex = 0; originalIndex < header.originalCount; ++originalIndex)
+	{
+		const IndexFileOriginal& original = originals[originalIndex];
+
+		if (original.pathLength == 0 || original.pathOffset > header.pathCharCount || original.pathLength > header.pathCharCount - original.pathOffset)
+		{
+			return false;
+		}
+
+		ownedVersionCount += original.versionCount;
+	}
+
+	return ownedVersionCount == header.versionCount;
+}
+
+static void VerifyIndexFileProc(const uint8_t* view, uint64_t viewSize)
+{
+	const IndexFileHeader& header = *(const IndexFileHeader*)view;
+
+	uint64_t sectionsChecksum = HashBytes(view + sizeof(IndexFileHeader), (size_t)(viewSize - sizeof(IndexFileHeader)));
+	g_indexFile.isCorrupt.store(sectionsChecksum != header.sectionsChecksum);
+}
+
+bool LoadBackupIndexFile(const std::fs::path& backupRootPath, uint64_t& outGeneration, const IndexFileVersionCallback& callback)
+{
+	std::lock_guard<std::mutex> lock(g_indexFile.mutex);
+
+	CloseIndexFile_Locked();
+	g_indexFile.isCorrupt.store(false);
+
+	uint64_t viewSize = 0;
+	const uint8_t* view = MapIndexFile(GetIndexFilePath(backupRootPath), viewSize);
+	if (!view)
+	{
+		return false;
+	}
+
+	if (!IsIndexLayoutValid(view, viewSize))
+	{
+		UnmapIndexFile(view, viewSize);
+		return false;
+	}
+
+	const IndexFileHeader& header = *(const IndexFileHeader*)view;
+	const StoredBackupVersion* versions = (const StoredBackupVersion*)(view + sizeof(IndexFileHeader));
+	const IndexFileOriginal* originals = (const IndexFileOriginal*)(versions + header.versionCount);
+	const wchar_t* pathChars = (const wchar_t*)(originals + header.originalCount);
+
+	const StoredBackupVersion* fileVersion = versions;
+
+	for (uint64_t originalIndex = 0; originalIndex < header.originalCount; ++originalIndex)
+	{
+		const IndexFileOriginal& original = originals[originalIndex];
+		std::wstring_view originalPath(pathChars + original.pathOffset, original.pathLength);
+
+		for (uint32_t versionIndex = 0; versionIndex < original.versionCount; ++versionIndex, ++fileVersion)
+		{
+			callback(originalPath, MakeBackupVersion(*fileVersion));
+		}
+	}
+
+	outGeneration = header.generation;
+
+	g_indexFile.view = view;
+	g_indexFile.viewSize = viewSize;
+	g_indexFile.verifyThread = std::thread(VerifyIndexFileProc, view, viewSize);
+	return true;
+}
+
+bool PollBackupIndexFileCorrupt()
+{
+	return g_indexFile.isCorrupt.exchange(false);
+}
+
+void CloseBackupIndexFile()
+{
+	std::lock_guard<std::mutex> lock(g_indexFile.mutex);
+	CloseIndexFile_Locked();
+}
+
+std::string SerializeBackupIndex(const BackupIndex& index, uint64_t generation)
+{
+	IndexFileHeader header = {};
+	memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+	header.formatVersion = kIndexFormatVersion;
+	header.wcharSize = sizeof(wchar_t);
+	header.generation = generation;
+
+	for (const BackupFile& entry : index)
+	{
+		if (!entry.backups.empty())
+		{
+			++header.originalCount;
+			header.versionCount += entry.backups.size();
+			header.pathCharCount += GetPath(entry.originalPathId).size();
+		}
+	}
+
+	std::string contents(sizeof(IndexFileHeader) + header.versionCount * sizeof(StoredBackupVersion) + header.originalCount * sizeof(IndexFileOriginal) + header.pathCharCount * sizeof(wchar_t), '\0');
+
+	StoredBackupVersion* versions = (StoredBackupVersion*)(contents.data() + sizeof(IndexFileHeader));
+	IndexFileOriginal* originals = (IndexFileOriginal*)(versions + header.versionCount);
+	wchar_t* pathChars = (wchar_t*)(originals + header.originalCount);
+
+	StoredBackupVersion* fileVersion = versions;
+	IndexFileOriginal* original = originals;
+	uint64_t pathOffset = 0;
+
+	for (const BackupFile& entry : index)
+	{
+		if (entry.backups.empty())
+		{
+			continue;
+		}
+
+		std::wstring_view originalPath = GetPath(entry.originalPathId);
+		std::copy(originalPath.begin(), originalPath.end(), pathChars + pathOffset);
+
+		original->pathOffset = pathOffset;
+		original->pathLength = (uint32_t)originalPath.size();
+		original->versionCount = (uint32_t)entry.backups.size();
+		++original;
+		pathOffset += originalPath.size();
+
+		for (const BackupVersion& backupVersion : entry.backups)
+		{
+			*fileVersion++ = MakeStoredBackupVersion(backupVersion);
+		}
+	}
+
+	header.sectionsChecksum = HashBytes(contents.data() + sizeof(IndexFileHeader), contents.size() - sizeof(IndexFileHeader));
+	header.headerChecksum = ComputeHeaderChecksum(header);
+	memcpy(contents.data(), &header, sizeof(header));
+
+	return contents;
+}
+
+bool WriteBackupIndexFile(const std::fs::path& backupRootPath, const std::string& contents)
+{
+	std::lock_guard<std::mutex> lock(g_indexFile.mutex);
+
+	// A mapped file can't be replaced on Windows
+	CloseIndexFile_Locked();
+
+	std::fs::path indexFilePath = GetIndexFilePath(backupRootPath);
+	std::fs::path tempPath = indexFilePath;
+	tempPath += L".tmp";
+
+	std::error_code errorCode;
+	std::fs::create_directories(indexFilePath.parent_path(), errorCode);
+
+	{
+		std::ofstream tempStream(tempPath, std::ios::binary | std::ios::trunc);
+		if (!tempStream)
+		{
+			return false;
+		}
+
+		tempStream.write(contents.data(), (std::streamsize)contents.size());
+		tempStream.flush();
+
+		if (!tempStream)
+		{
+			tempStream.close();
+			std::fs::remove(tempPath, errorCode);
+			return false;
+		}
+	}
+
+	// A file torn by a crash around here fails its checksum and is walked around like a missing one
+	std::fs::rename(tempPath, indexFilePath, errorCode);
+	if (errorCode)
+	{
+		std::fs::remove(tempPath, errorCode);
+		return false;
+	}
+
+	// On disk before the journal starts over after it, a journal only replays on top of its own file
+	CommitBackupWrite(indexFilePath, g_settings.durability);
+	return true;
+}
+
+void RemoveBackupIndexFile(const std::fs::path& backupRootPath)
+{
+	std::lock_guard<std::mutex> lock(g_indexFile.mutex);
+
+	CloseIndexFile_Locked();
+
+	std::error_code errorCode;
+	std::fs::remove(GetIndexFilePath(backupRootPath), errorCode);
+}
@@ -0,0 +1,51 @@
+#ifndef INDEXFILE_H
+#define INDEXFILE_H
+
+// Persistent copy of the backup index, <backup root>\.lsc\index.bin, so startup doesn't have to walk the
+// backup root and parse every backup name. The file is a header followed by three sections: every
+// version, a table of originals each owning the next run of versions, and the path characters.
+// It is mapped read-only and read straight into the in-memory index. The header and the layout are
+// checked before anything is reported; the checksum of the sections is checked afterwards on a
+// background thread, so a large file doesn't have to be read through before the UI comes up.
+// The file is always rewritten whole, through a temporary file renamed over the old one. Each one is
+// a checkpoint with its own generation; the changes made since are in the index journal.
+
+static constexpr const wchar_t*	kIndexFolderName = L".lsc";
+
+// A version as the index file and the index journal store it
+struct StoredBackupVersion
+{
+	int64_t		timePointTicks;
+	int64_t		sourceWriteTimeTicks;
+	uint64_t	sourceSize;
+	uint64_t	storedBytes;
+	uint64_t	contentHash;
+	uint32_t	flags;
+	uint32_t	reserved;
+};
+
+StoredBackupVersion	MakeStoredBackupVersion(const BackupVersion& version);
+BackupVersion		MakeBackupVersion(const StoredBackupVersion& storedVersion);
+
+typedef std::function<void(std::wstring_view originalPath, const BackupVersion& version)> IndexFileVersionCallback;
+
+// Reports every version in the index file of backupRootPath, grouped by original, and the file's
+// generation. Returns false, without reporting anything, when there is no file or it is of another
+// format or doesn't check out.
+bool	LoadBackupIndexFile(const std::fs::path& backupRootPath, uint64_t& outGeneration, const IndexFileVersionCallback& callback);
+
+// True, once, when the background check of the file last loaded has found its contents don't match
+bool	PollBackupIndexFileCorrupt();
+
+// Waits for the background check and unmaps the file last loaded, for shutdown
+void	CloseBackupIndexFile();
+
+// The index in the file's layout, to be written by WriteBackupIndexFile. Called with the index locked,
+// the write can then happen outside the lock.
+std::string	SerializeBackupIndex(const BackupIndex& index, uint64_t generation);
+bool		WriteBackupIndexFile(const std::fs::path& backupRootPath, const std::string& contents);
+
+// Removes the file, for when the in-memory index is about to be rebuilt without it
+void		RemoveBackupIndexFile(const std::fs::path& backupRootPath);
+
+#endif // INDEXFILE_H
@@ -0,0 +1,408 @@
+#include "main.h"
+#include "pathpool.h"
+#include "backupindex.h"
+#include "indexfile.h"
+#include "indexjournal.h"
+#include "contenthash.h"
+#include "settings.h"
+#include "durability.h"
+
+#include <cstring>
+#include <fstream>
+
+static constexpr const wchar_t*	kIndexJournalFileName = L"index.journal";
+static constexpr uint32_t		kIndexJournalFormatVersion = 2;
+static constexpr char			kIndexJournalMagic[8] = { 'L', 'S', 'C', 'J', 'R', 'N', 'L', '1' };
+
+// Records arriving within this window share one write
+static constexpr uint32_t		kGroupCommitMs = 20;
+
+// Fold the journal into a new index file once it grows past this
+static constexpr uint64_t		kCheckpointJournalBytes = 4ull * 1024 * 1024;
+
+// Longer than any path Windows accepts, a record claiming more is garbage
+static constexpr uint32_t		kMaxRecordPathLength = 32768;
+
+struct IndexJournalHeader
+{
+	char		magic[8];
+	uint32_t	formatVersion;
+	uint32_t	wcharSize;
+	uint64_t	checkpointGeneration;	// Of the index file the records apply to
+};
+
+struct IndexJournalRecord
+{
+	uint32_t			recordType;
+	uint32_t			pathLength;		// The wchar_t path follows the record
+	StoredBackupVersion	version;
+	uint64_t			checksum;		// HashBytes of the record with this field zero, then the path
+};
+
+struct IndexJournal
+{
+	std::mutex						mutex;
+	std::condition_variable			condition;
+	std::string						buffer;
+	uint64_t						generation = 0;		// Of the index file the journal file follows
+	uint64_t						recordsSinceCheckpoint = 0;
+	uint64_t						checkpoints = 0;
+	bool							checkpointRequested = false;
+	bool							stopRequested = false;
+
+	std::fs::path					backupRootPath;
+	std::fs::path					path;
+	std::shared_mutex*				indexMutex = nullptr;
+	const BackupIndex*				index = nullptr;
+
+	// Only touched by the writer thread once it is running
+	std::ofstream					stream;
+	uint64_t						fileBytes = 0;
+
+	std::thread						writerThread;
+};
+
+// Only replaced with the index lock held, so journaling under that lock always finds it settled
+static std::unique_ptr<IndexJournal>	g_indexJournal;
+
+static uint64_t ComputeRecordChecksum(const IndexJournalRecord& record, std::wstring_view originalPath)
+{
+	IndexJournalRecord checksummedRecord = record;
+	checksummedRecord.checksum = 0;
+
+	ContentHasher hasher;
+	hasher.Update(&checksummedRecord, sizeof(checksummedRecord));
+	hasher.Update(originalPath.data(), originalPath.size() * sizeof(wchar_t));
+	return hasher.Finish();
+}
+
+// Starts the journal file over, empty, following the index file of generation. Returns false when the
+// journal can't be written, records made from then on would be lost.
+static bool ResetJournalFile(IndexJournal& journal, uint64_t generation)
+{
+	journal.stream.close();
+
+	IndexJournalHeader header = {};
+	memcpy(header.magic, kIndexJournalMagic, sizeof(kIndexJournalMagic));
+	header.formatVersion = kIndexJournalFormatVersion;
+	header.wcharSize = sizeof(wchar_t);
+	header.checkpointGeneration = generation;
+
+	std::fs::path tempPath = journal.path;
+	tempPath += L".tmp";
+
+	{
+		std::ofstream tempStream(tempPath, std::ios::binary | std::ios::trunc);
+		tempStream.write((const char*)&header, sizeof(header));
+		tempStream.flush();
+	}
+
+	std::error_code errorCode;
+	std::fs::rename(tempPath, journal.path, errorCode);
+
+	if (errorCode)
+	{
+		// Appending to the file still there would put the records behind a header of another generation,
+		// where replay never looks. It is rewritten in place instead; torn by a crash, it only loses
+		// records the index file already has.
+		std::fs::remove(tempPath, errorCode);
+
+		std::ofstream stream(journal.path, std::ios::binary | std::ios::trunc);
+		stream.write((const char*)&header, sizeof(header));
+		stream.flush();
+
+		if (!stream)
+		{
+			return false;
+		}
+	}
+
+	journal.stream.open(journal.path, std::ios::binary | std::ios::app);
+	journal.fileBytes = sizeof(header);
+	return journal.stream.is_open();
+}
+
+// Writes the index as a new index file and starts the journal over after it
+static void WriteCheckpoint(IndexJournal& journal)
+{
+	std::string contents;
+	uint64_t generation = 0;
+	size_t snapshotBufferBytes = 0;
+
+	{
+		// Records are only made under the index lock, so none can come in while the snapshot is taken
+		std::shared_lock<std::shared_mutex> indexLock(*journal.indexMutex);
+		std::lock_guard<std::mutex> lock(journal.mutex);
+
+		generation = (std::max)(journal.generation + 1, (uint64_t)std::chrono::system_clock::now().time_since_epoch().count());
+		contents = SerializeBackupIndex(*journal.index, generation);
+		snapshotBufferBytes = journal.buffer.size();
+	}
+
+	// The old index file and journal stay as they are until the new index file is in place; a crash in
+	// between leaves a journal of the old generation, which the new file doesn't replay
+	if (!WriteBackupIndexFile(journal.backupRootPath, contents))
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(journal.mutex);
+
+		// Records buffered before the snapshot are in the new file
+		journal.buffer.erase(0, snapshotBufferBytes);
+		journal.generation = generation;
+		journal.recordsSinceCheckpoint = 0;
+		++journal.checkpoints;
+	}
+
+	if (!ResetJournalFile(journal, generation))
+	{
+		// The records to come can't follow the new index file, which must not be loaded without them. The
+		// next start walks the backup root instead, the next checkpoint tries again.
+		journal.stream.close();
+		RemoveBackupIndexFile(journal.backupRootPath);
+	}
+}
+
+static void IndexJournalWriterProc(IndexJournal* journal)
+{
+	std::string pendingBytes;
+
+	std::unique_lock<std::mutex> lock(journal->mutex);
+
+	while (true)
+	{
+		journal->condition.wait(lock, [journal]()
+		{
+			return journal->stopRequested || journal->checkpointRequested || !journal->buffer.empty();
+		});
+
+		if (journal->buffer.empty() && journal->stopRequested)
+		{
+			break;
+		}
+
+		// Group commit: give concurrent callers a moment to add to this batch
+		if (!journal->stopRequested && !journal->checkpointRequested)
+		{
+			lock.unlock();
+			std::this_thread::sleep_for(std::chrono::milliseconds(kGroupCommitMs));
+			lock.lock();
+		}
+
+		pendingBytes.clear();
+		pendingBytes.swap(journal->buffer);
+
+		// Not on the way out, the journal replays just as well next time
+		bool writeCheckpoint = !journal->stopRequested && (journal->checkpointRequested || journal->fileBytes + pendingBytes.size() > kCheckpointJournalBytes);
+		journal->checkpointRequested = false;
+
+		lock.unlock();
+
+		if (!pendingBytes.empty())
+		{
+			journal->stream.write(pendingBytes.data(), (std::streamsize)pendingBytes.size());
+			journal->stream.flush();
+			journal->fileBytes += pendingBytes.size();
+
+			// As durable as the backups the records list: a version whose file survived a power loss is
+			// only ever found through its record, nothing walks the root while the index file loads
+			CommitBackupWrite(journal->path, g_settings.durability);
+		}
+
+		if (writeCheckpoint)
+		{
+			WriteCheckpoint(*journal);
+		}
+
+		lock.lock();
+	}
+}
+
+bool OpenIndexJournal(const std::fs::path& backupRootPath, uint64_t checkpointGeneration, std::shared_mutex& indexMutex, const BackupIndex& index, const IndexJournalReplayCallback& replayCallback)
+{
+	auto journal = std::make_unique<IndexJournal>();
+	journal->backupRootPath = backupRootPath;
+	journal->path = backupRootPath / kIndexFolderName / kIndexJournalFileName;
+	journal->indexMutex = &indexMutex;
+	journal->index = &index;
+	journal->generation = checkpointGeneration;
+
+	bool isReplayed = false;
+	uint64_t validBytes = 0;
+
+	if (replayCallback)
+	{
+		std::ifstream readStream(journal->path, std::ios::binary);
+		IndexJournalHeader header = {};
+
+		if (readStream.read((char*)&header, sizeof(header)) &&
+			memcmp(header.magic, kIndexJournalMagic, sizeof(kIndexJournalMagic)) == 0 &&
+			header.formatVersion == kIndexJournalFormatVersion &&
+			header.wcharSize == sizeof(wchar_t) &&
+			header.checkpointGeneration == checkpointGeneration)
+		{
+			isReplayed = true;
+			validBytes = sizeof(header);
+
+			IndexJournalRecord record = {};
+			std::wstring originalPath;
+
+			while (readStream.read((char*)&record, sizeof(record)))
+			{
+				if (record.pathLength == 0 || record.pathLength > kMaxRecordPathLength)
+				{
+					break;
+				}
+
+				originalPath.resize(record.pathLength);
+				if (!readStream.read((char*)originalPath.data(), (std::streamsize)(record.pathLength * sizeof(wchar_t))) ||
+					ComputeRecordChecksum(record, originalPath) != record.checksum)
+				{
+					break;
+				}
+
+				replayCallback((IndexJournalRecordType)record.recordType, originalPath, MakeBackupVersion(record.version));
+
+				validBytes += sizeof(record) + record.pathLength * sizeof(wchar_t);
+				++journal->recordsSinceCheckpoint;
+			}
+		}
+	}
+
+	std::error_code errorCode;
+	std::fs::create_directories(journal->path.parent_path(), errorCode);
+
+	if (isReplayed)
+	{
+		// A torn record left by a crash is cut off, new records go right after the last good one
+		std::fs::resize_file(journal->path, validBytes, errorCode);
+
+		journal->stream.open(journal->path, std::ios::binary | std::ios::app);
+		journal->fileBytes = validBytes;
+	}
+	else
+	{
+		ResetJournalFile(*journal, checkpointGeneration);
+	}
+
+	if (!journal->stream.is_open())
+	{
+		return false;
+	}
+
+	journal->writerThread = std::thread(IndexJournalWriterProc, journal.get());
+	g_indexJournal = std::move(journal);
+	return true;
+}
+
+void CloseIndexJournal()
+{
+	if (!g_indexJournal)
+	{
+		return;
+	}
+
+	std::unique_ptr<IndexJournal> journal;
+	{
+		std::unique_lock<std::shared_mutex> indexLock(*g_indexJournal->indexMutex);
+		journal = std::move(g_indexJournal);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(journal->mutex);
+		journal->stopRequested = true;
+	}
+	journal->condition.notify_all();
+
+	if (journal->writerThread.joinable())
+	{
+		journal->writerThread.join();
+	}
+
+	journal->stream.close();
+}
+
+void RequestIndexCheckpoint()
+{
+	if (!g_indexJournal)
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_indexJournal->mutex);
+		g_indexJournal->checkpointRequested = true;
+	}
+	g_indexJournal->condition.notify_one();
+}
+
+static void AppendRecord(IndexJournalRecordType recordType, PathId originalPathId, const StoredBackupVersion& version)
+{
+	if (!g_indexJournal)
+	{
+		return;
+	}
+
+	std::wstring_view originalPath = GetPath(originalPathId);
+
+	IndexJournalRecord record = {};
+	record.recordType = (uint32_t)recordType;
+	record.pathLength = (uint32_t)originalPath.size();
+	record.version = version;
+	record.checksum = ComputeRecordChecksum(record, originalPath);
+
+	bool wakeWriter = false;
+	{
+		std::lock_guard<std::mutex> lock(g_indexJournal->mutex);
+
+		wakeWriter = g_indexJournal->buffer.empty();
+		g_indexJournal->buffer.append((const char*)&record, sizeof(record));
+		g_indexJournal->buffer.append((const char*)originalPath.data(), originalPath.size() * sizeof(wchar_t));
+		++g_indexJournal->recordsSinceCheckpoint;
+	}
+
+	if (wakeWriter)
+	{
+		g_indexJournal->condition.notify_one();
+	}
+}
+
+void JournalVersionAdded(PathId originalPathId, const BackupVersion& version)
+{
+	AppendRecord(IndexJournalRecordType::VersionAdded, originalPathId, MakeStoredBackupVersion(version));
+}
+
+void JournalVersionRemoved(PathId originalPathId, const TimePoint& timePoint)
+{
+	StoredBackupVersion version = {};
+	version.timePointTicks = (int64_t)timePoint.time_since_epoch().count();
+
+	AppendRecord(IndexJournalRecordType::VersionRemoved, originalPathId, version);
+}
+
+void JournalOriginalRemoved(PathId originalPathId)
+{
+	AppendRecord(IndexJournalRecordType::OriginalRemoved, originalPathId, StoredBackupVersion());
+}
+
+void JournalVersionUpdated(PathId originalPathId, const BackupVersion& version)
+{
+	AppendRecord(IndexJournalRecordType::VersionUpdated, originalPathId, MakeStoredBackupVersion(version));
+}
+
+void GetIndexJournalCounts(uint64_t& outRecords, uint64_t& outCheckpoints)
+{
+	outRecords = 0;
+	outCheckpoints = 0;
+
+	if (!g_indexJournal)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(g_indexJournal->mutex);
+	outRecords = g_indexJournal->recordsSinceCheckpoint;
+	outCheckpoints = g_indexJournal->checkpoints;
+}
@@ -0,0 +1,43 @@
+#ifndef INDEXJOURNAL_H
+#define INDEXJOURNAL_H
+
+// Append-only journal of the changes made to the backup index since its index file was written,
+// <backup root>\.lsc\index.journal. The journal starts with the generation of the index file it
+// follows and only replays on top of that one. Every record carries its own checksum, replay stops at
+// the first one that doesn't check out, which is where a crash cut the file short.
+// Records are made while the caller holds the index lock, so the journal has the changes in the
+// order the index saw them, but only buffered there; a background thread appends them in groups.
+// Once the journal grows large the same thread folds it into a new index file and starts over.
+// Replaying is idempotent, a change that is in the index file already changes nothing.
+
+enum class IndexJournalRecordType : uint32_t
+{
+	VersionAdded = 1,
+	VersionRemoved = 2,		// Only the version's time point is recorded
+	OriginalRemoved = 3,	// Every version of the original went
+	VersionUpdated = 4,		// Replaces the version with the same time point
+};
+
+typedef std::function<void(IndexJournalRecordType recordType, std::wstring_view originalPath, const BackupVersion& version)> IndexJournalReplayCallback;
+
+// Replays the journal of backupRootPath if it follows the index file of checkpointGeneration, then
+// keeps it open for the changes to come. index is read, under indexMutex, for each new index file.
+// Call with indexMutex held exclusively; replayCallback may be nullptr to start a new journal.
+bool	OpenIndexJournal(const std::fs::path& backupRootPath, uint64_t checkpointGeneration, std::shared_mutex& indexMutex, const BackupIndex& index, const IndexJournalReplayCallback& replayCallback);
+
+// Appends anything still buffered and stops the writer thread. Not with the index lock held.
+void	CloseIndexJournal();
+
+// Has the writer thread write a new index file and empty the journal soon
+void	RequestIndexCheckpoint();
+
+// Called with the index lock held, once the change is in the index
+void	JournalVersionAdded(PathId originalPathId, const BackupVersion& version);
+void	JournalVersionRemoved(PathId originalPathId, const TimePoint& timePoint);
+void	JournalOriginalRemoved(PathId originalPathId);
+void	JournalVersionUpdated(PathId originalPathId, const BackupVersion& version);
+
+// Records appended since the last index file, and index files written by the journal
+void	GetIndexJournalCounts(uint64_t& outRecords, uint64_t& outCheckpoints);
+
+#endif // INDEXJOURNAL_H
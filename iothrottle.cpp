@@ -0,0 +1,98 @@
+#include "main.h"
+#include "iothrottle.h"
+
+#if defined(_WIN32)
+#elif defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Waits are cut into slices this long so a changed limit takes effect on a waiting thread
+static constexpr uint32_t kMaxThrottleSleepMs = 100;
+
+struct TokenBucket
+{
+	std::mutex								mutex;
+	double									ratePerSec = 0.0;	// 0 when unlimited
+	double									tokens = 0.0;		// Negative while in debt
+	std::chrono::steady_clock::time_point	lastRefillTime;
+};
+
+static TokenBucket				g_byteBucket;
+static TokenBucket				g_operationBucket;
+static std::atomic<uint64_t>	g_throttledMs = 0;
+
+static void SetBucketRate(TokenBucket& bucket, double ratePerSec)
+{
+	std::lock_guard<std::mutex> lock(bucket.mutex);
+
+	bucket.ratePerSec = ratePerSec;
+	bucket.tokens = ratePerSec;
+	bucket.lastRefillTime = std::chrono::steady_clock::now();
+}
+
+// Waits until the bucket is out of debt, then takes amount from it. Taking more than is there is
+// allowed, the debt is paid off by whoever comes next, so a large file isn't held back for good.
+static void TakeFromBucket(TokenBucket& bucket, double amount)
+{
+	std::unique_lock<std::mutex> lock(bucket.mutex);
+
+	while (bucket.ratePerSec > 0.0)
+	{
+		auto now = std::chrono::steady_clock::now();
+		double elapsedSec = std::chrono::duration<double>(now - bucket.lastRefillTime).count();
+		bucket.lastRefillTime = now;
+
+		// Up to one second of rate builds up while the pipeline is idle
+		bucket.tokens = (std::min)(bucket.tokens + elapsedSec * bucket.ratePerSec, bucket.ratePerSec);
+
+		if (bucket.tokens >= 0.0)
+		{
+			bucket.tokens -= amount;
+			return;
+		}
+
+		uint32_t waitMs = (uint32_t)(std::min)(-bucket.tokens / bucket.ratePerSec * 1000.0 + 1.0, (double)kMaxThrottleSleepMs);
+
+		lock.unlock();
+		std::this_thread::sleep_for(std::chrono::milliseconds(waitMs));
+		g_throttledMs.fetch_add(waitMs, std::memory_order_relaxed);
+		lock.lock();
+	}
+}
+
+void SetBackupIoLimits(uint32_t maxMegabytesPerSec, uint32_t maxOperationsPerSec)
+{
+	SetBucketRate(g_byteBucket, (double)maxMegabytesPerSec * 1024.0 * 1024.0);
+	SetBucketRate(g_operationBucket, (double)maxOperationsPerSec);
+}
+
+void ThrottleBackupBytes(uint64_t byteCount)
+{
+	TakeFromBucket(g_byteBucket, (double)byteCount);
+}
+
+void ThrottleBackupOperation()
+{
+	TakeFromBucket(g_operationBucket, 1.0);
+}
+
+void SetBackgroundIoPriority()
+{
+#if defined(_WIN32)
+	// Also lowers the thread's scheduling and memory priority, the copy threads only ever do backups
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#elif defined(__linux__)
+	// glibc has no wrapper for ioprio_set. Idle class I/O is only served when the disk has nothing else to do.
+	static constexpr int kIoprioWhoProcess = 1;
+	static constexpr int kIoprioClassIdle = 3;
+	static constexpr int kIoprioClassShift = 13;
+
+	syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, kIoprioClassIdle << kIoprioClassShift);
+#endif
+}
+
+uint64_t GetBackupThrottledMs()
+{
+	return g_throttledMs.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,24 @@
+#ifndef IOTHROTTLE_H
+#define IOTHROTTLE_H
+
+// Keeps backups from competing with foreground work for the disk. Two token buckets cap the bytes
+// and the files the backup pipeline writes per second; each holds up to one second of its rate, so
+// after a quiet spell a burst of saves goes through at full speed. The copy threads also run at
+// background I/O priority, so the disk serves everyone else first when it is busy.
+
+// Limits of 0 leave that bucket unlimited
+void	SetBackupIoLimits(uint32_t maxMegabytesPerSec, uint32_t maxOperationsPerSec);
+
+// Charges byteCount bytes of backup I/O, first waiting while the byte bucket is in debt
+void	ThrottleBackupBytes(uint64_t byteCount);
+
+// Charges one stored file, first waiting while the operation bucket is in debt
+void	ThrottleBackupOperation();
+
+// Puts the calling thread's I/O at background priority (idle class on Linux)
+void	SetBackgroundIoPriority();
+
+// Total time backup I/O has spent waiting on the limits
+uint64_t	GetBackupThrottledMs();
+
+#endif // IOTHROTTLE_H
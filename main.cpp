@@ -4,12 +4,27 @@
 #include "app.h"
 #include "util.h"
 #include "settings.h"
+#include "watcher.h"
+#include "boundedqueue.h"
+#include "scanner.h"
+#include "timerwheel.h"
+#include "pendingjournal.h"
+#include "contenthash.h"
+#include "copyengine.h"
+#include "objectstore.h"
+#include "deltastore.h"
+#include "compressedstore.h"
+#include "packstore.h"
+#include "durability.h"
+#include "iothrottle.h"
+#include "pathpool.h"
+#include "backupindex.h"
+#include "indexfile.h"
+#include "indexjournal.h"
 #include "imgui/imgui_internal.h"
 
 using namespace std::chrono;
 
-typedef std::chrono::system_clock::time_point TimePoint;
-
 enum class DateFilterMode
 {
 	All,
@@ -27,42 +42,143 @@ struct DateFilterState
 	TimePoint rangeEnd = {};
 };
 
-struct BackupFile
+struct BackupRequest
 {
-	std::vector<TimePoint>	backups;
-	std::wstring			originalPath;
+	std::wstring	filePath;
+	uint32_t		folderIndex = 0;
+};
 
-	void SortBackupTimes()
-	{
-		std::sort(backups.begin(), backups.end(), [](const TimePoint& left, const TimePoint& right)
-		{
-			return left < right;
-		});
-	}
+static constexpr size_t kBackupQueueCapacity = 4096;
+
+// Upper bounds (ms) of the quiet window histogram buckets reported in the stats
+static constexpr uint32_t kQuietWindowBucketLimits[] = { 150, 300, 600, 1200, 2500, 5000 };
+static constexpr size_t kQuietWindowBucketCount = std::size(kQuietWindowBucketLimits);
+
+// Size and last write time of a file as of its last backup or reconcile pass
+struct FileSnapshot
+{
+	uint64_t					size = 0;
+	std::fs::file_time_type		lastWriteTime = {};
+};
+
+// One OS watch. Watched folders that are nested inside (or identical to) another recursively watched
+// folder don't get a watch of their own; they are listed in folderIndices of the root that covers them.
+struct WatchRoot
+{
+	std::wstring			path;
+	bool					includeSubfolders = true;
+	std::vector<uint32_t>	folderIndices;
 };
 
+// Every watch root is serviced by one thread over one multiplexed backend. The watchId handed to the
+// backend is the index into watchRoots.
+// The watch thread only decides when a file has settled; the copy itself is handed to a pool of copy
+// threads through backupQueue so a slow copy never delays re-arming the OS notifications.
 struct FolderWatcher
 {
-	WatchedFolder								config;
+	std::vector<WatchedFolder>					folders;
+	std::vector<std::wstring>					folderPathKeys;
+
+	// Journaled paths still waiting for a backup, handed over from the previous run (or watcher) and
+	// handed back on stop
+	std::vector<std::wstring>					replayPaths;
+	std::vector<std::wstring>					unfinishedPaths;
+
+	std::vector<WatchRoot>						watchRoots;
 	std::thread									workerThread;
-	HANDLE										directoryHandle = INVALID_HANDLE_VALUE;
+	std::unique_ptr<WatchBackend>				backend;
 	std::atomic<bool>							stopRequested = false;
+
+	BoundedQueue<BackupRequest>					backupQueue{ kBackupQueueCapacity };
+	std::vector<std::thread>					copyThreads;
+	std::mutex									copyWakeMutex;
+	std::condition_variable						copyWakeCondition;
+	std::atomic<uint32_t>						idleCopyThreads = 0;
+	std::atomic<bool>							copyStopRequested = false;
+	std::atomic<uint64_t>						completedCopies = 0;
+
+	// Paths queued or being copied. A path is not queued again until its previous copy finishes.
+	std::mutex									inFlightMutex;
+	std::uset<std::wstring>						inFlightPaths;
+
+	// When the OS drops notifications (Overflow) the affected watch root is queued for a reconcile pass,
+	// which compares the files on disk against these snapshots. Request ticks are per watch root, 0 = none.
+	std::fs::file_time_type						watchStartTime = {};
+	std::mutex									snapshotMutex;
+	std::umap<std::wstring, FileSnapshot>		snapshots;
+
+	std::thread									reconcileThread;
+	std::mutex									reconcileMutex;
+	std::condition_variable						reconcileCondition;
+	std::vector<uint64_t>						reconcileRequestTicks;
+	std::atomic<uint64_t>						reconcilePasses = 0;
+	std::atomic<uint64_t>						reconcileQueued = 0;
+
+	// The reconcile thread starts with a catch-up pass over every watch root, queueing files that changed
+	// while the app wasn't running (or that have no backup yet, for a newly added folder)
+	std::atomic<bool>							catchUpRunning = false;
+	std::atomic<uint64_t>						catchUpScanned = 0;
+	std::atomic<uint64_t>						catchUpQueued = 0;
+
+	// Debounce policy and its stats. Settled backups went quiet for their window, forced ones hit the
+	// max latency cap while still being written.
+	uint64_t									maxLatencyMs = 0;
+	std::atomic<uint64_t>						settledBackups = 0;
+	std::atomic<uint64_t>						forcedBackups = 0;
+	std::atomic<uint64_t>						quietWindowSumMs = 0;
+	std::atomic<uint64_t>						quietWindowHistogram[kQuietWindowBucketCount] = {};
+
+	// Pending files dropped because they were deleted or renamed away before settling (editor temp files)
+	std::atomic<uint64_t>						collapsedTempFiles = 0;
+};
+
+struct BackupPipelineStats
+{
+	uint32_t	copyThreads = 0;
+	uint32_t	busyCopyThreads = 0;
+	size_t		depth = 0;
+	size_t		capacity = 0;
+	size_t		highWater = 0;
+	uint64_t	pushed = 0;
+	uint64_t	rejected = 0;
+	uint64_t	completed = 0;
+	uint64_t	reconcilePasses = 0;
+	uint64_t	reconcileQueued = 0;
+	bool		catchUpRunning = false;
+	uint64_t	catchUpScanned = 0;
+	uint64_t	catchUpQueued = 0;
+	uint64_t	settledBackups = 0;
+	uint64_t	forcedBackups = 0;
+	uint32_t	averageQuietWindowMs = 0;
+	uint64_t	quietWindowHistogram[kQuietWindowBucketCount] = {};
+	uint64_t	collapsedTempFiles = 0;
+	uint64_t	skippedUnchanged = 0;
+	uint64_t	copyRetries = 0;
+	uint64_t	tornBackups = 0;
+	uint64_t	dedupedBackups = 0;
+	uint64_t	dedupedBytes = 0;
+	uint64_t	deltaBackups = 0;
+	uint64_t	deltaBytesSaved = 0;
+	uint64_t	compressedBackups = 0;
+	uint64_t	compressionBytesSaved = 0;
+	uint64_t	packedBackups = 0;
 };
 
 static std::shared_mutex									g_indexMutex;
-static std::list<BackupFile>								g_backupIndex;
+static BackupIndex											g_backupIndex;
 static std::mutex											g_historyMutex;
 
 struct HistoryEntry
 {
-	std::wstring originalPath;
+	PathId originalPathId = kInvalidPathId;
 	TimePoint timePoint = {};
 };
 
 static std::vector<HistoryEntry>							g_filteredEntries;
 
 static std::mutex											g_watchersMutex;
-static std::vector<std::unique_ptr<FolderWatcher>>			g_watchers;
+static std::unique_ptr<FolderWatcher>						g_watcher;
+static std::vector<std::wstring>							g_replayPendingPaths;
 
 static std::atomic<uint32_t>								g_backupsToday;
 static std::wstring											g_todayPrefix;
@@ -208,7 +324,7 @@ static std::wstring BuildTodayPrefixFromTimePoint(const TimePoint& timePoint)
 		tmv.tm_mday);
 }
 
-static std::wstring MakeBackupPathFromTimePoint(const std::wstring& backupRoot, const std::wstring& originalFullPath, const TimePoint& timePoint)
+static std::wstring MakeBackupPathFromTimePoint(const std::wstring& backupRoot, std::wstring_view originalFullPath, const TimePoint& timePoint)
 {
 	std::fs::path originalPath(originalFullPath);
 	std::fs::path originalDir = originalPath.parent_path();
@@ -361,9 +477,9 @@ static bool DateFilterMatches(const DateFilterState& filter, const TimePoint& ti
 
 static bool AnyBackupMatchesDateFilter(const DateFilterState& filter, const BackupFile& entry)
 {
-	for (const TimePoint& timePoint : entry.backups)
+	for (const BackupVersion& backupVersion : entry.backups)
 	{
-		if (DateFilterMatches(filter, timePoint))
+		if (DateFilterMatches(filter, backupVersion.timePoint))
 		{
 			return true;
 		}
@@ -372,19 +488,19 @@ static bool AnyBackupMatchesDateFilter(const DateFilterState& filter, const Back
 	return false;
 }
 
-static void RemoveFromFilteredEntries(const std::wstring& originalPath, const TimePoint& timePoint)
+static void RemoveFromFilteredEntries(PathId originalPathId, const TimePoint& timePoint)
 {
 	std::lock_guard<std::mutex> lock(g_historyMutex);
 
 	g_filteredEntries.erase(
 		std::remove_if(g_filteredEntries.begin(), g_filteredEntries.end(), [&](const HistoryEntry& entry)
 		{
-			return entry.originalPath == originalPath && entry.timePoint == timePoint;
+			return entry.originalPathId == originalPathId && entry.timePoint == timePoint;
 		}),
 		g_filteredEntries.end());
 }
 
-static void InsertFilteredEntries(const std::wstring& originalPath, const TimePoint& timePoint)
+static void InsertFilteredEntries(PathId originalPathId, const TimePoint& timePoint)
 {
 	if (!DateFilterMatches(g_historyDateFilter, timePoint))
 	{
@@ -392,7 +508,7 @@ static void InsertFilteredEntries(const std::wstring& originalPath, const TimePo
 	}
 
 	HistoryEntry item = {};
-	item.originalPath = originalPath;
+	item.originalPathId = originalPathId;
 	item.timePoint = timePoint;
 
 	std::lock_guard<std::mutex> lock(g_historyMutex);
@@ -415,16 +531,16 @@ static void RebuildFilteredEntries()
 
 		for (const BackupFile& entry : g_backupIndex)
 		{
-			for (const TimePoint& timePoint : entry.backups)
+			for (const BackupVersion& backupVersion : entry.backups)
 			{
-				if (!DateFilterMatches(g_historyDateFilter, timePoint))
+				if (!DateFilterMatches(g_historyDateFilter, backupVersion.timePoint))
 				{
 					continue;
 				}
 
 				HistoryEntry item = {};
-				item.originalPath = entry.originalPath;
-				item.timePoint = timePoint;
+				item.originalPathId = entry.originalPathId;
+				item.timePoint = backupVersion.timePoint;
 				rebuilt.push_back(std::move(item));
 			}
 		}
@@ -556,7 +672,7 @@ static void DrawDateFilterControls(DateFilterState& filter)
 	}
 }
 
-static std::wstring MakeBackupWildcardPath(const std::wstring& backupRoot, const std::wstring& originalFullPath)
+static std::wstring MakeBackupWildcardPath(const std::wstring& backupRoot, std::wstring_view originalFullPath)
 {
 	std::fs::path originalPath(originalFullPath);
 	std::fs::path originalDir = originalPath.parent_path();
@@ -612,22 +728,93 @@ static bool IsPaused()
 }
 
 
+static BackupFile* FindBackupEntry_Locked(const std::wstring& originalPath)
+{
+	// A path that was never interned has no entry
+	return g_backupIndex.Find(FindPathId(originalPath));
+}
+
 static BackupFile& GetOrCreateBackupEntry_Locked(const std::wstring& originalPath)
 {
-	auto itr = g_backupIndex.end();
+	return g_backupIndex.FindOrAdd(InternPath(originalPath));
+}
+
+// Applies one journaled change on top of what the index file loaded. A change the file already has,
+// because the journal was cut short of its checkpoint, changes nothing.
+static void ReplayIndexJournalRecord_Locked(IndexJournalRecordType recordType, std::wstring_view originalPath, const BackupVersion& backupVersion)
+{
+	if (recordType == IndexJournalRecordType::VersionAdded)
+	{
+		BackupFile& entry = g_backupIndex.FindOrAdd(InternPath(originalPath));
+
+		bool isIndexed = std::any_of(entry.backups.begin(), entry.backups.end(), [&](const BackupVersion& indexedVersion)
+		{
+			return indexedVersion.timePoint == backupVersion.timePoint;
+		});
+
+		if (!isIndexed)
+		{
+			entry.backups.push_back(backupVersion);
+		}
+		return;
+	}
+
+	BackupFile* entry = g_backupIndex.Find(FindPathId(originalPath));
+	if (!entry)
+	{
+		return;
+	}
+
+	switch (recordType)
+	{
+		case IndexJournalRecordType::VersionRemoved:
+			entry->backups.erase(std::remove_if(entry->backups.begin(), entry->backups.end(), [&](const BackupVersion& indexedVersion)
+			{
+				return indexedVersion.timePoint == backupVersion.timePoint;
+			}), entry->backups.end());
+			break;
+
+		case IndexJournalRecordType::OriginalRemoved:
+			entry->backups.clear();
+			break;
+
+		case IndexJournalRecordType::VersionUpdated:
+			for (BackupVersion& indexedVersion : entry->backups)
+			{
+				if (indexedVersion.timePoint == backupVersion.timePoint)
+				{
+					indexedVersion = backupVersion;
+				}
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+static uint32_t CountBackupsToday_Locked()
+{
+	auto now = std::chrono::system_clock::now();
+	auto tt = std::chrono::system_clock::to_time_t(now);
+	tm tmv = {};
+	localtime_s(&tmv, &tt);
+
+	DateFilterState todayFilter = {};
+	todayFilter.mode = DateFilterMode::Today;
+	SetRelativeDayFilterRange(todayFilter, tmv, 0);
 
-	for (itr = g_backupIndex.begin(); itr != g_backupIndex.end(); ++itr)
+	uint32_t backupCount = 0;
+
+	for (const BackupFile& entry : g_backupIndex)
 	{
-		if (itr->originalPath == originalPath)
+		for (const BackupVersion& backupVersion : entry.backups)
 		{
-			return *itr;
+			backupCount += DateFilterMatches(todayFilter, backupVersion.timePoint) ? 1 : 0;
 		}
 	}
 
-	BackupFile entry = {};
-	entry.originalPath = originalPath;
-	g_backupIndex.push_back(std::move(entry));
-	return g_backupIndex.back();
+	return backupCount;
 }
 
 static bool FilterMatchToken(
@@ -752,512 +939,2042 @@ static void EnsureDirExists(const std::fs::path& directoryPath)
 	std::fs::create_directories(directoryPath, errorCode);
 }
 
-static uint64_t ComputeFolderSizeBytes(const std::fs::path& rootPath)
+// Bytes the backup root takes on disk, shared content counted once. Seeded from the index by each scan;
+// after that each backup adds what it stored and each removal takes off what it freed, so checking the
+// limit after every backup costs nothing. A background thread walks the root shortly after each scan and
+// every kBackupRootReconcileMs after that, and corrects whatever the total drifted by.
+static constexpr uint64_t									kBackupRootReconcileMs = 60 * 60 * 1000;
+static constexpr uint64_t									kBackupRootReconcileDelayMs = 30 * 1000;
+static constexpr uint64_t									kBackupRootReconcileRetryMs = 5 * 60 * 1000;
+static std::atomic<uint64_t>								g_backupRootBytes = 0;
+static std::atomic<uint64_t>								g_backupRootChanges = 0;			// Moves on each addition or removal
+static std::atomic<uint64_t>								g_backupRootGeneration = 0;			// Moves on each time the total is seeded
+static std::atomic<uint64_t>								g_backupRootMeasuredTicks = 0;		// 0 until measured
+static std::atomic<int64_t>									g_backupRootDriftBytes = 0;			// Corrected by the last measurement
+
+struct BackupRootReconciler
 {
-	uint64_t totalBytes = 0;
-	std::error_code errorCode;
+	std::mutex					mutex;
+	std::condition_variable		condition;
+	std::fs::path				backupRootPath;
+	uint64_t					requestTicks = 0;		// A pass is due kBackupRootReconcileDelayMs after this
+	std::atomic<bool>			stopRequested = false;
+	std::thread					thread;
+};
+
+static BackupRootReconciler									g_backupRootReconciler;
+
+static void AddBackupRootBytes(uint64_t bytes)
+{
+	if (bytes == 0)
+	{
+		return;
+	}
 
-	if (!std::fs::exists(rootPath, errorCode))
+	g_backupRootChanges.fetch_add(1);
+	g_backupRootBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+static void SubtractBackupRootBytes(uint64_t bytes)
+{
+	if (bytes == 0)
 	{
-		return 0;
+		return;
 	}
 
-	for (auto iterator = std::fs::recursive_directory_iterator(rootPath, std::fs::directory_options::skip_permission_denied, errorCode);
-		iterator != std::fs::recursive_directory_iterator();
-		++iterator)
+	g_backupRootChanges.fetch_add(1);
+
+	// Clamped, a removal of something the last measurement never saw mustn't wrap the total
+	uint64_t currentBytes = g_backupRootBytes.load(std::memory_order_relaxed);
+	while (!g_backupRootBytes.compare_exchange_weak(currentBytes, currentBytes > bytes ? currentBytes - bytes : 0, std::memory_order_relaxed))
 	{
-		if (errorCode)
-		{
-			errorCode.clear();
-			continue;
-		}
+	}
+}
+
+// Sums what the indexed versions store, content several versions share counted once, like on disk. A
+// repeated (hash, size) is a deduplicated copy unless it is packed: pack records are never shared.
+static uint64_t ComputeIndexedBackupBytes_Locked(const std::wstring& backupRoot)
+{
+	std::set<std::pair<uint64_t, uint64_t>> storedContents;
+	uint64_t totalBytes = 0;
 
-		if (iterator->is_regular_file(errorCode))
+	for (const BackupFile& entry : g_backupIndex)
+	{
+		for (const BackupVersion& backupVersion : entry.backups)
 		{
-			totalBytes += (uint64_t)iterator->file_size(errorCode);
+			if (backupVersion.hasContentHash && !storedContents.insert({ backupVersion.contentHash, backupVersion.storedBytes }).second &&
+				!IsPackedBackup(MakeBackupPathFromTimePoint(backupRoot, GetPath(entry.originalPathId), backupVersion.timePoint)))
+			{
+				continue;
+			}
+
+			totalBytes += backupVersion.storedBytes;
 		}
 	}
 
 	return totalBytes;
 }
 
-static void EnforcePerFileLimit_Locked(BackupFile& entry, uint32_t maxBackupsPerFile, std::vector<HistoryEntry>& removedHistoryEntries)
+// Walks the backup root for its actual size and corrects the running total by what it missed (orphaned
+// blobs, files changed outside the app). Whether the walk saw a backup stored or removed meanwhile is
+// anyone's guess, so the pass is dropped when the total changed during it, or was seeded again. Returns
+// false then.
+static bool ReconcileBackupRootBytes(const std::fs::path& backupRootPath)
 {
-	if (maxBackupsPerFile == 0)
+	uint64_t generation = g_backupRootGeneration.load();
+
+	SubtractBackupRootBytes(RemoveOrphanedObjects(backupRootPath));
+
+	uint64_t changes = g_backupRootChanges.load();
+	uint64_t trackedBytes = g_backupRootBytes.load();
+	uint64_t measuredBytes = 0;
+
+	if (!ComputePhysicalBackupBytes(backupRootPath, g_backupRootReconciler.stopRequested, measuredBytes) ||
+		g_backupRootChanges.load() != changes || g_backupRootGeneration.load() != generation)
 	{
-		return;
+		return false;
 	}
 
-	entry.SortBackupTimes();
+	int64_t driftBytes = (int64_t)(measuredBytes - trackedBytes);
+	if (driftBytes >= 0)
+	{
+		AddBackupRootBytes((uint64_t)driftBytes);
+	}
+	else
+	{
+		SubtractBackupRootBytes((uint64_t)-driftBytes);
+	}
+
+	g_backupRootDriftBytes.store(driftBytes);
+	g_backupRootMeasuredTicks.store(GetTickCount64());
+	return true;
+}
+
+// Walks the root a while after each request, and hourly otherwise, at background I/O priority so the
+// walk never gets in the way of the app or anything else using the disk. A dropped pass is tried again
+// kBackupRootReconcileRetryMs later.
+static void BackupRootReconcileProc()
+{
+	SetBackgroundIoPriority();
+
+	BackupRootReconciler& reconciler = g_backupRootReconciler;
+	std::unique_lock<std::mutex> lock(reconciler.mutex);
 
-	size_t validCount = entry.backups.size();
-	while (validCount > maxBackupsPerFile)
+	uint64_t nextPassTicks = GetTickCount64() + kBackupRootReconcileMs;
+
+	while (!reconciler.stopRequested.load())
 	{
-		auto oldestIt = entry.backups.begin();
-		if (oldestIt == entry.backups.end())
+		uint64_t dueTicks = nextPassTicks;
+		if (reconciler.requestTicks != 0)
 		{
-			break;
+			dueTicks = (std::min)(dueTicks, reconciler.requestTicks + kBackupRootReconcileDelayMs);
+		}
+
+		uint64_t nowTicks = GetTickCount64();
+		if (nowTicks < dueTicks)
+		{
+			reconciler.condition.wait_for(lock, std::chrono::milliseconds(dueTicks - nowTicks));
+			continue;
 		}
 
-		TimePoint oldestTimePoint = *oldestIt;
-		entry.backups.erase(oldestIt);
-		--validCount;
+		reconciler.requestTicks = 0;
+		std::fs::path backupRootPath = reconciler.backupRootPath;
 
-		std::wstring oldestBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, entry.originalPath, oldestTimePoint);
-		std::error_code removeError;
-		std::fs::remove(std::fs::path(oldestBackupPath), removeError);
-		removedHistoryEntries.push_back(HistoryEntry{ entry.originalPath, oldestTimePoint });
+		lock.unlock();
+
+		bool isReconciled = backupRootPath.empty() || ReconcileBackupRootBytes(backupRootPath);
+
+		lock.lock();
+		nextPassTicks = GetTickCount64() + (isReconciled ? kBackupRootReconcileMs : kBackupRootReconcileRetryMs);
 	}
 }
 
-static void EnforceGlobalSizeLimit(const std::fs::path& backupRootPath, uint32_t maxSizeMB)
+// Points the background walk at backupRootPath, the first pass due shortly. An empty path stops the
+// walks until the next scan seeds a total for them to correct.
+static void SetReconciledBackupRoot(const std::fs::path& backupRootPath)
 {
-	if (backupRootPath.empty())
+	BackupRootReconciler& reconciler = g_backupRootReconciler;
+
 	{
-		return;
+		std::lock_guard<std::mutex> lock(reconciler.mutex);
+		reconciler.backupRootPath = backupRootPath;
+		reconciler.requestTicks = backupRootPath.empty() ? 0 : GetTickCount64();
+
+		if (!backupRootPath.empty() && !reconciler.thread.joinable())
+		{
+			reconciler.stopRequested.store(false);
+			reconciler.thread = std::thread(BackupRootReconcileProc);
+		}
 	}
 
-	if (maxSizeMB == 0)
+	reconciler.condition.notify_one();
+}
+
+static void StopBackupRootReconcile()
+{
+	BackupRootReconciler& reconciler = g_backupRootReconciler;
+
 	{
-		return;
+		std::lock_guard<std::mutex> lock(reconciler.mutex);
+		reconciler.stopRequested.store(true);
 	}
+	reconciler.condition.notify_one();
 
-	uint64_t maxBytes = (uint64_t)maxSizeMB * 1024ull * 1024ull;
-	uint64_t currentBytes = ComputeFolderSizeBytes(backupRootPath);
-
-	if (currentBytes <= maxBytes)
+	if (reconciler.thread.joinable())
 	{
-		return;
+		reconciler.thread.join();
 	}
+}
 
-	struct GlobalBackupItem
+// Puts a version taken out of the index back, its file turned out to be still needed. Returns false if
+// the original itself was removed meanwhile.
+static bool RestoreBackupVersion(PathId originalPathId, const BackupVersion& version)
+{
+	std::unique_lock<std::shared_mutex> lock(g_indexMutex);
+
+	BackupFile* entry = g_backupIndex.Find(originalPathId);
+	if (!entry)
 	{
-		std::wstring originalPath;
-		TimePoint timePoint;
-	};
+		return false;
+	}
 
-	std::vector<GlobalBackupItem> allBackups;
+	entry->backups.push_back(version);
+	entry->SortBackupTimes();
+	JournalVersionAdded(originalPathId, version);
+	return true;
+}
+
+// Deletes the stored file of one version, which has already been taken out of the index. nextVersion is
+// the version after it, if any: should that be a delta encoded against the one going away it is rewritten
+// as a full copy first, and its size updated in the index, so only called without the index lock then.
+// Returns false if that rewrite failed: the version is back in the index then, with its file. The bytes
+// freed on disk come off the backup root's running total.
+static bool RemoveBackupVersion(const std::wstring& backupRoot, PathId originalPathId, const BackupVersion& version, const BackupVersion* nextVersion)
+{
+	std::fs::path backupPath = MakeBackupPathFromTimePoint(backupRoot, GetPath(originalPathId), version.timePoint);
 
+	if (nextVersion)
 	{
-		std::unique_lock<std::shared_mutex> indexLock(g_indexMutex);
+		std::fs::path nextBackupPath = MakeBackupPathFromTimePoint(backupRoot, GetPath(originalPathId), nextVersion->timePoint);
+		uint64_t rebasedBytes = 0;
 
-		for (const BackupFile& entry : g_backupIndex)
+		// Better to keep a version too many than lose the ones built on it
+		if (!RebaseDeltaBackup(nextBackupPath, backupPath, rebasedBytes) && RestoreBackupVersion(originalPathId, version))
+		{
+			return false;
+		}
+
+		if (rebasedBytes > 0)
 		{
-			for (const TimePoint& timePoint : entry.backups)
+			// The full copy took the delta's place
+			AddBackupRootBytes(rebasedBytes);
+			SubtractBackupRootBytes(nextVersion->storedBytes);
+
+			std::unique_lock<std::shared_mutex> lock(g_indexMutex);
+
+			BackupFile* entry = g_backupIndex.Find(originalPathId);
+			if (entry)
 			{
-				allBackups.push_back(GlobalBackupItem{ entry.originalPath, timePoint });
+				for (BackupVersion& indexedVersion : entry->backups)
+				{
+					if (indexedVersion.timePoint == nextVersion->timePoint)
+					{
+						indexedVersion.storedBytes = rebasedBytes;
+						JournalVersionUpdated(originalPathId, indexedVersion);
+					}
+				}
 			}
 		}
 	}
 
-	std::sort(allBackups.begin(), allBackups.end(), [](const GlobalBackupItem& left, const GlobalBackupItem& right)
+	// A packed version is tombstoned, its bytes only come back (and off the running total) when its
+	// segment is compacted. A plain file left by a retried copy that fell back from packing goes too.
+	if (IsPackedBackup(backupPath))
 	{
-		return left.timePoint < right.timePoint;
-	});
+		RemovePackedBackup(backupPath);
+	}
 
+	uint64_t freedBytes = RemoveBackupFile(std::fs::path(backupRoot), GetStoredBackupPath(backupPath), version.hasContentHash ? &version.contentHash : nullptr);
 
-	size_t globalIndex = 0;
+	SubtractBackupRootBytes(freedBytes);
+	return true;
+}
 
-	while (currentBytes > maxBytes && globalIndex < allBackups.size())
-	{
-		std::error_code errorCode;
-		uint64_t removedFileSize = 0;
+// A version taken out of the index whose stored file is still to be removed, with the version after it
+struct TakenVersion
+{
+	PathId							originalPathId;
+	BackupVersion					version;
+	std::optional<BackupVersion>	nextVersion;
+};
 
-		const std::wstring& originalPath = allBackups[globalIndex].originalPath;
-		const TimePoint& timePoint = allBackups[globalIndex].timePoint;
-		std::wstring backupPath = MakeBackupPathFromTimePoint(backupRootPath.wstring(), originalPath, timePoint);
+// Removes the files of taken versions and drops them from the filtered list. Each original's versions go
+// newest first: a delta is built on every version before it, so the one rebased is rebuilt while its whole
+// chain is still there. Once a version has to stay, so do the older ones it may be built on. Called
+// outside the index lock, a rebase rebuilds a whole delta chain.
+static void RemoveTakenVersions(const std::vector<TakenVersion>& takenVersions)
+{
+	std::vector<const TakenVersion*> orderedVersions;
+	orderedVersions.reserve(takenVersions.size());
+
+	for (const TakenVersion& takenVersion : takenVersions)
+	{
+		orderedVersions.push_back(&takenVersion);
+	}
 
-		if (std::fs::exists(backupPath, errorCode))
+	std::sort(orderedVersions.begin(), orderedVersions.end(), [](const TakenVersion* left, const TakenVersion* right)
+	{
+		if (left->originalPathId != right->originalPathId)
 		{
-			removedFileSize = (uint64_t)std::fs::file_size(backupPath, errorCode);
+			return left->originalPathId < right->originalPathId;
 		}
+		return left->version.timePoint > right->version.timePoint;
+	});
 
-		std::fs::remove(backupPath, errorCode);
+	PathId keptPathId = kInvalidPathId;
 
+	for (const TakenVersion* takenVersion : orderedVersions)
+	{
+		if (takenVersion->originalPathId == keptPathId && RestoreBackupVersion(takenVersion->originalPathId, takenVersion->version))
 		{
-			std::unique_lock<std::shared_mutex> indexLock(g_indexMutex);
-			auto entryItr = g_backupIndex.end();
-			for (entryItr = g_backupIndex.begin(); entryItr != g_backupIndex.end(); ++entryItr)
-			{
-				if (entryItr->originalPath == originalPath)
-				{
-					break;
-				}
-			}
-			if (entryItr != g_backupIndex.end())
-			{
-				auto& backups = entryItr->backups;
-				backups.erase(
-					std::remove(backups.begin(), backups.end(), timePoint),
-					backups.end());
-			}
+			continue;
 		}
-		RemoveFromFilteredEntries(originalPath, timePoint);
 
-		if (removedFileSize > 0 && currentBytes >= removedFileSize)
+		if (RemoveBackupVersion(g_settings.backupRoot, takenVersion->originalPathId, takenVersion->version, takenVersion->nextVersion ? &*takenVersion->nextVersion : nullptr))
 		{
-			currentBytes -= removedFileSize;
+			RemoveFromFilteredEntries(takenVersion->originalPathId, takenVersion->version.timePoint);
+		}
+		else
+		{
+			keptPathId = takenVersion->originalPathId;
 		}
-
-		++globalIndex;
 	}
 }
 
-
-static bool CopyToBackupAndIndex(const WatchedFolder& watchedFolder, const std::wstring& filePath)
+// Takes the version of the original saved at timePoint out of the index, along with the version after it
+static bool TakeBackupVersion_Locked(PathId originalPathId, const TimePoint& timePoint, BackupVersion& outVersion, std::optional<BackupVersion>& outNextVersion)
 {
-	(void)watchedFolder;
-
-	if (IsPaused())
+	BackupFile* entry = g_backupIndex.Find(originalPathId);
+	if (!entry)
 	{
 		return false;
 	}
 
-	if (g_settings.backupRoot.empty())
+	auto& backups = entry->backups;
+	auto versionIt = std::find_if(backups.begin(), backups.end(), [&](const BackupVersion& backupVersion)
 	{
-		return false;
-	}
+		return backupVersion.timePoint == timePoint;
+	});
 
-	std::error_code errorCode;
-	if (!std::fs::exists(filePath, errorCode) || !std::fs::is_regular_file(filePath, errorCode))
+	if (versionIt == backups.end())
 	{
 		return false;
 	}
 
-	TimePoint backupTimePoint = std::chrono::system_clock::now();
-	std::wstring destinationPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, filePath, backupTimePoint);
-	EnsureDirExists(std::fs::path(destinationPath).parent_path());
+	outVersion = *versionIt;
+	versionIt = backups.erase(versionIt);
+	JournalVersionRemoved(originalPathId, timePoint);
 
-	BOOL copySucceeded = CopyFileW(filePath.c_str(), destinationPath.c_str(), FALSE);
-	if (!copySucceeded)
+	if (versionIt != backups.end())
 	{
-		return false;
+		outNextVersion = *versionIt;
 	}
 
-	std::vector<HistoryEntry> removedHistoryEntries;
-	{
-		std::unique_lock<std::shared_mutex> lock(g_indexMutex);
+	return true;
+}
 
-		BackupFile& entry = GetOrCreateBackupEntry_Locked(filePath);
-		entry.backups.push_back(backupTimePoint);
-		entry.SortBackupTimes();
-		EnforcePerFileLimit_Locked(entry, g_settings.maxBackupsPerFile, removedHistoryEntries);
+// Takes the oldest versions beyond the limit out of the index; their files are left to RemoveTakenVersions.
+// Only the newest of them is paired with the version after it, the first to stay: the others are followed
+// by versions going too, which need no rebasing.
+static void EnforcePerFileLimit_Locked(BackupFile& entry, uint32_t maxBackupsPerFile, std::vector<TakenVersion>& outTakenVersions)
+{
+	if (maxBackupsPerFile == 0)
+	{
+		return;
 	}
 
-	for (const HistoryEntry& entry : removedHistoryEntries)
+	entry.SortBackupTimes();
+
+	if (entry.backups.size() <= maxBackupsPerFile)
 	{
-		RemoveFromFilteredEntries(entry.originalPath, entry.timePoint);
+		return;
 	}
 
-	InsertFilteredEntries(filePath, backupTimePoint);
+	size_t takenCount = entry.backups.size() - maxBackupsPerFile;
 
-	if (destinationPath.find(g_todayPrefix) != std::wstring::npos)
+	for (size_t backupIndex = 0; backupIndex < takenCount; ++backupIndex)
 	{
-		++g_backupsToday;
-		TrayUpdateStatus(g_backupsToday, g_isPaused.load(std::memory_order_relaxed));
+		TakenVersion takenVersion = { entry.originalPathId, entry.backups[backupIndex] };
+		JournalVersionRemoved(entry.originalPathId, takenVersion.version.timePoint);
+
+		if (backupIndex + 1 == takenCount)
+		{
+			takenVersion.nextVersion = entry.backups[takenCount];
+		}
+
+		outTakenVersions.push_back(std::move(takenVersion));
 	}
 
-	EnforceGlobalSizeLimit(std::fs::path(g_settings.backupRoot), g_settings.maxBackupSizeMB);
-	return true;
+	entry.backups.erase(entry.backups.begin(), entry.backups.begin() + takenCount);
 }
 
-static void ScanBackupFolder()
+static std::mutex											g_sizeLimitMutex;
+static std::atomic<bool>									g_sizeLimitRequested = false;
+static std::atomic<uint64_t>								g_skippedUnchangedBackups = 0;
+static std::atomic<uint64_t>								g_copyRetries = 0;
+static std::atomic<uint64_t>								g_tornBackups = 0;
+static std::atomic<uint64_t>								g_dedupedBackups = 0;
+static std::atomic<uint64_t>								g_dedupedBytes = 0;
+static std::atomic<uint64_t>								g_deltaBackups = 0;
+static std::atomic<uint64_t>								g_deltaBytesSaved = 0;
+static std::atomic<uint64_t>								g_compressedBackups = 0;
+static std::atomic<uint64_t>								g_compressionBytesSaved = 0;
+static std::atomic<uint64_t>								g_packedBackups = 0;
+
+static void EnforceGlobalSizeLimit_Locked(const std::fs::path& backupRootPath, uint32_t maxSizeMB)
 {
+	if (backupRootPath.empty())
 	{
-		std::unique_lock<std::shared_mutex> lock(g_indexMutex);
-		g_backupIndex.clear();
+		return;
 	}
 
-	if (g_settings.backupRoot.empty())
+	// Segments that versions were evicted from since the last pass are compacted before the total is checked
+	SubtractBackupRootBytes(CompactPackSegments(false));
+
+	if (maxSizeMB == 0)
 	{
 		return;
 	}
 
-	std::fs::path backupRootPath(g_settings.backupRoot);
-	std::error_code errorCode;
+	uint64_t maxBytes = (uint64_t)maxSizeMB * 1024ull * 1024ull;
 
-	if (!std::fs::exists(backupRootPath, errorCode))
+	if (g_backupRootBytes.load() <= maxBytes)
 	{
 		return;
 	}
-	
-	g_backupsToday = 0;
 
-	for (auto iterator = std::fs::recursive_directory_iterator(backupRootPath, std::fs::directory_options::skip_permission_denied, errorCode); iterator != std::fs::recursive_directory_iterator(); ++iterator)
+	// Space held by removed packed versions is given back before any more versions go
+	SubtractBackupRootBytes(CompactPackSegments(true));
+
+	if (g_backupRootBytes.load() <= maxBytes)
 	{
-		if (errorCode)
-		{
-			errorCode.clear();
-			continue;
-		}
+		return;
+	}
 
-		if (!iterator->is_regular_file(errorCode))
-		{
-			continue;
-		}
+	struct GlobalBackupItem
+	{
+		PathId originalPathId;
+		TimePoint timePoint;
+	};
 
-		std::fs::path backupFilePath = iterator->path();
-		std::wstring backupStem = backupFilePath.stem().wstring();
+	std::vector<GlobalBackupItem> allBackups;
 
-		size_t backupMarkerPos = backupStem.rfind(L"_backup_");
+	{
+		std::unique_lock<std::shared_mutex> indexLock(g_indexMutex);
+
+		for (const BackupFile& entry : g_backupIndex)
+		{
+			for (const BackupVersion& backupVersion : entry.backups)
+			{
+				allBackups.push_back(GlobalBackupItem{ entry.originalPathId, backupVersion.timePoint });
+			}
+		}
+	}
+
+	std::sort(allBackups.begin(), allBackups.end(), [](const GlobalBackupItem& left, const GlobalBackupItem& right)
+	{
+		return left.timePoint < right.timePoint;
+	});
+
+
+	// A packed victim is only tombstoned, so its bytes stay in the total until the compaction after the
+	// loop; they already count as freed here, or every other version would go after them
+	auto isOverLimit = [maxBytes]()
+	{
+		uint64_t totalBytes = g_backupRootBytes.load();
+		uint64_t deadBytes = GetPackDeadBytes();
+		return (totalBytes > deadBytes ? totalBytes - deadBytes : 0) > maxBytes;
+	};
+
+	size_t globalIndex = 0;
+
+	while (isOverLimit() && globalIndex < allBackups.size())
+	{
+		PathId originalPathId = allBackups[globalIndex].originalPathId;
+		const TimePoint& timePoint = allBackups[globalIndex].timePoint;
+
+		BackupVersion removedVersion = {};
+		std::optional<BackupVersion> nextVersion;
+		bool isTaken = false;
+		{
+			std::unique_lock<std::shared_mutex> indexLock(g_indexMutex);
+			isTaken = TakeBackupVersion_Locked(originalPathId, timePoint, removedVersion, nextVersion);
+		}
+
+		if (!isTaken || RemoveBackupVersion(backupRootPath.wstring(), originalPathId, removedVersion, nextVersion ? &*nextVersion : nullptr))
+		{
+			RemoveFromFilteredEntries(originalPathId, timePoint);
+		}
+
+		++globalIndex;
+	}
+
+	SubtractBackupRootBytes(CompactPackSegments(true));
+}
+
+
+// Every backup checks the limit and a pass may have to walk the backup root, so concurrent callers are
+// coalesced: whoever holds the lock runs the enforcement again if another request arrived meanwhile,
+// and everyone else returns at once.
+static void EnforceGlobalSizeLimit(const std::fs::path& backupRootPath, uint32_t maxSizeMB)
+{
+	g_sizeLimitRequested.store(true);
+
+	while (g_sizeLimitRequested.load())
+	{
+		std::unique_lock<std::mutex> lock(g_sizeLimitMutex, std::try_to_lock);
+		if (!lock.owns_lock())
+		{
+			return;
+		}
+
+		g_sizeLimitRequested.store(false);
+		EnforceGlobalSizeLimit_Locked(backupRootPath, maxSizeMB);
+	}
+}
+
+// Editors and build tools often rewrite or touch a file without changing its bytes. Matching size and
+// write time is taken as unchanged without reading anything; a same sized file with a new write time
+// is hashed and compared against the latest backup's content. outSourceHash is set whenever the source
+// was hashed, so a copy that goes ahead can keep it.
+static bool IsUnchangedSinceLatestBackup(const std::wstring& filePath, uint64_t sourceSize, std::fs::file_time_type sourceWriteTime, bool& outHasSourceHash, uint64_t& outSourceHash)
+{
+	BackupVersion latestVersion = {};
+	{
+		std::shared_lock<std::shared_mutex> lock(g_indexMutex);
+
+		const BackupFile* entry = FindBackupEntry_Locked(filePath);
+		if (!entry || entry->backups.empty())
+		{
+			return false;
+		}
+
+		latestVersion = entry->backups.back();
+	}
+
+	if (latestVersion.sourceSize != sourceSize)
+	{
+		return false;
+	}
+
+	if (latestVersion.sourceWriteTime == sourceWriteTime)
+	{
+		return true;
+	}
+
+	if (!HashFileContents(std::fs::path(filePath), outSourceHash))
+	{
+		return false;
+	}
+
+	outHasSourceHash = true;
+
+	uint64_t latestHash = latestVersion.contentHash;
+	if (!latestVersion.hasContentHash)
+	{
+		std::wstring latestBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, filePath, latestVersion.timePoint);
+		if (!HashFileContents(std::fs::path(latestBackupPath), latestHash))
+		{
+			return false;
+		}
+	}
+
+	if (latestHash != outSourceHash)
+	{
+		return false;
+	}
+
+	// Remember the new write time so the next touch takes the fast path
+	{
+		std::unique_lock<std::shared_mutex> lock(g_indexMutex);
+
+		BackupFile* entry = FindBackupEntry_Locked(filePath);
+		if (entry && !entry->backups.empty() && entry->backups.back().timePoint == latestVersion.timePoint)
+		{
+			BackupVersion& storedVersion = entry->backups.back();
+			storedVersion.sourceWriteTime = sourceWriteTime;
+			storedVersion.contentHash = latestHash;
+			storedVersion.hasContentHash = true;
+			JournalVersionUpdated(entry->originalPathId, storedVersion);
+		}
+	}
+
+	return true;
+}
+
+static constexpr uint32_t kMaxCopyAttempts = 4;
+static constexpr uint32_t kCopyRetryBaseDelayMs = 250;
+
+// Unlinks whatever is stored under backupPath, in any of its forms, and returns the bytes this freed
+static uint64_t RemoveStoredBackupFiles(const std::fs::path& backupPath)
+{
+	std::fs::path deltaPath = backupPath;
+	deltaPath += kDeltaFileExtension;
+
+	const std::fs::path storedPaths[] = { backupPath, deltaPath, MakeCompressedBackupPath(backupPath) };
+	uint64_t freedBytes = 0;
+
+	for (const std::fs::path& storedPath : storedPaths)
+	{
+		std::error_code errorCode;
+		if (std::fs::exists(storedPath, errorCode))
+		{
+			freedBytes += RemoveBackupFile(std::fs::path(g_settings.backupRoot), storedPath, nullptr);
+		}
+	}
+
+	return freedBytes;
+}
+
+static bool ReadFileSnapshot(const std::wstring& filePath, FileSnapshot& outSnapshot)
+{
+	std::error_code errorCode;
+
+	outSnapshot.size = (uint64_t)std::fs::file_size(filePath, errorCode);
+	if (errorCode)
+	{
+		return false;
+	}
+
+	outSnapshot.lastWriteTime = std::fs::last_write_time(filePath, errorCode);
+	return !errorCode;
+}
+
+static bool CopyToBackupAndIndex(const WatchedFolder& watchedFolder, const std::wstring& filePath)
+{
+	(void)watchedFolder;
+
+	if (IsPaused())
+	{
+		return false;
+	}
+
+	if (g_settings.backupRoot.empty())
+	{
+		return false;
+	}
+
+	std::error_code errorCode;
+	if (!std::fs::exists(filePath, errorCode) || !std::fs::is_regular_file(filePath, errorCode))
+	{
+		return false;
+	}
+
+	FileSnapshot sourceSnapshot = {};
+	if (!ReadFileSnapshot(filePath, sourceSnapshot))
+	{
+		return false;
+	}
+
+	BackupVersion backupVersion = {};
+	backupVersion.sourceSize = sourceSnapshot.size;
+	backupVersion.sourceWriteTime = sourceSnapshot.lastWriteTime;
+
+	if (IsUnchangedSinceLatestBackup(filePath, backupVersion.sourceSize, backupVersion.sourceWriteTime, backupVersion.hasContentHash, backupVersion.contentHash))
+	{
+		g_skippedUnchangedBackups.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	TimePoint backupTimePoint = std::chrono::system_clock::now();
+	backupVersion.timePoint = backupTimePoint;
+
+	std::wstring destinationPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, filePath, backupTimePoint);
+
+	// A second save within the same second is stored under the name of the version before it. That file
+	// may be a hard link to a blob other versions share, and every writer truncates in place, so it is
+	// unlinked first rather than written through.
+	SubtractBackupRootBytes(RemoveStoredBackupFiles(std::fs::path(destinationPath)));
+
+	// Small files are appended to a pack segment when enabled, and get no file (or folder) of their own
+	bool shouldPack = g_settings.packSmallBackups && sourceSnapshot.size <= kPackMaxVersionSize;
+
+	if (!shouldPack)
+	{
+		EnsureDirExists(std::fs::path(destinationPath).parent_path());
+	}
+
+	// Large files are stored as a delta against the latest version when enabled
+	std::wstring deltaBasePath;
+
+	if (g_settings.deltaBackups && sourceSnapshot.size >= kDeltaMinFileSize && sourceSnapshot.size <= kDeltaMaxFileSize)
+	{
+		std::shared_lock<std::shared_mutex> lock(g_indexMutex);
+
+		const BackupFile* entry = FindBackupEntry_Locked(filePath);
+		if (entry && !entry->backups.empty())
+		{
+			deltaBasePath = MakeBackupPathFromTimePoint(g_settings.backupRoot, filePath, entry->backups.back().timePoint);
+		}
+
+		// A second save within the same second replaces the latest version, which can't be its own base
+		if (deltaBasePath == destinationPath)
+		{
+			deltaBasePath.clear();
+		}
+	}
+
+	// Otherwise compressible files are compressed when enabled
+	bool shouldCompress = deltaBasePath.empty() && g_settings.compressBackups && IsWorthCompressing(std::fs::path(filePath));
+
+	bool isStoredAsDelta = false;
+	bool isStoredCompressed = false;
+	bool isStoredPacked = false;
+	uint64_t storedBytes = 0;
+
+	// A file still being written (big generated files especially) can change under the copy. The source
+	// is compared before and after each attempt; if it moved on, the copy is retried with a growing
+	// backoff, and once the attempts run out the last copy is kept but flagged as possibly torn.
+	for (uint32_t attemptIndex = 0; ; ++attemptIndex)
+	{
+		// Plain copies and compression charge their bytes as they go, deltas and packed versions read
+		// the whole file up front
+		ThrottleBackupOperation();
+
+		if (shouldPack || !deltaBasePath.empty())
+		{
+			ThrottleBackupBytes(sourceSnapshot.size);
+		}
+
+		if (shouldPack)
+		{
+			isStoredPacked = StoreBackupPacked(std::fs::path(filePath), std::fs::path(destinationPath), backupVersion.contentHash, storedBytes);
+
+			if (!isStoredPacked)
+			{
+				// It grew past the pack limit since it was measured, or the segment couldn't be written
+				shouldPack = false;
+				EnsureDirExists(std::fs::path(destinationPath).parent_path());
+			}
+		}
+
+		// The hash is of the bytes actually written, so it describes the backup even if the copy tears
+		if (isStoredPacked)
+		{
+			// The record is the whole version, there is nothing else to write
+		}
+		else if (!deltaBasePath.empty())
+		{
+			if (!StoreBackupAsDelta(std::fs::path(filePath), std::fs::path(destinationPath), std::fs::path(deltaBasePath), backupVersion.contentHash, isStoredAsDelta, storedBytes))
+			{
+				return false;
+			}
+		}
+		else if (shouldCompress)
+		{
+			if (!StoreBackupCompressed(std::fs::path(filePath), std::fs::path(destinationPath), backupVersion.contentHash, isStoredCompressed, storedBytes))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			if (!CopyFileFast(std::fs::path(filePath), std::fs::path(destinationPath), nullptr, &backupVersion.contentHash))
+			{
+				return false;
+			}
+
+			storedBytes = (uint64_t)std::fs::file_size(destinationPath, errorCode);
+			if (errorCode)
+			{
+				storedBytes = 0;
+			}
+		}
+
+		backupVersion.hasContentHash = true;
+
+		FileSnapshot copiedSnapshot = {};
+		bool isSnapshotValid = ReadFileSnapshot(filePath, copiedSnapshot);
+
+		if (isSnapshotValid && copiedSnapshot.size == sourceSnapshot.size && copiedSnapshot.lastWriteTime == sourceSnapshot.lastWriteTime)
+		{
+			break;
+		}
+
+		if (!isSnapshotValid || attemptIndex + 1 >= kMaxCopyAttempts)
+		{
+			backupVersion.possiblyTorn = true;
+			g_tornBackups.fetch_add(1, std::memory_order_relaxed);
+			break;
+		}
+
+		g_copyRetries.fetch_add(1, std::memory_order_relaxed);
+		std::this_thread::sleep_for(std::chrono::milliseconds(kCopyRetryBaseDelayMs << attemptIndex));
+
+		if (!ReadFileSnapshot(filePath, sourceSnapshot))
+		{
+			backupVersion.possiblyTorn = true;
+			g_tornBackups.fetch_add(1, std::memory_order_relaxed);
+			break;
+		}
+
+		backupVersion.sourceSize = sourceSnapshot.size;
+		backupVersion.sourceWriteTime = sourceSnapshot.lastWriteTime;
+	}
+
+	if (isStoredAsDelta)
+	{
+		g_deltaBackups.fetch_add(1, std::memory_order_relaxed);
+
+		if (backupVersion.sourceSize > storedBytes)
+		{
+			g_deltaBytesSaved.fetch_add(backupVersion.sourceSize - storedBytes, std::memory_order_relaxed);
+		}
+	}
+
+	if (isStoredPacked)
+	{
+		g_packedBackups.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	if (isStoredCompressed)
+	{
+		g_compressedBackups.fetch_add(1, std::memory_order_relaxed);
+
+		if (backupVersion.sourceSize > storedBytes)
+		{
+			g_compressionBytesSaved.fetch_add(backupVersion.sourceSize - storedBytes, std::memory_order_relaxed);
+		}
+	}
+
+	// Content that is already stored (a file reverted to an earlier state, the same file in two
+	// watched folders) is swapped for a hard link to the stored copy. A torn copy is left alone, and so
+	// is a delta, which only means anything next to its base, and a packed version, which has no file.
+	// Compression is deterministic, so equal contents compress to equal files and still share one.
+	bool isDeduplicated = false;
+
+	if (!isStoredAsDelta && !isStoredPacked && g_settings.deduplicateBackups && !backupVersion.possiblyTorn)
+	{
+		std::fs::path storedPath = GetStoredBackupPath(std::fs::path(destinationPath));
+		uint64_t copiedSize = (uint64_t)std::fs::file_size(storedPath, errorCode);
+
+		if (!errorCode && LinkBackupIntoObjectStore(std::fs::path(g_settings.backupRoot), storedPath, backupVersion.contentHash, copiedSize))
+		{
+			isDeduplicated = true;
+			g_dedupedBackups.fetch_add(1, std::memory_order_relaxed);
+			g_dedupedBytes.fetch_add(copiedSize, std::memory_order_relaxed);
+		}
+	}
+
+	// A deduplicated copy added nothing on disk, its bytes were already counted with the blob
+	backupVersion.storedBytes = storedBytes;
+	AddBackupRootBytes(isDeduplicated ? 0 : storedBytes);
+
+	// The version is only indexed once it is on disk (as far as the durability setting asks), so the
+	// index never lists a version a power loss could still take
+	std::fs::path writtenPath = isStoredPacked ? GetPackedBackupSegmentPath(std::fs::path(destinationPath)) : GetStoredBackupPath(std::fs::path(destinationPath));
+	CommitBackupWrite(writtenPath, g_settings.durability);
+
+	std::vector<TakenVersion> takenVersions;
+	PathId filePathId = kInvalidPathId;
+	{
+		std::unique_lock<std::shared_mutex> lock(g_indexMutex);
+
+		BackupFile& entry = GetOrCreateBackupEntry_Locked(filePath);
+		filePathId = entry.originalPathId;
+		entry.backups.push_back(backupVersion);
+		JournalVersionAdded(filePathId, backupVersion);
+		entry.SortBackupTimes();
+		EnforcePerFileLimit_Locked(entry, g_settings.maxBackupsPerFile, takenVersions);
+	}
+
+	RemoveTakenVersions(takenVersions);
+
+	InsertFilteredEntries(filePathId, backupTimePoint);
+
+	if (destinationPath.find(g_todayPrefix) != std::wstring::npos)
+	{
+		++g_backupsToday;
+		TrayUpdateStatus(g_backupsToday, g_isPaused.load(std::memory_order_relaxed));
+	}
+
+	EnforceGlobalSizeLimit(std::fs::path(g_settings.backupRoot), g_settings.maxBackupSizeMB);
+	return true;
+}
+
+static bool		g_isIndexLoadedFromFile = false;
+static uint64_t	g_indexLoadMs = 0;
+
+// Walks the backup root and rebuilds the index from the backup names
+static void WalkBackupFolder(const std::fs::path& backupRootPath)
+{
+	std::error_code errorCode;
+
+	// Adds the version whose backup path is backupFilePath, read back from its name: the original's
+	// relative path with the timestamp inserted before the extension
+	auto addBackupVersion = [&](const std::fs::path& backupFilePath, BackupVersion& backupVersion)
+	{
+		std::wstring backupStem = backupFilePath.stem().wstring();
+
+		size_t backupMarkerPos = backupStem.rfind(L"_backup_");
 		if (backupMarkerPos == std::wstring::npos)
 		{
+			return;
+		}
+
+		std::wstring originalStem = backupStem.substr(0, backupMarkerPos);
+		std::wstring originalExt = backupFilePath.extension().wstring();
+
+		std::error_code relativeErrorCode;
+		std::fs::path relativeDir = std::fs::relative( backupFilePath.parent_path(), backupRootPath, relativeErrorCode);
+
+		if (relativeErrorCode)
+		{
+			return;
+		}
+
+		std::fs::path originalRelativePath = relativeDir / std::fs::path(originalStem + originalExt);
+		
+		std::wstring originalFullPath = UnsanitizePathFromBackupLayout(originalRelativePath.wstring());
+
+		if (!TryParseBackupTimestampToTimePoint(backupStem, backupVersion.timePoint))
+		{
+			return;
+		}
+
+		std::unique_lock<std::shared_mutex> lock(g_indexMutex);
+		BackupFile& entry = GetOrCreateBackupEntry_Locked(originalFullPath);
+		entry.backups.push_back(backupVersion);
+	};
+
+	std::fs::path objectStorePath = backupRootPath / kObjectStoreFolderName;
+	std::fs::path packStorePath = backupRootPath / kPackFolderName;
+	std::fs::path indexFolderPath = backupRootPath / kIndexFolderName;
+
+	for (auto iterator = std::fs::recursive_directory_iterator(backupRootPath, std::fs::directory_options::skip_permission_denied, errorCode); iterator != std::fs::recursive_directory_iterator(); ++iterator)
+	{
+		if (errorCode)
+		{
+			errorCode.clear();
+			continue;
+		}
+
+		if (iterator->path() == objectStorePath || iterator->path() == packStorePath || iterator->path() == indexFolderPath)
+		{
+			iterator.disable_recursion_pending();
+			continue;
+		}
+
+		if (!iterator->is_regular_file(errorCode))
+		{
+			continue;
+		}
+
+		std::fs::path backupFilePath = iterator->path();
+		bool isDeltaBackup = (backupFilePath.extension() == kDeltaFileExtension);
+		bool isCompressedBackup = (backupFilePath.extension() == kCompressedFileExtension);
+
+		if (isDeltaBackup || isCompressedBackup)
+		{
+			backupFilePath.replace_extension();
+		}
+
+		// The copy kept the original's size and write time; deltas and compressed versions record the size
+		// (and hash) they rebuild to
+		BackupVersion backupVersion = {};
+		backupVersion.sourceSize = iterator->file_size(errorCode);
+		backupVersion.storedBytes = errorCode ? 0 : backupVersion.sourceSize;
+		backupVersion.sourceWriteTime = iterator->last_write_time(errorCode);
+		errorCode.clear();
+
+		if (isDeltaBackup)
+		{
+			if (!GetDeltaBackupInfo(backupFilePath, backupVersion.sourceSize, backupVersion.contentHash))
+			{
+				continue;
+			}
+			backupVersion.hasContentHash = true;
+		}
+		else if (isCompressedBackup)
+		{
+			if (!GetCompressedBackupInfo(iterator->path(), backupVersion.sourceSize, backupVersion.contentHash))
+			{
+				continue;
+			}
+			backupVersion.hasContentHash = true;
+		}
+
+		addBackupVersion(backupFilePath, backupVersion);
+	}
+
+	// Packed versions have no file to find, the pack store knows them by the path they would have had
+	ForEachPackedBackup([&](const std::fs::path& backupPath, uint64_t contentSize, uint64_t contentHash, std::fs::file_time_type lastWriteTime)
+	{
+		BackupVersion backupVersion = {};
+		backupVersion.sourceSize = contentSize;
+		backupVersion.storedBytes = contentSize;
+		backupVersion.sourceWriteTime = lastWriteTime;
+		backupVersion.contentHash = contentHash;
+		backupVersion.hasContentHash = true;
+
+		addBackupVersion(backupPath, backupVersion);
+	});
+}
+
+// Fills the index for the backup root, from its index file and journal when useIndexFile is set and the
+// file is usable, walking the root otherwise. A walked index goes to a new index file in the background.
+static void ScanBackupFolder(bool useIndexFile)
+{
+	// The journal belongs to the index about to be replaced
+	CloseIndexJournal();
+
+	// The root may be another one, its total is seeded again from the new index
+	SetReconciledBackupRoot({});
+	g_backupRootMeasuredTicks.store(0);
+	g_backupRootDriftBytes.store(0);
+	g_backupRootGeneration.fetch_add(1);
+	g_backupRootBytes.store(0);
+	{
+		std::unique_lock<std::shared_mutex> lock(g_indexMutex);
+		g_backupIndex.Clear();
+	}
+
+	std::fs::path backupRootPath(g_settings.backupRoot);
+	OpenPackStore(backupRootPath);
+
+	if (g_settings.backupRoot.empty())
+	{
+		return;
+	}
+
+	std::error_code errorCode;
+
+	if (!std::fs::exists(backupRootPath, errorCode))
+	{
+		return;
+	}
+
+	uint64_t scanStartTicks = GetTickCount64();
+	bool isLoadedFromFile = false;
+
+	if (useIndexFile)
+	{
+		std::unique_lock<std::shared_mutex> lock(g_indexMutex);
+
+		BackupFile* entry = nullptr;
+		const wchar_t* entryPathChars = nullptr;
+		uint64_t checkpointGeneration = 0;
+
+		isLoadedFromFile = LoadBackupIndexFile(backupRootPath, checkpointGeneration, [&](std::wstring_view originalPath, const BackupVersion& backupVersion)
+		{
+			// Versions come grouped by original, only the first of each needs a lookup
+			if (originalPath.data() != entryPathChars)
+			{
+				entry = &GetOrCreateBackupEntry_Locked(std::wstring(originalPath));
+				entryPathChars = originalPath.data();
+			}
+
+			entry->backups.push_back(backupVersion);
+		});
+
+		if (isLoadedFromFile)
+		{
+			OpenIndexJournal(backupRootPath, checkpointGeneration, g_indexMutex, g_backupIndex, ReplayIndexJournalRecord_Locked);
+		}
+	}
+
+	if (!isLoadedFromFile)
+	{
+		// Whatever is there is stale or unreadable, don't leave it to be loaded should the walk not finish
+		RemoveBackupIndexFile(backupRootPath);
+		WalkBackupFolder(backupRootPath);
+
+		{
+			std::unique_lock<std::shared_mutex> lock(g_indexMutex);
+			OpenIndexJournal(backupRootPath, 0, g_indexMutex, g_backupIndex, nullptr);
+		}
+
+		RequestIndexCheckpoint();
+	}
+
+	g_isIndexLoadedFromFile = isLoadedFromFile;
+	g_indexLoadMs = GetTickCount64() - scanStartTicks;
+
+	std::vector<TakenVersion> takenVersions;
+	{
+		std::unique_lock<std::shared_mutex> lock(g_indexMutex);
+
+		// Before the per-file limit, whose removals come off the total
+		g_backupRootGeneration.fetch_add(1);
+		g_backupRootBytes.store(ComputeIndexedBackupBytes_Locked(g_settings.backupRoot));
+
+		for (BackupFile& entry : g_backupIndex)
+		{
+			entry.SortBackupTimes();
+			EnforcePerFileLimit_Locked(entry, g_settings.maxBackupsPerFile, takenVersions);
+		}
+	}
+
+	SetReconciledBackupRoot(backupRootPath);
+
+	RemoveTakenVersions(takenVersions);
+
+	EnforceGlobalSizeLimit(std::fs::path(g_settings.backupRoot), g_settings.maxBackupSizeMB);
+	RebuildFilteredEntries();
+
+	{
+		std::shared_lock<std::shared_mutex> lock(g_indexMutex);
+		g_backupsToday = CountBackupsToday_Locked();
+	}
+
+	TrayUpdateStatus(g_backupsToday, g_isPaused.load(std::memory_order_relaxed));
+}
+
+// Quiet period used for files we know nothing about yet. Each path then learns its own window from an
+// EWMA of the gaps between its writes: editors that save in one shot shrink towards the minimum, files
+// written in bursts stretch it so a backup isn't taken mid burst. Gaps longer than the maximum window
+// are pauses between separate saves and don't feed the average.
+static constexpr uint64_t kBackupQuietPeriodMs = 500;
+static constexpr uint32_t kMinQuietWindowMs = 150;
+static constexpr uint32_t kMaxQuietWindowMs = 5000;
+static constexpr float kQuietWindowGapScale = 2.0f;
+static constexpr float kWriteGapEwmaAlpha = 0.25f;
+
+// Burst profiles of paths not written for this long are dropped
+static constexpr uint64_t kWriteProfileExpiryMs = 10 * 60 * 1000;
+
+// Debounce timers for the watch loop. 512 slots of 10 ms cover about five seconds, a little more than
+// the longest quiet window, so a touch re-arms in O(1) and each wakeup only visits the slots that came due.
+typedef TimerWheel<512, 10> PendingBackupWheel;
+
+struct WriteBurstProfile
+{
+	float		gapEwmaMs = (float)kBackupQuietPeriodMs / kQuietWindowGapScale;
+	uint64_t	lastTouchTick = 0;
+};
+
+struct PendingBackup : TimerWheelNode
+{
+	const std::wstring*	filePath = nullptr;		// Key of this entry in the pending map
+	uint32_t			folderIndex = 0;
+	uint64_t			firstTouchTick = 0;
+	uint32_t			quietWindowMs = 0;
+	bool				latencyCapped = false;
+};
+
+struct PendingBackupSchedule
+{
+	explicit PendingBackupSchedule(uint64_t nowTick) : wheel(nowTick), nextProfilePruneTick(nowTick + kWriteProfileExpiryMs) {}
+
+	std::unordered_map<std::wstring, PendingBackup>			pending;
+	std::unordered_map<std::wstring, WriteBurstProfile>		profiles;
+	PendingBackupWheel										wheel;
+	uint64_t												maxLatencyMs = 0;
+	uint64_t												nextProfilePruneTick = 0;
+};
+
+static uint32_t QuietWindowFromProfile(const WriteBurstProfile& profile)
+{
+	float quietWindowMs = profile.gapEwmaMs * kQuietWindowGapScale;
+	return (uint32_t)std::clamp(quietWindowMs, (float)kMinQuietWindowMs, (float)kMaxQuietWindowMs);
+}
+
+// Returns true when filePath wasn't pending yet
+static bool TouchPendingBackup(PendingBackupSchedule& schedule, const std::wstring& filePath, uint32_t folderIndex, uint64_t nowTick)
+{
+	WriteBurstProfile& profile = schedule.profiles[filePath];
+	if (profile.lastTouchTick != 0)
+	{
+		uint64_t gapMs = nowTick - profile.lastTouchTick;
+		if (gapMs <= kMaxQuietWindowMs)
+		{
+			profile.gapEwmaMs += kWriteGapEwmaAlpha * ((float)gapMs - profile.gapEwmaMs);
+		}
+	}
+	profile.lastTouchTick = nowTick;
+
+	auto insertResult = schedule.pending.try_emplace(filePath);
+	PendingBackup& pendingBackup = insertResult.first->second;
+
+	if (insertResult.second)
+	{
+		pendingBackup.filePath = &insertResult.first->first;
+		pendingBackup.firstTouchTick = nowTick;
+	}
+
+	pendingBackup.folderIndex = folderIndex;
+	pendingBackup.quietWindowMs = QuietWindowFromProfile(profile);
+
+	// A file that never goes quiet is still backed up once it has been pending for maxLatencyMs
+	uint64_t quietDeadlineTick = nowTick + pendingBackup.quietWindowMs;
+	uint64_t latencyDeadlineTick = pendingBackup.firstTouchTick + schedule.maxLatencyMs;
+
+	pendingBackup.latencyCapped = schedule.maxLatencyMs > 0 && latencyDeadlineTick < quietDeadlineTick;
+	schedule.wheel.Schedule(pendingBackup, pendingBackup.latencyCapped ? latencyDeadlineTick : quietDeadlineTick);
+	return insertResult.second;
+}
+
+// Drops a pending backup whose file went away before it settled. Editors that save atomically write
+// foo.tmp (or ~foo), then rename it over foo: the temp name is cancelled here and the rename's new name
+// is touched as the one logical change, so the temp file is never copied or indexed.
+static bool CancelPendingBackup(PendingBackupSchedule& schedule, const std::wstring& filePath)
+{
+	auto foundPending = schedule.pending.find(filePath);
+	if (foundPending == schedule.pending.end())
+	{
+		return false;
+	}
+
+	schedule.wheel.Cancel(foundPending->second);
+	schedule.pending.erase(foundPending);
+	JournalPendingDone(filePath);
+	return true;
+}
+
+static void PruneWriteProfiles(PendingBackupSchedule& schedule, uint64_t nowTick)
+{
+	if (nowTick < schedule.nextProfilePruneTick)
+	{
+		return;
+	}
+
+	schedule.nextProfilePruneTick = nowTick + kWriteProfileExpiryMs;
+
+	for (auto itr = schedule.profiles.begin(); itr != schedule.profiles.end();)
+	{
+		if (nowTick - itr->second.lastTouchTick > kWriteProfileExpiryMs && schedule.pending.find(itr->first) == schedule.pending.end())
+		{
+			itr = schedule.profiles.erase(itr);
+		}
+		else
+		{
+			++itr;
+		}
+	}
+}
+
+static void RecordQuietWindowStats(FolderWatcher* watcher, const PendingBackup& pendingBackup)
+{
+	if (pendingBackup.latencyCapped)
+	{
+		watcher->forcedBackups.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	watcher->settledBackups.fetch_add(1, std::memory_order_relaxed);
+	watcher->quietWindowSumMs.fetch_add(pendingBackup.quietWindowMs, std::memory_order_relaxed);
+
+	size_t bucketIndex = 0;
+	while (bucketIndex + 1 < kQuietWindowBucketCount && pendingBackup.quietWindowMs > kQuietWindowBucketLimits[bucketIndex])
+	{
+		++bucketIndex;
+	}
+
+	watcher->quietWindowHistogram[bucketIndex].fetch_add(1, std::memory_order_relaxed);
+}
+
+static uint32_t PendingBackupWaitTime(const PendingBackupWheel& pendingWheel, uint64_t nowTick)
+{
+	uint64_t deadlineTick = 0;
+	if (!pendingWheel.NextDeadline(deadlineTick))
+	{
+		return kWatchWaitInfinite;
+	}
+
+	if (deadlineTick <= nowTick)
+	{
+		return 0;
+	}
+
+	return (uint32_t)(std::min)(deadlineTick - nowTick, (uint64_t)kWatchWaitInfinite - 1);
+}
+
+static void WakeCopyThread(FolderWatcher* watcher)
+{
+	if (watcher->idleCopyThreads.load() == 0)
+	{
+		return;
+	}
+
+	// Taking the mutex orders this notify after a sleeper's predicate check, so the wakeup can't be lost
+	{
+		std::lock_guard<std::mutex> lock(watcher->copyWakeMutex);
+	}
+	watcher->copyWakeCondition.notify_one();
+}
+
+enum class QueueBackupResult
+{
+	Queued,
+	AlreadyInFlight,
+	QueueFull,
+};
+
+static QueueBackupResult TryQueueBackup(FolderWatcher* watcher, const std::wstring& filePath, uint32_t folderIndex)
+{
+	{
+		std::lock_guard<std::mutex> lock(watcher->inFlightMutex);
+		if (!watcher->inFlightPaths.insert(filePath).second)
+		{
+			return QueueBackupResult::AlreadyInFlight;
+		}
+	}
+
+	BackupRequest request = {};
+	request.filePath = filePath;
+	request.folderIndex = folderIndex;
+
+	if (!watcher->backupQueue.TryPush(std::move(request)))
+	{
+		std::lock_guard<std::mutex> lock(watcher->inFlightMutex);
+		watcher->inFlightPaths.erase(filePath);
+		return QueueBackupResult::QueueFull;
+	}
+
+	WakeCopyThread(watcher);
+	return QueueBackupResult::Queued;
+}
+
+// Hands settled files to the copy threads. When a path is still being copied, or the queue is full,
+// the entry stays pending and is retried shortly instead of blocking the watch thread.
+static void QueueSettledPendingBackups(FolderWatcher* watcher, PendingBackupSchedule& schedule, uint64_t nowTick)
+{
+	static constexpr uint64_t kRetryDelayMs = 50;
+
+	bool queueFull = false;
+
+	schedule.wheel.Expire(nowTick, [&](TimerWheelNode& expiredNode)
+	{
+		PendingBackup& pendingBackup = static_cast<PendingBackup&>(expiredNode);
+
+		QueueBackupResult queueResult = queueFull ? QueueBackupResult::QueueFull : TryQueueBackup(watcher, *pendingBackup.filePath, pendingBackup.folderIndex);
+		if (queueResult != QueueBackupResult::Queued)
+		{
+			queueFull = queueResult == QueueBackupResult::QueueFull;
+			schedule.wheel.Schedule(pendingBackup, nowTick + kRetryDelayMs);
+			return;
+		}
+
+		RecordQuietWindowStats(watcher, pendingBackup);
+
+		std::wstring filePath = *pendingBackup.filePath;
+		schedule.pending.erase(filePath);
+	});
+
+	PruneWriteProfiles(schedule, nowTick);
+}
+
+static void UpdateFileSnapshot(FolderWatcher* watcher, const std::wstring& filePath)
+{
+	FileSnapshot snapshot = {};
+	if (!ReadFileSnapshot(filePath, snapshot))
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(watcher->snapshotMutex);
+	watcher->snapshots[filePath] = snapshot;
+}
+
+static void CopyThreadProc(FolderWatcher* watcher)
+{
+	BackupRequest request;
+
+	// Backups give way to whatever else wants the disk, the build that triggered them most of all
+	SetBackgroundIoPriority();
+
+	while (true)
+	{
+		if (watcher->backupQueue.TryPop(request))
+		{
+			// Snapshot before copying so a write that lands during the copy still shows up as a change
+			UpdateFileSnapshot(watcher, request.filePath);
+			CopyToBackupAndIndex(watcher->folders[request.folderIndex], request.filePath);
+
+			{
+				std::lock_guard<std::mutex> lock(watcher->inFlightMutex);
+				watcher->inFlightPaths.erase(request.filePath);
+			}
+
+			JournalPendingDone(request.filePath);
+
+			watcher->completedCopies.fetch_add(1, std::memory_order_relaxed);
 			continue;
 		}
 
-		std::wstring originalStem = backupStem.substr(0, backupMarkerPos);
-		std::wstring originalExt = backupFilePath.extension().wstring();
+		std::unique_lock<std::mutex> lock(watcher->copyWakeMutex);
 
-		if (backupStem.find(g_todayPrefix) != std::wstring::npos)
+		// Only exit once the queue is drained so settled changes aren't lost on restart
+		if (watcher->copyStopRequested.load())
 		{
-			g_backupsToday += 1;
+			break;
 		}
 
-		std::fs::path relativeDir = std::fs::relative( backupFilePath.parent_path(), backupRootPath, errorCode);
+		watcher->idleCopyThreads.fetch_add(1);
+		watcher->copyWakeCondition.wait(lock, [watcher]()
+		{
+			return watcher->copyStopRequested.load() || watcher->backupQueue.Depth() > 0;
+		});
+		watcher->idleCopyThreads.fetch_sub(1);
+	}
+}
 
-		if (errorCode)
+// Case and separator insensitive form of a path, without trailing separator, for cheap prefix tests
+static std::wstring MakePathKey(const std::wstring& path)
+{
+	std::wstring pathKey = ToLower(NormalizePathSlashes(path));
+	while (pathKey.size() > 1 && pathKey.back() == L'\\')
+	{
+		pathKey.pop_back();
+	}
+
+	return pathKey;
+}
+
+static bool IsPathKeyInFolder(const std::wstring& pathKey, const std::wstring& folderKey, bool includeSubfolders)
+{
+	if (pathKey.size() <= folderKey.size() || pathKey.compare(0, folderKey.size(), folderKey) != 0 || pathKey[folderKey.size()] != L'\\')
+	{
+		return false;
+	}
+
+	return includeSubfolders || pathKey.find(L'\\', folderKey.size() + 1) == std::wstring::npos;
+}
+
+// Computes the minimal set of OS watches for the configured folders: a folder is served by the watch of
+// a recursive folder that contains it (or has the same path), so nested and duplicate configs cost no
+// extra kernel watches and their events are only received once.
+static std::vector<WatchRoot> BuildWatchRoots(const std::vector<WatchedFolder>& watchedFolders, const std::vector<std::wstring>& folderPathKeys)
+{
+	auto CoversFolder = [&](size_t coveringIndex, size_t folderIndex)
+	{
+		const WatchedFolder& coveringFolder = watchedFolders[coveringIndex];
+		const WatchedFolder& watchedFolder = watchedFolders[folderIndex];
+
+		if (folderPathKeys[coveringIndex] == folderPathKeys[folderIndex])
 		{
-			errorCode.clear();
-			continue;
+			// Same path: a recursive watch beats a flat one, otherwise the first config wins
+			if (coveringFolder.includeSubfolders != watchedFolder.includeSubfolders)
+			{
+				return coveringFolder.includeSubfolders;
+			}
+			return coveringIndex < folderIndex;
 		}
 
-		std::fs::path originalRelativePath = relativeDir / std::fs::path(originalStem + originalExt);
-		
-		std::wstring originalFullPath = UnsanitizePathFromBackupLayout(originalRelativePath.wstring());
+		return coveringFolder.includeSubfolders && IsPathKeyInFolder(folderPathKeys[folderIndex], folderPathKeys[coveringIndex], true);
+	};
 
-		TimePoint timePoint;
-		if (!TryParseBackupTimestampToTimePoint(backupStem, timePoint))
+	std::vector<WatchRoot> watchRoots;
+	std::vector<size_t> rootFolderIndices;
+
+	for (size_t folderIndex = 0; folderIndex < watchedFolders.size(); ++folderIndex)
+	{
+		bool isCovered = false;
+		for (size_t coveringIndex = 0; coveringIndex < watchedFolders.size() && !isCovered; ++coveringIndex)
 		{
-			continue;
+			isCovered = coveringIndex != folderIndex && CoversFolder(coveringIndex, folderIndex);
 		}
 
+		if (!isCovered)
 		{
-			std::unique_lock<std::shared_mutex> lock(g_indexMutex);
-			BackupFile& entry = GetOrCreateBackupEntry_Locked(originalFullPath);
-			entry.backups.push_back(timePoint);
+			WatchRoot watchRoot = {};
+			watchRoot.path = watchedFolders[folderIndex].path;
+			watchRoot.includeSubfolders = watchedFolders[folderIndex].includeSubfolders;
+			watchRoots.push_back(std::move(watchRoot));
+			rootFolderIndices.push_back(folderIndex);
 		}
 	}
 
-	std::vector<HistoryEntry> removedHistoryEntries;
+	for (size_t folderIndex = 0; folderIndex < watchedFolders.size(); ++folderIndex)
 	{
-		std::unique_lock<std::shared_mutex> lock(g_indexMutex);
+		for (size_t rootIndex = 0; rootIndex < watchRoots.size(); ++rootIndex)
+		{
+			size_t rootFolderIndex = rootFolderIndices[rootIndex];
+			if (rootFolderIndex == folderIndex || CoversFolder(rootFolderIndex, folderIndex))
+			{
+				watchRoots[rootIndex].folderIndices.push_back((uint32_t)folderIndex);
+				break;
+			}
+		}
+	}
 
-		for (BackupFile& entry : g_backupIndex)
+	return watchRoots;
+}
+
+// Finds the first watched folder served by watchRoot whose location and filters accept filePath. The
+// same path is only ever scheduled once, however many folder configs overlap on it.
+static bool FindWatchedFolderForPath(const FolderWatcher* watcher, const WatchRoot& watchRoot, const std::wstring& filePath, uint32_t& outFolderIndex)
+{
+	std::wstring pathKey = MakePathKey(filePath);
+
+	for (uint32_t folderIndex : watchRoot.folderIndices)
+	{
+		const WatchedFolder& watchedFolder = watcher->folders[folderIndex];
+
+		if (IsPathKeyInFolder(pathKey, watcher->folderPathKeys[folderIndex], watchedFolder.includeSubfolders) && PassesFilters(watchedFolder, filePath))
 		{
-			entry.SortBackupTimes();
-			EnforcePerFileLimit_Locked(entry, g_settings.maxBackupsPerFile, removedHistoryEntries);
+			outFolderIndex = folderIndex;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static constexpr uint64_t kReconcileSettleMs = 250;
+static constexpr uint64_t kReconcileCooldownMs = 2000;
+
+// The catch-up scan runs while the user is logging in, so it is kept to a few threads at background priority
+static constexpr uint32_t kCatchUpScanThreads = 4;
+static constexpr uint32_t kCatchUpScanEntriesPerSecond = 20000;
+
+// Folders whose catch-up scan finished, waiting for the UI thread to store their scan time in the settings
+struct CompletedCatchUpScan
+{
+	std::wstring				folderPath;
+	std::fs::file_time_type		scanTime = {};
+};
+
+static std::mutex									g_completedCatchUpScansMutex;
+static std::vector<CompletedCatchUpScan>			g_completedCatchUpScans;
+
+static void RequestReconcile(FolderWatcher* watcher, uint32_t rootIndex)
+{
+	{
+		std::lock_guard<std::mutex> lock(watcher->reconcileMutex);
+
+		// Repeated overflows during a storm keep the original request time, so the pass isn't starved
+		uint64_t& requestTick = watcher->reconcileRequestTicks[rootIndex];
+		if (requestTick == 0)
+		{
+			requestTick = GetTickCount64();
 		}
 	}
 
-	for (const HistoryEntry& entry : removedHistoryEntries)
+	watcher->reconcileCondition.notify_one();
+}
+
+// For the scan passes, which run off the watch thread so waiting for room in the queue is fine.
+// Journaled before it is queued so the copy thread's done record can't overtake it.
+static bool QueueBackupFromScan(FolderWatcher* watcher, const std::wstring& filePath, uint32_t folderIndex)
+{
+	JournalPendingAccepted(filePath);
+
+	QueueBackupResult queueResult = QueueBackupResult::QueueFull;
+	while (!watcher->stopRequested.load())
 	{
-		RemoveFromFilteredEntries(entry.originalPath, entry.timePoint);
+		queueResult = TryQueueBackup(watcher, filePath, folderIndex);
+		if (queueResult != QueueBackupResult::QueueFull)
+		{
+			break;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
 	}
 
-	EnforceGlobalSizeLimit(std::fs::path(g_settings.backupRoot), g_settings.maxBackupSizeMB);
-	RebuildFilteredEntries();
+	if (queueResult != QueueBackupResult::Queued)
+	{
+		JournalPendingDone(filePath);
+		return false;
+	}
 
-	TrayUpdateStatus(g_backupsToday, g_isPaused.load(std::memory_order_relaxed));
+	return true;
 }
 
-static constexpr uint64_t kBackupQuietPeriodMs = 500;
+// Walks one watch root and queues every file that differs from its snapshot. A file without a
+// snapshot is queued only when it was written after watching started, older files just get recorded.
+static void ReconcileWatchRoot(FolderWatcher* watcher, uint32_t rootIndex)
+{
+	const WatchRoot& watchRoot = watcher->watchRoots[rootIndex];
+
+	ScanOptions scanOptions = {};
+	scanOptions.includeSubfolders = watchRoot.includeSubfolders;
+	scanOptions.threadCount = std::clamp(std::thread::hardware_concurrency(), 2u, 8u);
 
-static DWORD PendingBackupWaitTime(const std::unordered_map<std::wstring, uint64_t>& pendingBackupTicks, uint64_t nowTick)
+	ScanFolderParallel(std::fs::path(watchRoot.path), scanOptions, watcher->stopRequested, [&](const ScannedFile& scannedFile)
+	{
+		std::wstring filePath = scannedFile.path.wstring();
+
+		uint32_t folderIndex = 0;
+		if (IsPathUnderRoot(filePath, g_settings.backupRoot) || !FindWatchedFolderForPath(watcher, watchRoot, filePath, folderIndex))
+		{
+			return;
+		}
+
+		bool hasChanged = false;
+		{
+			std::lock_guard<std::mutex> lock(watcher->snapshotMutex);
+
+			auto foundSnapshot = watcher->snapshots.find(filePath);
+			if (foundSnapshot != watcher->snapshots.end())
+			{
+				hasChanged = foundSnapshot->second.size != scannedFile.size || foundSnapshot->second.lastWriteTime != scannedFile.lastWriteTime;
+			}
+			else if (scannedFile.lastWriteTime >= watcher->watchStartTime)
+			{
+				hasChanged = true;
+			}
+			else
+			{
+				watcher->snapshots[filePath] = FileSnapshot{ scannedFile.size, scannedFile.lastWriteTime };
+			}
+		}
+
+		if (hasChanged && QueueBackupFromScan(watcher, filePath, folderIndex))
+		{
+			watcher->reconcileQueued.fetch_add(1, std::memory_order_relaxed);
+		}
+	});
+
+	watcher->reconcilePasses.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Compares every file under the watch roots against the newest indexed backup of it, queueing those
+// whose size or write time differ. A file with no backup is queued if it was written since its folder's
+// last catch-up scan, or unconditionally when the folder has never been scanned, which takes the
+// baseline of a newly added folder. Unchanged files seed the reconcile snapshots.
+static void CatchUpScan(FolderWatcher* watcher)
 {
-	DWORD waitTime = INFINITE;
+	watcher->catchUpRunning.store(true);
+
+	std::fs::file_time_type scanTime = std::fs::file_time_type::clock::now();
+
+	// The scan threads match files by path key and mustn't hold the index lock for the whole scan, so
+	// take a lookup of the newest versions up front
+	std::umap<std::wstring, FileSnapshot> latestBackups;
+	{
+		std::shared_lock<std::shared_mutex> lock(g_indexMutex);
+
+		for (const BackupFile& entry : g_backupIndex)
+		{
+			if (!entry.backups.empty())
+			{
+				const BackupVersion& latestVersion = entry.backups.back();
+				latestBackups[MakePathKey(std::wstring(GetPath(entry.originalPathId)))] = FileSnapshot{ latestVersion.sourceSize, latestVersion.sourceWriteTime };
+			}
+		}
+	}
+
+	ScanOptions scanOptions = {};
+	scanOptions.threadCount = std::clamp(std::thread::hardware_concurrency() / 2, 1u, kCatchUpScanThreads);
+	scanOptions.maxEntriesPerSecond = kCatchUpScanEntriesPerSecond;
+	scanOptions.backgroundPriority = true;
 
-	for (const auto& pendingBackup : pendingBackupTicks)
+	for (const WatchRoot& watchRoot : watcher->watchRoots)
 	{
-		uint64_t elapsedMs = nowTick - pendingBackup.second;
-		if (elapsedMs >= kBackupQuietPeriodMs)
+		scanOptions.includeSubfolders = watchRoot.includeSubfolders;
+
+		bool scanCompleted = ScanFolderParallel(std::fs::path(watchRoot.path), scanOptions, watcher->stopRequested, [&](const ScannedFile& scannedFile)
+		{
+			std::wstring filePath = scannedFile.path.wstring();
+			watcher->catchUpScanned.fetch_add(1, std::memory_order_relaxed);
+
+			uint32_t folderIndex = 0;
+			if (IsPathUnderRoot(filePath, g_settings.backupRoot) || !FindWatchedFolderForPath(watcher, watchRoot, filePath, folderIndex))
+			{
+				return;
+			}
+
+			bool hasChanged = false;
+
+			auto foundBackup = latestBackups.find(MakePathKey(filePath));
+			if (foundBackup != latestBackups.end())
+			{
+				hasChanged = foundBackup->second.size != scannedFile.size || foundBackup->second.lastWriteTime != scannedFile.lastWriteTime;
+			}
+			else
+			{
+				std::fs::file_time_type lastScanTime = watcher->folders[folderIndex].lastScanTime;
+				hasChanged = lastScanTime == std::fs::file_time_type() || scannedFile.lastWriteTime >= lastScanTime;
+			}
+
+			if (!hasChanged)
+			{
+				std::lock_guard<std::mutex> lock(watcher->snapshotMutex);
+				watcher->snapshots.emplace(filePath, FileSnapshot{ scannedFile.size, scannedFile.lastWriteTime });
+				return;
+			}
+
+			if (QueueBackupFromScan(watcher, filePath, folderIndex))
+			{
+				watcher->catchUpQueued.fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+
+		if (!scanCompleted)
 		{
-			return 0;
+			break;
 		}
 
-		DWORD remainingMs = (DWORD)(kBackupQuietPeriodMs - elapsedMs);
-		waitTime = (std::min)(waitTime, remainingMs);
+		std::lock_guard<std::mutex> lock(g_completedCatchUpScansMutex);
+		for (uint32_t folderIndex : watchRoot.folderIndices)
+		{
+			g_completedCatchUpScans.push_back(CompletedCatchUpScan{ watcher->folders[folderIndex].path, scanTime });
+		}
 	}
 
-	return waitTime;
+	watcher->catchUpRunning.store(false);
 }
 
-static void CopySettledPendingBackups(const WatchedFolder& watchedFolder, std::unordered_map<std::wstring, uint64_t>& pendingBackupTicks, uint64_t nowTick)
+// Called on the UI thread, which owns g_settings
+static void ApplyCompletedCatchUpScans()
 {
-	for (auto itr = pendingBackupTicks.begin(); itr != pendingBackupTicks.end();)
+	std::vector<CompletedCatchUpScan> completedScans;
+	{
+		std::lock_guard<std::mutex> lock(g_completedCatchUpScansMutex);
+		completedScans.swap(g_completedCatchUpScans);
+	}
+
+	for (const CompletedCatchUpScan& completedScan : completedScans)
 	{
-		if (nowTick - itr->second < kBackupQuietPeriodMs)
+		for (WatchedFolder& watchedFolder : g_settings.watched)
 		{
-			++itr;
+			if (watchedFolder.path == completedScan.folderPath && watchedFolder.lastScanTime < completedScan.scanTime)
+			{
+				watchedFolder.lastScanTime = completedScan.scanTime;
+				MarkSettingsDirty();
+			}
+		}
+	}
+}
+
+// Runs reconcile passes off the watch thread. A pass starts once the overflow burst has had time to
+// settle, and passes are spaced by a cooldown so a long storm doesn't turn into back to back walks.
+static void ReconcileThreadProc(FolderWatcher* watcher)
+{
+	CatchUpScan(watcher);
+
+	uint64_t lastPassEndTick = 0;
+
+	std::unique_lock<std::mutex> lock(watcher->reconcileMutex);
+
+	while (!watcher->stopRequested.load())
+	{
+		uint64_t dueTick = UINT64_MAX;
+		size_t dueRootIndex = 0;
+
+		for (size_t rootIndex = 0; rootIndex < watcher->reconcileRequestTicks.size(); ++rootIndex)
+		{
+			uint64_t requestTick = watcher->reconcileRequestTicks[rootIndex];
+			if (requestTick == 0)
+			{
+				continue;
+			}
+
+			uint64_t rootDueTick = (std::max)(requestTick + kReconcileSettleMs, lastPassEndTick + kReconcileCooldownMs);
+			if (rootDueTick < dueTick)
+			{
+				dueTick = rootDueTick;
+				dueRootIndex = rootIndex;
+			}
+		}
+
+		if (dueTick == UINT64_MAX)
+		{
+			watcher->reconcileCondition.wait(lock);
+			continue;
+		}
+
+		uint64_t nowTick = GetTickCount64();
+		if (dueTick > nowTick)
+		{
+			watcher->reconcileCondition.wait_for(lock, std::chrono::milliseconds(dueTick - nowTick));
 			continue;
 		}
 
-		std::wstring filePath = itr->first;
-		itr = pendingBackupTicks.erase(itr);
-		CopyToBackupAndIndex(watchedFolder, filePath);
+		watcher->reconcileRequestTicks[dueRootIndex] = 0;
+
+		lock.unlock();
+		ReconcileWatchRoot(watcher, (uint32_t)dueRootIndex);
+		lastPassEndTick = GetTickCount64();
+		lock.lock();
 	}
 }
 
-static void WatchThreadProc(FolderWatcher* watcher)
+static void WatchLoopProc(FolderWatcher* watcher)
 {
-	const WatchedFolder watchedFolder = watcher->config;
+	const std::vector<WatchRoot>& watchRoots = watcher->watchRoots;
+	WatchBackend* backend = watcher->backend.get();
 
-	watcher->directoryHandle = CreateFileW(
-		watchedFolder.path.c_str(),
-		FILE_LIST_DIRECTORY,
-		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-		nullptr,
-		OPEN_EXISTING,
-		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
-		nullptr);
+	size_t activeWatches = 0;
+	for (uint32_t rootIndex = 0; rootIndex < (uint32_t)watchRoots.size(); ++rootIndex)
+	{
+		const WatchRoot& watchRoot = watchRoots[rootIndex];
+		if (backend->AddWatch(rootIndex, watchRoot.path, watchRoot.includeSubfolders))
+		{
+			++activeWatches;
+		}
+	}
 
-	if (watcher->directoryHandle == INVALID_HANDLE_VALUE)
+	if (activeWatches == 0)
 	{
+		watcher->unfinishedPaths = watcher->replayPaths;
+		backend->Close();
 		return;
 	}
 
-	DWORD notifyFlags = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
-	std::vector<uint8_t> notifyBuffer;
-	notifyBuffer.resize(64 * 1024);
-	std::unordered_map<std::wstring, uint64_t> pendingBackupTicks;
+	std::vector<WatchEvent> watchEvents;
 
-	OVERLAPPED overlapped = {};
-	overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
-	if (overlapped.hEvent == nullptr)
+	auto schedule = std::make_unique<PendingBackupSchedule>(GetTickCount64());
+	schedule->maxLatencyMs = watcher->maxLatencyMs;
+
+	// Already journaled, so these are scheduled without a new accepted record
+	for (const std::wstring& replayPath : watcher->replayPaths)
 	{
-		CloseHandle(watcher->directoryHandle);
-		watcher->directoryHandle = INVALID_HANDLE_VALUE;
-		return;
+		bool isScheduled = false;
+
+		for (uint32_t rootIndex = 0; rootIndex < (uint32_t)watchRoots.size() && !isScheduled; ++rootIndex)
+		{
+			uint32_t folderIndex = 0;
+			if (FindWatchedFolderForPath(watcher, watchRoots[rootIndex], replayPath, folderIndex))
+			{
+				isScheduled = true;
+				if (!TouchPendingBackup(*schedule, replayPath, folderIndex, GetTickCount64()))
+				{
+					JournalPendingDone(replayPath);
+				}
+			}
+		}
+
+		if (!isScheduled)
+		{
+			JournalPendingDone(replayPath);
+		}
 	}
 
 	while (!watcher->stopRequested.load())
 	{
-		ResetEvent(overlapped.hEvent);
-		DWORD bytesReturned = 0;
+		watchEvents.clear();
 
-		BOOL readStarted = ReadDirectoryChangesW(
-			watcher->directoryHandle,
-			notifyBuffer.data(),
-			(DWORD)notifyBuffer.size(),
-			watchedFolder.includeSubfolders ? TRUE : FALSE,
-			notifyFlags,
-			nullptr,
-			&overlapped,
-			nullptr);
-
-		if (!readStarted && GetLastError() != ERROR_IO_PENDING)
+		uint32_t waitTime = PendingBackupWaitTime(schedule->wheel, GetTickCount64());
+		if (!backend->WaitForEvents(waitTime, watchEvents))
 		{
 			break;
 		}
 
-		bool readCompleted = false;
-		while (!readCompleted && !watcher->stopRequested.load())
+		uint64_t nowTick = GetTickCount64();
+
+		for (const WatchEvent& watchEvent : watchEvents)
 		{
-			DWORD waitTime = PendingBackupWaitTime(pendingBackupTicks, GetTickCount64());
-			DWORD waitResult = WaitForSingleObject(overlapped.hEvent, waitTime);
+			if (watchEvent.watchId >= watchRoots.size())
+			{
+				continue;
+			}
 
-			if (waitResult == WAIT_TIMEOUT)
+			if (watchEvent.action == WatchAction::Overflow)
 			{
-				CopySettledPendingBackups(watchedFolder, pendingBackupTicks, GetTickCount64());
+				RequestReconcile(watcher, watchEvent.watchId);
 				continue;
 			}
 
-			if (waitResult != WAIT_OBJECT_0 ||
-				!GetOverlappedResult(watcher->directoryHandle, &overlapped, &bytesReturned, FALSE))
+			if (watchEvent.action == WatchAction::Removed || watchEvent.action == WatchAction::RenamedOldName)
 			{
-				readCompleted = false;
-				break;
+				if (CancelPendingBackup(*schedule, watchEvent.fullPath))
+				{
+					watcher->collapsedTempFiles.fetch_add(1, std::memory_order_relaxed);
+				}
+
+				if (watchEvent.action == WatchAction::Removed)
+				{
+					schedule->profiles.erase(watchEvent.fullPath);
+				}
+				continue;
+			}
+
+			bool isInteresting =
+				watchEvent.action == WatchAction::Added ||
+				watchEvent.action == WatchAction::Modified ||
+				watchEvent.action == WatchAction::RenamedNewName;
+
+			if (!isInteresting)
+			{
+				continue;
+			}
+
+			// Exclude anything inside backup root
+			if (!IsPathUnderRoot(watchEvent.fullPath, g_settings.backupRoot))
+			{
+				uint32_t folderIndex = 0;
+				if (FindWatchedFolderForPath(watcher, watchRoots[watchEvent.watchId], watchEvent.fullPath, folderIndex))
+				{
+					if (TouchPendingBackup(*schedule, watchEvent.fullPath, folderIndex, nowTick))
+					{
+						JournalPendingAccepted(watchEvent.fullPath);
+					}
+				}
 			}
+		}
+
+		QueueSettledPendingBackups(watcher, *schedule, nowTick);
+	}
+
+	// Still journaled as outstanding; the next watcher (or the next run) picks them up
+	for (const auto& pendingBackup : schedule->pending)
+	{
+		watcher->unfinishedPaths.push_back(pendingBackup.first);
+	}
+
+	backend->Close();
+}
+
+static void StopWatchers()
+{
+	std::lock_guard<std::mutex> lock(g_watchersMutex);
+
+	if (!g_watcher)
+	{
+		return;
+	}
+
+	g_watcher->stopRequested.store(true);
+	g_watcher->backend->Cancel();
+
+	if (g_watcher->workerThread.joinable())
+	{
+		g_watcher->workerThread.join();
+	}
+
+	g_replayPendingPaths.insert(g_replayPendingPaths.end(), g_watcher->unfinishedPaths.begin(), g_watcher->unfinishedPaths.end());
+
+	{
+		std::lock_guard<std::mutex> reconcileLock(g_watcher->reconcileMutex);
+	}
+	g_watcher->reconcileCondition.notify_all();
+
+	if (g_watcher->reconcileThread.joinable())
+	{
+		g_watcher->reconcileThread.join();
+	}
 
-			readCompleted = true;
-		}
+	// What is left in the queue is copied at full speed, nobody should wait on the limits to exit
+	SetBackupIoLimits(0, 0);
 
-		if (!readCompleted)
-		{
-			CancelIoEx(watcher->directoryHandle, &overlapped);
-			GetOverlappedResult(watcher->directoryHandle, &overlapped, &bytesReturned, TRUE);
-			break;
-		}
+	{
+		std::lock_guard<std::mutex> wakeLock(g_watcher->copyWakeMutex);
+		g_watcher->copyStopRequested.store(true);
+	}
+	g_watcher->copyWakeCondition.notify_all();
 
-		if (bytesReturned == 0)
+	for (std::thread& copyThread : g_watcher->copyThreads)
+	{
+		if (copyThread.joinable())
 		{
-			continue;
+			copyThread.join();
 		}
+	}
 
-		uint64_t nowTick = GetTickCount64();
+	g_watcher.reset();
+}
 
-		FILE_NOTIFY_INFORMATION* notifyInfo = (FILE_NOTIFY_INFORMATION*)notifyBuffer.data();
-		while (true)
-		{
-			std::wstring relativePath(notifyInfo->FileName, notifyInfo->FileNameLength / sizeof(wchar_t));
-			std::wstring fullPath = (std::fs::path(watchedFolder.path) / std::fs::path(relativePath)).wstring();
+static void StartWatchersFromSettings()
+{
+	StopWatchers();
 
-			bool isInteresting =
-				notifyInfo->Action == FILE_ACTION_ADDED ||
-				notifyInfo->Action == FILE_ACTION_MODIFIED ||
-				notifyInfo->Action == FILE_ACTION_RENAMED_NEW_NAME;
+	std::lock_guard<std::mutex> lock(g_watchersMutex);
 
-			if (isInteresting)
-			{
-				// Exclude anything inside backup root
-				if (!IsPathUnderRoot(fullPath, g_settings.backupRoot))
-				{
-					if (PassesFilters(watchedFolder, fullPath))
-					{
-						pendingBackupTicks[fullPath] = nowTick;
-					}
-				}
-			}
+	if (g_settings.watched.empty())
+	{
+		return;
+	}
 
-			if (notifyInfo->NextEntryOffset == 0)
-			{
-				break;
-			}
+	g_watcher = std::make_unique<FolderWatcher>();
+	g_watcher->folders = g_settings.watched;
+	g_watcher->replayPaths.swap(g_replayPendingPaths);
 
-			notifyInfo = (FILE_NOTIFY_INFORMATION*)((uint8_t*)notifyInfo + notifyInfo->NextEntryOffset);
-		}
+	for (const WatchedFolder& watchedFolder : g_watcher->folders)
+	{
+		g_watcher->folderPathKeys.push_back(MakePathKey(watchedFolder.path));
+	}
+
+	g_watcher->watchRoots = BuildWatchRoots(g_watcher->folders, g_watcher->folderPathKeys);
+	g_watcher->backend = CreateWatchBackend();
+	g_watcher->stopRequested.store(false);
+	g_watcher->watchStartTime = std::fs::file_time_type::clock::now();
+	g_watcher->maxLatencyMs = (uint64_t)g_settings.maxBackupLatencySec * 1000ull;
+	g_watcher->reconcileRequestTicks.assign(g_watcher->watchRoots.size(), 0);
+
+	SetBackupIoLimits(g_settings.maxCopyMegabytesPerSec, g_settings.maxCopyOperationsPerSec);
 
-		CopySettledPendingBackups(watchedFolder, pendingBackupTicks, nowTick);
+	uint32_t copyThreadCount = std::clamp(g_settings.copyWorkerCount, 1u, kMaxCopyWorkers);
+	for (uint32_t threadIndex = 0; threadIndex < copyThreadCount; ++threadIndex)
+	{
+		g_watcher->copyThreads.push_back(std::thread(CopyThreadProc, g_watcher.get()));
 	}
 
-	CloseHandle(overlapped.hEvent);
-	CloseHandle(watcher->directoryHandle);
+	g_watcher->reconcileThread = std::thread(ReconcileThreadProc, g_watcher.get());
+	g_watcher->workerThread = std::thread(WatchLoopProc, g_watcher.get());
 }
 
-static void StopWatchers()
+static BackupPipelineStats GetBackupPipelineStats()
 {
+	BackupPipelineStats stats = {};
+	stats.skippedUnchanged = g_skippedUnchangedBackups.load(std::memory_order_relaxed);
+	stats.copyRetries = g_copyRetries.load(std::memory_order_relaxed);
+	stats.tornBackups = g_tornBackups.load(std::memory_order_relaxed);
+	stats.dedupedBackups = g_dedupedBackups.load(std::memory_order_relaxed);
+	stats.dedupedBytes = g_dedupedBytes.load(std::memory_order_relaxed);
+	stats.deltaBackups = g_deltaBackups.load(std::memory_order_relaxed);
+	stats.deltaBytesSaved = g_deltaBytesSaved.load(std::memory_order_relaxed);
+	stats.compressedBackups = g_compressedBackups.load(std::memory_order_relaxed);
+	stats.compressionBytesSaved = g_compressionBytesSaved.load(std::memory_order_relaxed);
+	stats.packedBackups = g_packedBackups.load(std::memory_order_relaxed);
+
 	std::lock_guard<std::mutex> lock(g_watchersMutex);
 
-	for (std::unique_ptr<FolderWatcher>& watcher : g_watchers)
+	if (!g_watcher)
 	{
-		watcher->stopRequested.store(true);
-		CancelIoEx(watcher->directoryHandle, nullptr);
+		return stats;
 	}
 
-	for (auto& watcher : g_watchers)
+	stats.copyThreads = (uint32_t)g_watcher->copyThreads.size();
+	stats.busyCopyThreads = stats.copyThreads - (std::min)(stats.copyThreads, g_watcher->idleCopyThreads.load());
+	stats.depth = g_watcher->backupQueue.Depth();
+	stats.capacity = g_watcher->backupQueue.Capacity();
+	stats.highWater = g_watcher->backupQueue.HighWater();
+	stats.pushed = g_watcher->backupQueue.PushedCount();
+	stats.rejected = g_watcher->backupQueue.RejectedCount();
+	stats.completed = g_watcher->completedCopies.load(std::memory_order_relaxed);
+	stats.reconcilePasses = g_watcher->reconcilePasses.load(std::memory_order_relaxed);
+	stats.reconcileQueued = g_watcher->reconcileQueued.load(std::memory_order_relaxed);
+	stats.catchUpRunning = g_watcher->catchUpRunning.load();
+	stats.catchUpScanned = g_watcher->catchUpScanned.load(std::memory_order_relaxed);
+	stats.catchUpQueued = g_watcher->catchUpQueued.load(std::memory_order_relaxed);
+	stats.settledBackups = g_watcher->settledBackups.load(std::memory_order_relaxed);
+	stats.forcedBackups = g_watcher->forcedBackups.load(std::memory_order_relaxed);
+	stats.collapsedTempFiles = g_watcher->collapsedTempFiles.load(std::memory_order_relaxed);
+
+	if (stats.settledBackups > 0)
 	{
-		if (watcher->workerThread.joinable())
-		{
-			watcher->workerThread.join();
-		}
+		stats.averageQuietWindowMs = (uint32_t)(g_watcher->quietWindowSumMs.load(std::memory_order_relaxed) / stats.settledBackups);
 	}
 
-	g_watchers.clear();
+	for (size_t bucketIndex = 0; bucketIndex < kQuietWindowBucketCount; ++bucketIndex)
+	{
+		stats.quietWindowHistogram[bucketIndex] = g_watcher->quietWindowHistogram[bucketIndex].load(std::memory_order_relaxed);
+	}
+	return stats;
 }
 
-static void StartWatchersFromSettings()
+// A version stored as a delta has no file of its own, anything handing a backup path to another
+// program gets it rebuilt first. Other paths come back unchanged.
+static std::wstring ResolveBackupPathForRead(const std::wstring& backupPath)
 {
-	StopWatchers();
+	return MaterializeBackupForRead(std::fs::path(backupPath)).wstring();
+}
 
-	std::lock_guard<std::mutex> lock(g_watchersMutex);
+// Selects the file holding a version in Explorer. A packed version has none, its rebuilt copy is shown.
+static void ShowBackupInExplorer(const std::wstring& backupPath)
+{
+	std::fs::path storedPath = GetStoredBackupPath(std::fs::path(backupPath));
+	std::error_code errorCode;
 
-	for (const auto& watchedFolder : g_settings.watched)
+	if (std::fs::exists(storedPath, errorCode))
 	{
-		auto folderWatcher = std::make_unique<FolderWatcher>();
-		folderWatcher->config = watchedFolder;
-		folderWatcher->stopRequested.store(false);
-		folderWatcher->workerThread = std::thread(WatchThreadProc, folderWatcher.get());
-
-		g_watchers.push_back(std::move(folderWatcher));
+		OpenExplorerSelectPath(storedPath.wstring());
+	}
+	else
+	{
+		OpenExplorerSelectPath(ResolveBackupPathForRead(backupPath));
 	}
 }
 
@@ -1278,8 +2995,17 @@ void LaunchDiffTool(const std::wstring& diffToolPath, const std::wstring& backup
 		return;
 	}
 
+	// Either side may be a backup (Diff Previous passes two)
+	std::wstring leftPath = ResolveBackupPathForRead(backupFilePath);
+	std::wstring rightPath = ResolveBackupPathForRead(originalFilePath);
+
+	if (leftPath.empty() || rightPath.empty())
+	{
+		return;
+	}
+
 	// Convention: diffTool.exe "<backup>" "<original>"
-	std::wstring parameters = L"\"" + backupFilePath + L"\"" + L" " + L"\"" + originalFilePath + L"\"";
+	std::wstring parameters = L"\"" + leftPath + L"\"" + L" " + L"\"" + rightPath + L"\"";
 
 	HINSTANCE resultHandle = ShellExecuteW(
 		nullptr,
@@ -1517,6 +3243,7 @@ static void UI_WatchedFolders()
 						if (!selectedPath.empty())
 						{
 							watchedFolder.path = selectedPath;
+							watchedFolder.lastScanTime = {};
 							MarkSettingsDirty();
 							SaveSettings();
 							StartWatchersFromSettings();
@@ -1529,6 +3256,8 @@ static void UI_WatchedFolders()
 					ImGui::TableNextColumn();
 					if (ImGui::Checkbox("##include_subfolders", &watchedFolder.includeSubfolders))
 					{
+						// Sub-folders that just came into scope need their baseline too
+						watchedFolder.lastScanTime = {};
 						MarkSettingsDirty();
 					}
 
@@ -1716,7 +3445,7 @@ static void UI_BackedUpFiles()
 
 	static std::wstring searchText;
 
-	static std::set<std::wstring> selectedOriginalPaths;
+	static std::set<PathId> selectedOriginalPaths;
 	static std::wstring selectedBackupPath;
 	static int lastClickIndex = -1;
 	static int rangeSelectMinIndex = -1;
@@ -1727,7 +3456,7 @@ static void UI_BackedUpFiles()
 	static size_t pendingDeleteBackupCount = 0;
 
 
-	std::list<BackupFile>::iterator currentSelectionItr = g_backupIndex.end();
+	BackupEntryHandle currentSelection = kInvalidBackupEntry;
 	std::wstring latestBackupPath;
 
 	static float leftPaneWidth = ImGui::GetContentRegionAvail().x * 0.5f;
@@ -1785,34 +3514,27 @@ static void UI_BackedUpFiles()
 
 	auto SortBackupIndex_Locked = [&](int column, ImGuiSortDirection direction)
 	{
-		g_backupIndex.sort([&](const BackupFile& left, const BackupFile& right)
+		g_backupIndex.Sort([&](const BackupFile& left, const BackupFile& right)
 		{
 			int compareResult = 0;
 
 			switch (column)
 			{
 			case 0: // Path
+				compareResult = GetPathDirectory(left.originalPathId).compare(GetPathDirectory(right.originalPathId));
+				if (compareResult == 0)
 				{
-					const std::fs::path leftPath(left.originalPath);
-					const std::fs::path rightPath(right.originalPath);
-					const std::wstring leftDir = leftPath.parent_path().wstring();
-					const std::wstring rightDir = rightPath.parent_path().wstring();
-					compareResult = leftDir.compare(rightDir);
-					if (compareResult == 0)
-					{
-						compareResult = leftPath.filename().wstring().compare(rightPath.filename().wstring());
-					}
+					compareResult = GetPathFileName(left.originalPathId).compare(GetPathFileName(right.originalPathId));
 				}
 				break;
 			case 1: // Filename
-				compareResult = std::fs::path(left.originalPath).filename().wstring().compare(
-					std::fs::path(right.originalPath).filename().wstring());
+				compareResult = GetPathFileName(left.originalPathId).compare(GetPathFileName(right.originalPathId));
 				break;
 			case 2: // #
 				compareResult = (left.backups.size() < right.backups.size()) ? -1 : (left.backups.size() > right.backups.size() ? 1 : 0);
 				break;
 			case 3: // Latest Backup
-				compareResult = (left.backups.back() < right.backups.back()) ? -1 : (left.backups.back() > right.backups.back() ? 1 : 0);
+				compareResult = (left.backups.back().timePoint < right.backups.back().timePoint) ? -1 : (left.backups.back().timePoint > right.backups.back().timePoint ? 1 : 0);
 				break;
 			default:
 				break;
@@ -1825,7 +3547,7 @@ static void UI_BackedUpFiles()
 
 			if (compareResult == 0)
 			{
-				return left.originalPath < right.originalPath;
+				return GetPath(left.originalPathId) < GetPath(right.originalPathId);
 			}
 
 			return compareResult < 0;
@@ -1837,7 +3559,7 @@ static void UI_BackedUpFiles()
 	
 		bool selectedIsVisible = false;
 		bool hasVisibleEntries = false;
-		std::list<BackupFile>::iterator firstVisibleItr = g_backupIndex.end();
+		BackupEntryHandle firstVisible = kInvalidBackupEntry;
 
 		if (ImGui::BeginChild("backed_up_files_left", ImVec2(leftPaneWidth, paneHeight), false))
 		{
@@ -1867,18 +3589,22 @@ static void UI_BackedUpFiles()
 
 				bool rangeSelectPending = rangeSelectMinIndex >=0 && rangeSelectMaxIndex >= 0;
 
+				// Matched against the lowercase paths the pool keeps, so nothing is lowered per row
+				std::vector<std::wstring> searchKeywordsLower = SplitKeywordsLower(searchText);
+
 				int currentIndex = 0;
 
-				for (auto entryIt = g_backupIndex.begin(); entryIt != g_backupIndex.end(); ++entryIt, ++currentIndex)
+				for (auto handleIt = g_backupIndex.Handles().begin(); handleIt != g_backupIndex.Handles().end(); ++handleIt, ++currentIndex)
 				{
-					const BackupFile& entry = *entryIt;
+					BackupEntryHandle entryHandle = *handleIt;
+					const BackupFile& entry = *g_backupIndex.Get(entryHandle);
 
 					if (entry.backups.empty())
 					{
 						continue;
 					}
 
-					if (!ContainsAllKeywords(entry.originalPath, searchText))
+					if (!ContainsAllKeywordsLower(GetPathLower(entry.originalPathId), searchKeywordsLower))
 					{
 						continue;
 					}
@@ -1890,13 +3616,13 @@ static void UI_BackedUpFiles()
 
 					if (!hasVisibleEntries)
 					{
-						firstVisibleItr = entryIt;
+						firstVisible = entryHandle;
 						hasVisibleEntries = true;
 					}
 
-					if (selectedOriginalPaths.count(entry.originalPath))
+					if (selectedOriginalPaths.count(entry.originalPathId))
 					{
-						currentSelectionItr = entryIt;
+						currentSelection = entryHandle;
 						selectedIsVisible = true;
 					}
 
@@ -1904,18 +3630,18 @@ static void UI_BackedUpFiles()
 					{
 						if (currentIndex >= rangeSelectMinIndex && currentIndex <= rangeSelectMaxIndex)
 						{
-							selectedOriginalPaths.insert(entry.originalPath);
+							selectedOriginalPaths.insert(entry.originalPathId);
 						}
 					}
 
-					std::fs::path originalFsPath(entry.originalPath);
-					std::wstring originalNameWide = originalFsPath.filename().wstring();
-					std::wstring originalFolderWide = originalFsPath.parent_path().wstring();
+					std::wstring originalPathWide(GetPath(entry.originalPathId));
+					std::wstring originalNameWide(GetPathFileName(entry.originalPathId));
+					std::wstring originalFolderWide(GetPathDirectory(entry.originalPathId));
 					std::string originalNameUtf8 = WToUTF8(originalNameWide);
 					std::string originalFolderUtf8 = WToUTF8(originalFolderWide);
-					std::string originalPathUtf8 = WToUTF8(entry.originalPath);
+					std::string originalPathUtf8 = WToUTF8(originalPathWide);
 
-					ImGui::PushID(entry.originalPath.data());
+					ImGui::PushID((int)entry.originalPathId);
 					ImGui::TableNextRow();
 					float rowMinY = ImGui::GetCursorScreenPos().y;
 
@@ -1948,22 +3674,22 @@ static void UI_BackedUpFiles()
 					if (!g_modalWindowShowing && ImGui::IsItemHovered() && ImGui::IsMouseDoubleClicked(ImGuiMouseButton_Left))
 					{
 						selectedOriginalPaths.clear();
-						selectedOriginalPaths.insert(entry.originalPath);
+						selectedOriginalPaths.insert(entry.originalPathId);
 						selectedBackupPath.clear();
-						currentSelectionItr = entryIt;
+						currentSelection = entryHandle;
 						selectedIsVisible = true;
-						OpenFileWithShell(entry.originalPath);
+						OpenFileWithShell(originalPathWide);
 					}
 					if (!g_modalWindowShowing && ImGui::BeginPopupContextItem("original_context"))
 					{
 						if (ImGui::MenuItem("Show in Explorer"))
 						{
 							selectedOriginalPaths.clear();
-							selectedOriginalPaths.insert(entry.originalPath);
+							selectedOriginalPaths.insert(entry.originalPathId);
 							selectedBackupPath.clear();
-							currentSelectionItr = entryIt;
+							currentSelection = entryHandle;
 							selectedIsVisible = true;
-							OpenExplorerSelectPath(entry.originalPath);
+							OpenExplorerSelectPath(originalPathWide);
 						}
 						ImGui::EndPopup();
 					}
@@ -1975,7 +3701,7 @@ static void UI_BackedUpFiles()
 
 					ImGui::TableNextColumn();
 					{
-						std::wstring latestTimestamp = FormatTimestampForDisplay(entry.backups.back());
+						std::wstring latestTimestamp = FormatTimestampForDisplay(entry.backups.back().timePoint);
 						ImGui::TextUnformatted(WToUTF8(latestTimestamp).c_str());
 					}
 
@@ -1990,18 +3716,18 @@ static void UI_BackedUpFiles()
 						ImVec2 rowMax(windowPos.x + contentMax.x, rowMaxY);
 
 						bool isHovered = !g_modalWindowShowing && ImGui::IsMouseHoveringRect(rowMin, rowMax, false);
-						bool isSelected = (selectedOriginalPaths.count(entry.originalPath));
+						bool isSelected = (selectedOriginalPaths.count(entry.originalPathId));
 						if (!g_modalWindowShowing && isHovered && ImGui::IsMouseClicked(ImGuiMouseButton_Left))
 						{
 							if (isCtrlDown)
 							{
-								if (selectedOriginalPaths.count(entry.originalPath))
+								if (selectedOriginalPaths.count(entry.originalPathId))
 								{
-									selectedOriginalPaths.erase(entry.originalPath);
+									selectedOriginalPaths.erase(entry.originalPathId);
 								}
 								else
 								{
-									selectedOriginalPaths.insert(entry.originalPath);
+									selectedOriginalPaths.insert(entry.originalPathId);
 								}
 								lastClickIndex = currentIndex;
 							}
@@ -2015,11 +3741,11 @@ static void UI_BackedUpFiles()
 							{
 								lastClickIndex = currentIndex;
 								selectedOriginalPaths.clear();
-								selectedOriginalPaths.insert(entry.originalPath);
+								selectedOriginalPaths.insert(entry.originalPathId);
 							}
 
 							selectedBackupPath.clear();
-							currentSelectionItr = entryIt;
+							currentSelection = entryHandle;
 							selectedIsVisible = true;
 							isSelected = true;
 						}
@@ -2054,13 +3780,13 @@ static void UI_BackedUpFiles()
 		{
 			selectedOriginalPaths.clear();
 			selectedBackupPath.clear();
-			currentSelectionItr = g_backupIndex.end();
+			currentSelection = kInvalidBackupEntry;
 		}
 		else if (!selectedIsVisible)
 		{
-			currentSelectionItr = firstVisibleItr;
+			currentSelection = firstVisible;
 			selectedOriginalPaths.clear();
-			selectedOriginalPaths.insert( currentSelectionItr->originalPath );
+			selectedOriginalPaths.insert( g_backupIndex.Get(currentSelection)->originalPathId );
 			selectedBackupPath.clear();
 		}
 
@@ -2102,13 +3828,13 @@ static void UI_BackedUpFiles()
 			}
 			else
 			{
-				if (currentSelectionItr == g_backupIndex.end())
+				if (!g_backupIndex.Get(currentSelection))
 				{
 					ImGui::TextDisabled("No backups available for selected file.");
 				}
 				else
 				{
-					const BackupFile& selectedEntry = *currentSelectionItr;
+					const BackupFile& selectedEntry = *g_backupIndex.Get(currentSelection);
 
 					if (selectedEntry.backups.empty())
 					{
@@ -2116,9 +3842,9 @@ static void UI_BackedUpFiles()
 					}
 
 					bool hasFilteredBackups = false;
-					for (const TimePoint& backupTimePoint : selectedEntry.backups)
+					for (const BackupVersion& backupVersion : selectedEntry.backups)
 					{
-						if (DateFilterMatches(g_backupDateFilter, backupTimePoint))
+						if (DateFilterMatches(g_backupDateFilter, backupVersion.timePoint))
 						{
 							hasFilteredBackups = true;
 							break;
@@ -2136,10 +3862,10 @@ static void UI_BackedUpFiles()
 					{
 						for (int backupIndex = (int)selectedEntry.backups.size() - 1; backupIndex >= 0; --backupIndex)
 						{
-							const TimePoint& backupTimePoint = selectedEntry.backups[backupIndex];
+							const TimePoint& backupTimePoint = selectedEntry.backups[backupIndex].timePoint;
 							if (DateFilterMatches(g_backupDateFilter, backupTimePoint))
 							{
-								latestBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, selectedEntry.originalPath, backupTimePoint);
+								latestBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, GetPath(selectedEntry.originalPathId), backupTimePoint);
 								break;
 							}
 						}
@@ -2153,12 +3879,12 @@ static void UI_BackedUpFiles()
 
 							for (int backupIndex = (int)selectedEntry.backups.size() - 1; backupIndex >= 0; --backupIndex)
 							{
-								const TimePoint& backupTimePoint = selectedEntry.backups[backupIndex];
+								const TimePoint& backupTimePoint = selectedEntry.backups[backupIndex].timePoint;
 								if (!DateFilterMatches(g_backupDateFilter, backupTimePoint))
 								{
 									continue;
 								}
-								std::wstring backupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, selectedEntry.originalPath, backupTimePoint);
+								std::wstring backupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, GetPath(selectedEntry.originalPathId), backupTimePoint);
 								std::wstring backupFileName = std::fs::path(backupPath).filename().wstring();
 								std::string backupFileNameUtf8 = WToUTF8(backupFileName);
 
@@ -2172,6 +3898,16 @@ static void UI_BackedUpFiles()
 									std::wstring timestamp = FormatTimestampForDisplay(backupTimePoint);
 						
 									ImGui::TextUnformatted(WToUTF8(timestamp).c_str());
+
+									if (selectedEntry.backups[backupIndex].possiblyTorn)
+									{
+										ImGui::SameLine();
+										ImGui::TextColored(ImVec4(1.0f, 0.6f, 0.2f, 1.0f), "(torn?)");
+										if (ImGui::IsItemHovered())
+										{
+											ImGui::SetTooltip("The file was still being written while it was backed up, this copy may be incomplete.");
+										}
+									}
 								}
 
 								ImGui::TableNextColumn();
@@ -2180,12 +3916,12 @@ static void UI_BackedUpFiles()
 
 									if (ImGui::IsItemHovered())
 									{
-										ImGui::SetTooltip("%s", WToUTF8(backupPath).c_str());
+										ImGui::SetTooltip("%s\nStored in %.1f KB", WToUTF8(backupPath).c_str(), (double)selectedEntry.backups[backupIndex].storedBytes / 1024.0);
 									}
 
 									if (ImGui::IsItemHovered() && ImGui::IsMouseDoubleClicked(ImGuiMouseButton_Left))
 									{
-										OpenFileWithShell(backupPath);
+										OpenFileWithShell(ResolveBackupPathForRead(backupPath));
 									}
 								}
 
@@ -2198,8 +3934,8 @@ static void UI_BackedUpFiles()
 									}
 									if (ImGui::Button("Diff Previous"))
 									{
-										const TimePoint& previousTimePoint = selectedEntry.backups[backupIndex - 1];
-										std::wstring previousBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, selectedEntry.originalPath, previousTimePoint);
+										const TimePoint& previousTimePoint = selectedEntry.backups[backupIndex - 1].timePoint;
+										std::wstring previousBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, GetPath(selectedEntry.originalPathId), previousTimePoint);
 										LaunchDiffTool(g_settings.diffToolPath, previousBackupPath, backupPath);
 									}
 									if (!hasPreviousBackup)
@@ -2210,7 +3946,7 @@ static void UI_BackedUpFiles()
 									ImGui::SameLine();
 									if (ImGui::Button("Diff Current"))
 									{
-										LaunchDiffTool(g_settings.diffToolPath, backupPath, selectedEntry.originalPath);
+										LaunchDiffTool(g_settings.diffToolPath, backupPath, std::wstring(GetPath(selectedEntry.originalPathId)));
 									}
 								}
 
@@ -2258,27 +3994,27 @@ static void UI_BackedUpFiles()
 
 										if (ImGui::MenuItem("Open"))
 										{
-											OpenFileWithShell(backupPath);
+											OpenFileWithShell(ResolveBackupPathForRead(backupPath));
 										}
 
 										if (backupIndex > 0)
 										{
 											if (ImGui::MenuItem("Diff Previous"))
 											{
-												const TimePoint& previousTimePoint = selectedEntry.backups[backupIndex - 1];
-												std::wstring previousBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, selectedEntry.originalPath, previousTimePoint);
+												const TimePoint& previousTimePoint = selectedEntry.backups[backupIndex - 1].timePoint;
+												std::wstring previousBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, GetPath(selectedEntry.originalPathId), previousTimePoint);
 												LaunchDiffTool(g_settings.diffToolPath, previousBackupPath, backupPath);
 											}
 										}
 
 										if (ImGui::MenuItem("Diff Current"))
 										{
-											LaunchDiffTool(g_settings.diffToolPath, backupPath, selectedEntry.originalPath);
+											LaunchDiffTool(g_settings.diffToolPath, backupPath, std::wstring(GetPath(selectedEntry.originalPathId)));
 										}
 
 										if (ImGui::MenuItem("Show in Explorer"))
 										{
-											OpenExplorerSelectPath(backupPath);
+											ShowBackupInExplorer(backupPath);
 										}
 
 										ImGui::EndPopup();
@@ -2304,38 +4040,39 @@ static void UI_BackedUpFiles()
 		if (selectedBackupPath.empty())
 			selectedBackupPath = latestBackupPath;
 
-		if (currentSelectionItr != g_backupIndex.end())
+		bool hasPrevious = false;
+		std::wstring previousBackupPath;
 		{
-			const BackupFile& selectedEntry = *currentSelectionItr;
+			std::shared_lock<std::shared_mutex> indexLock(g_indexMutex);
 
-			if (!selectedEntry.originalPath.empty() && !selectedBackupPath.empty())
+			const BackupFile* selectedEntry = g_backupIndex.Get(currentSelection);
+			if (selectedEntry && selectedEntry->originalPathId != kInvalidPathId && !selectedBackupPath.empty())
 			{
-				bool hasPrevious = false;
-				std::wstring previousBackupPath;
-				for (size_t i = 0; i < selectedEntry.backups.size(); ++i)
+				for (size_t i = 0; i < selectedEntry->backups.size(); ++i)
 				{
-					if (MakeBackupPathFromTimePoint(g_settings.backupRoot, selectedEntry.originalPath, selectedEntry.backups[i]) == selectedBackupPath)
+					if (MakeBackupPathFromTimePoint(g_settings.backupRoot, GetPath(selectedEntry->originalPathId), selectedEntry->backups[i].timePoint) == selectedBackupPath)
 					{
 						if (i > 0)
 						{
 							hasPrevious = true;
-							previousBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, selectedEntry.originalPath, selectedEntry.backups[i - 1]);
+							previousBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, GetPath(selectedEntry->originalPathId), selectedEntry->backups[i - 1].timePoint);
 						}
 						break;
 					}
 				}
-
-				if (hasPrevious)
-				{
-					LaunchDiffTool(g_settings.diffToolPath, previousBackupPath, selectedBackupPath);
-				}
 			}
 		}
+
+		if (hasPrevious)
+		{
+			LaunchDiffTool(g_settings.diffToolPath, previousBackupPath, selectedBackupPath);
+		}
 	}
 
 	if (refreshRequested)
 	{
-		ScanBackupFolder();
+		// An explicit refresh doesn't trust the index file
+		ScanBackupFolder(false);
 
 		if (lastSortColumn >= 0)
 		{
@@ -2350,11 +4087,13 @@ static void UI_BackedUpFiles()
 
 		if (!selectedOriginalPaths.empty())
 		{
-			for (auto entryItr = g_backupIndex.begin(); entryItr != g_backupIndex.end(); ++entryItr)
+			std::shared_lock<std::shared_mutex> indexLock(g_indexMutex);
+
+			for (PathId selectedPathId : selectedOriginalPaths)
 			{
-				if (selectedOriginalPaths.count(entryItr->originalPath))
+				if (const BackupFile* entry = g_backupIndex.Find(selectedPathId))
 				{
-					pendingDeleteBackupCount += (*entryItr).backups.size(); 
+					pendingDeleteBackupCount += entry->backups.size();
 				}
 			}
 
@@ -2380,9 +4119,9 @@ static void UI_BackedUpFiles()
 
 		if (ImGui::BeginChild("delete_list", ImVec2(720.0f, 220.0f), true))
 		{
-			for (const auto& path : selectedOriginalPaths)
+			for (PathId selectedPathId : selectedOriginalPaths)
 			{
-				std::wstring wildcardPath = MakeBackupWildcardPath(g_settings.backupRoot, path);
+				std::wstring wildcardPath = MakeBackupWildcardPath(g_settings.backupRoot, GetPath(selectedPathId));
 
 				ImGui::TextUnformatted(WToUTF8(wildcardPath).c_str());
 			}
@@ -2393,30 +4132,36 @@ static void UI_BackedUpFiles()
 		{
 			std::unique_lock<std::shared_mutex> indexLock(g_indexMutex);
 
-			for (auto entryItr = g_backupIndex.begin(); entryItr != g_backupIndex.end(); )
+			std::vector<BackupEntryHandle> removedHandles;
+
+			for (PathId selectedPathId : selectedOriginalPaths)
 			{
-				if (selectedOriginalPaths.count(entryItr->originalPath))
-				{
-					for (const TimePoint& timePoint : entryItr->backups)
-					{
-						std::wstring backupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, (*entryItr).originalPath, timePoint);
-						std::error_code errorCode;
-						std::fs::remove(backupPath, errorCode);
-						RemoveFromFilteredEntries((*entryItr).originalPath, timePoint);
-					}
+				BackupEntryHandle entryHandle = g_backupIndex.FindHandle(selectedPathId);
+				const BackupFile* entry = g_backupIndex.Get(entryHandle);
 
-					entryItr = g_backupIndex.erase(entryItr);
+				if (!entry)
+				{
+					continue;
 				}
-				else
+
+				for (const BackupVersion& backupVersion : entry->backups)
 				{
-					++entryItr;
+					// Every version of the file goes, so no delta needs rebasing
+					RemoveBackupVersion(g_settings.backupRoot, entry->originalPathId, backupVersion, nullptr);
+					RemoveFromFilteredEntries(entry->originalPathId, backupVersion.timePoint);
 				}
+
+				JournalOriginalRemoved(entry->originalPathId);
+				removedHandles.push_back(entryHandle);
 			}
 
+			g_backupIndex.Remove(removedHandles);
+			indexLock.unlock();
+
 			pendingDeleteBackupCount = 0;
 			selectedBackupPath.clear();
 			selectedOriginalPaths.clear();
-			currentSelectionItr = g_backupIndex.end();
+			currentSelection = kInvalidBackupEntry;
 			lastClickIndex = -1;
 			rangeSelectMinIndex = -1;
 			rangeSelectMaxIndex = -1;
@@ -2560,7 +4305,7 @@ static void UI_History()
 
 				ImGui::TableNextColumn();
 				{
-					std::string originalUtf8 = WToUTF8(backupOperation.originalPath);
+					std::string originalUtf8 = WToUTF8(std::wstring(GetPath(backupOperation.originalPathId)));
 
 					ImGui::TextClickable("%s", originalUtf8.c_str());
 					if (ImGui::IsItemHovered())
@@ -2571,9 +4316,9 @@ static void UI_History()
 					if (!g_modalWindowShowing && ImGui::IsItemHovered() && ImGui::IsMouseDoubleClicked(ImGuiMouseButton_Left))
 					{
 						selectedOperationIndex = operationIndex;
-						if (!backupOperation.originalPath.empty())
+						if (backupOperation.originalPathId != kInvalidPathId)
 						{
-							OpenFileWithShell(backupOperation.originalPath);
+							OpenFileWithShell(std::wstring(GetPath(backupOperation.originalPathId)));
 						}
 					}
 
@@ -2582,7 +4327,7 @@ static void UI_History()
 						if (ImGui::MenuItem("Show in Explorer"))
 						{
 							selectedOperationIndex = operationIndex;
-							OpenExplorerSelectPath(backupOperation.originalPath);
+							OpenExplorerSelectPath(std::wstring(GetPath(backupOperation.originalPathId)));
 						}
 						ImGui::EndPopup();
 					}
@@ -2594,30 +4339,22 @@ static void UI_History()
 
 				ImGui::TableNextColumn();
 				{
-					std::wstring backupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, backupOperation.originalPath, backupOperation.timePoint);
+					std::wstring backupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, GetPath(backupOperation.originalPathId), backupOperation.timePoint);
 					bool hasPrevious = false;
 					std::wstring previousBackupPath;
 					{
 						std::shared_lock<std::shared_mutex> indexLock(g_indexMutex);
-						auto entryItr = g_backupIndex.end();
-						for (entryItr = g_backupIndex.begin(); entryItr != g_backupIndex.end(); ++entryItr)
+						if (const BackupFile* entry = g_backupIndex.Find(backupOperation.originalPathId))
 						{
-							if (entryItr->originalPath == backupOperation.originalPath)
-							{
-								break;
-							}
-						}
-						if (entryItr != g_backupIndex.end())
-						{
-							const auto& backups = entryItr->backups;
+							const auto& backups = entry->backups;
 							for (size_t i = 0; i < backups.size(); ++i)
 							{
-								if (backups[i] == backupOperation.timePoint)
+								if (backups[i].timePoint == backupOperation.timePoint)
 								{
 									if (i > 0)
 									{
 										hasPrevious = true;
-										previousBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, backupOperation.originalPath, backups[i - 1]);
+										previousBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, GetPath(backupOperation.originalPathId), backups[i - 1].timePoint);
 									}
 									break;
 								}
@@ -2640,13 +4377,13 @@ static void UI_History()
 					ImGui::SameLine();
 					if (ImGui::Button("Diff Current"))
 					{
-						LaunchDiffTool(g_settings.diffToolPath, backupPath, backupOperation.originalPath);
+						LaunchDiffTool(g_settings.diffToolPath, backupPath, std::wstring(GetPath(backupOperation.originalPathId)));
 					}
 
 					ImGui::SameLine();
 					if (ImGui::Button("Show in Explorer"))
 					{
-						OpenExplorerSelectPath(backupPath);
+						ShowBackupInExplorer(backupPath);
 					}
 				}
 
@@ -2745,39 +4482,20 @@ static void UI_History()
 				}
 			}
 
+			std::vector<TakenVersion> takenVersions;
 			{
 				std::unique_lock<std::shared_mutex> indexLock(g_indexMutex);
 				for (const auto& entry : entriesToDelete)
 				{
-					auto entryItr = g_backupIndex.end();
-					for (entryItr = g_backupIndex.begin(); entryItr != g_backupIndex.end(); ++entryItr)
-					{
-						if (entryItr->originalPath == entry.originalPath)
-						{
-							break;
-						}
-					}
-					if (entryItr != g_backupIndex.end())
+					TakenVersion takenVersion = { entry.originalPathId };
+					if (TakeBackupVersion_Locked(entry.originalPathId, entry.timePoint, takenVersion.version, takenVersion.nextVersion))
 					{
-						auto& backups = entryItr->backups;
-						backups.erase(
-							std::remove(backups.begin(), backups.end(), entry.timePoint),
-							backups.end());
+						takenVersions.push_back(std::move(takenVersion));
 					}
 				}
 			}
 
-			for (const auto& entry : entriesToDelete)
-			{
-				std::error_code errorCode;
-				std::wstring backupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, entry.originalPath, entry.timePoint);
-				std::fs::remove(backupPath, errorCode);
-			}
-
-			for (const auto& entry : entriesToDelete)
-			{
-				RemoveFromFilteredEntries(entry.originalPath, entry.timePoint);
-			}
+			RemoveTakenVersions(takenVersions);
 
 			selectedOperationIndices.clear();
 			selectedOperationIndex = -1;
@@ -2798,30 +4516,22 @@ static void UI_History()
 
 	if (isDiffPressed && hasSelectedOperation)
 	{
-		std::wstring selectedBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, selectedOperationCopy.originalPath, selectedOperationCopy.timePoint);
+		std::wstring selectedBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, GetPath(selectedOperationCopy.originalPathId), selectedOperationCopy.timePoint);
 		bool hasPrevious = false;
 		std::wstring previousBackupPath;
 		{
 			std::shared_lock<std::shared_mutex> indexLock(g_indexMutex);
-			auto entryItr = g_backupIndex.end();
-			for (entryItr = g_backupIndex.begin(); entryItr != g_backupIndex.end(); ++entryItr)
-			{
-				if (entryItr->originalPath == selectedOperationCopy.originalPath)
-				{
-					break;
-				}
-			}
-			if (entryItr != g_backupIndex.end())
+			if (const BackupFile* entry = g_backupIndex.Find(selectedOperationCopy.originalPathId))
 			{
-				const auto& backups = entryItr->backups;
+				const auto& backups = entry->backups;
 				for (size_t i = 0; i < backups.size(); ++i)
 				{
-					if (backups[i] == selectedOperationCopy.timePoint)
+					if (backups[i].timePoint == selectedOperationCopy.timePoint)
 					{
 						if (i > 0)
 						{
 							hasPrevious = true;
-							previousBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, selectedOperationCopy.originalPath, backups[i - 1]);
+							previousBackupPath = MakeBackupPathFromTimePoint(g_settings.backupRoot, GetPath(selectedOperationCopy.originalPathId), backups[i - 1].timePoint);
 						}
 						break;
 					}
@@ -2894,7 +4604,7 @@ static void UI_Settings()
 				backupRootUtf8 = WToUTF8(g_settings.backupRoot);
 				MarkSettingsDirty();
 				SaveSettings();
-				ScanBackupFolder();
+				ScanBackupFolder(true);
 			}
 		}
 
@@ -2948,6 +4658,135 @@ static void UI_Settings()
 			MarkSettingsDirty();
 		}
 
+		ImGui::TableNextRow();
+		ImGui::TableNextColumn();
+		ImGui::TextUnformatted("Copy threads");
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Number of threads copying settled files into the backup folder.\nTakes effect on Apply.");
+		ImGui::TableNextColumn();
+		ImGui::SetNextItemWidth(240.0f);
+		int copyWorkerCount = (int)g_settings.copyWorkerCount;
+		if (ImGui::InputInt("##copyWorkers", &copyWorkerCount))
+		{
+			copyWorkerCount = std::clamp(copyWorkerCount, 1, (int)kMaxCopyWorkers);
+			g_settings.copyWorkerCount = (uint32_t)copyWorkerCount;
+			MarkSettingsDirty();
+		}
+
+		ImGui::TableNextRow();
+		ImGui::TableNextColumn();
+		ImGui::TextUnformatted("Copy speed limit (MB/s)");
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Caps how fast backups are written, so a full rebuild rewriting thousands of files doesn't have\n"
+							"to share the disk with them. Up to a second's worth builds up while idle. 0 is unlimited.\n"
+							"Backups also run at background I/O priority. Takes effect on Apply.");
+		ImGui::TableNextColumn();
+		ImGui::SetNextItemWidth(240.0f);
+		int maxCopyMegabytesPerSec = (int)g_settings.maxCopyMegabytesPerSec;
+		if (ImGui::InputInt("##maxCopyMegabytesPerSec", &maxCopyMegabytesPerSec))
+		{
+			g_settings.maxCopyMegabytesPerSec = (uint32_t)(std::max)(maxCopyMegabytesPerSec, 0);
+			MarkSettingsDirty();
+		}
+
+		ImGui::TableNextRow();
+		ImGui::TableNextColumn();
+		ImGui::TextUnformatted("Copy rate limit (files/s)");
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Caps how many files are backed up per second. 0 is unlimited. Takes effect on Apply.");
+		ImGui::TableNextColumn();
+		ImGui::SetNextItemWidth(240.0f);
+		int maxCopyOperationsPerSec = (int)g_settings.maxCopyOperationsPerSec;
+		if (ImGui::InputInt("##maxCopyOperationsPerSec", &maxCopyOperationsPerSec))
+		{
+			g_settings.maxCopyOperationsPerSec = (uint32_t)(std::max)(maxCopyOperationsPerSec, 0);
+			MarkSettingsDirty();
+		}
+
+		ImGui::TableNextRow();
+		ImGui::TableNextColumn();
+		ImGui::TextUnformatted("Max backup latency (seconds)");
+		ImGui::SameLine();
+		ImGui::HelpTooltip("A file that keeps being written and never goes quiet is backed up anyway after this long.\n0 disables the cap. Takes effect on Apply.");
+		ImGui::TableNextColumn();
+		ImGui::SetNextItemWidth(240.0f);
+		int maxLatencySec = (int)g_settings.maxBackupLatencySec;
+		if (ImGui::InputInt("##maxLatency", &maxLatencySec))
+		{
+			if (maxLatencySec < 0)
+			{
+				maxLatencySec = 0;
+			}
+			g_settings.maxBackupLatencySec = (uint32_t)maxLatencySec;
+			MarkSettingsDirty();
+		}
+
+		ImGui::TableNextRow();
+		ImGui::TableNextColumn();
+		ImGui::TextUnformatted("Deduplicate backups");
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Backups with the same contents share one stored copy (kept in the .objects folder of the backup root).\n"
+							"Shared versions are hard links, so editing a backup file in place changes every version sharing it.");
+		ImGui::TableNextColumn();
+		if (ImGui::Checkbox("##deduplicate", &g_settings.deduplicateBackups))
+		{
+			MarkSettingsDirty();
+		}
+
+		ImGui::TableNextRow();
+		ImGui::TableNextColumn();
+		ImGui::TextUnformatted("Store large files as deltas");
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Versions of files over 1 MB are stored as the changes against the previous version, with a full copy every 16 versions.\n"
+							"Opening or diffing such a version rebuilds it into the temp folder first.");
+		ImGui::TableNextColumn();
+		if (ImGui::Checkbox("##deltaBackups", &g_settings.deltaBackups))
+		{
+			MarkSettingsDirty();
+		}
+
+		ImGui::TableNextRow();
+		ImGui::TableNextColumn();
+		ImGui::TextUnformatted("Compress backups");
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Versions are stored LZ4 compressed (as .lscz files), so the size limit holds more history.\n"
+							"Images, archives and other already compressed formats are stored as they are.\n"
+							"Opening or diffing a compressed version decompresses it into the temp folder first.");
+		ImGui::TableNextColumn();
+		if (ImGui::Checkbox("##compressBackups", &g_settings.compressBackups))
+		{
+			MarkSettingsDirty();
+		}
+
+		ImGui::TableNextRow();
+		ImGui::TableNextColumn();
+		ImGui::TextUnformatted("Pack small files");
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Versions of files up to 64 KB are appended to a few large segment files (in the .packs folder)\n"
+							"instead of each getting a file of its own, which keeps the backup folder small and fast to scan.\n"
+							"Space of deleted versions is given back once half of a segment is unused.");
+		ImGui::TableNextColumn();
+		if (ImGui::Checkbox("##packSmallBackups", &g_settings.packSmallBackups))
+		{
+			MarkSettingsDirty();
+		}
+
+		ImGui::TableNextRow();
+		ImGui::TableNextColumn();
+		ImGui::TextUnformatted("Flush backups to disk");
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Off: backups are left in the OS write cache, a power loss can leave the latest ones empty or missing.\n"
+							"Batched: backups finishing within a few milliseconds of each other are flushed together, each folder once.\n"
+							"Every backup: each backup is flushed on its own, the safest and slowest.");
+		ImGui::TableNextColumn();
+		ImGui::SetNextItemWidth(240.0f);
+		int durabilityIndex = (int)g_settings.durability;
+		if (ImGui::Combo("##durability", &durabilityIndex, "Off\0Batched\0Every backup\0"))
+		{
+			g_settings.durability = (BackupDurability)durabilityIndex;
+			MarkSettingsDirty();
+		}
+
 		ImGui::TableNextRow();
 		ImGui::TableNextColumn();
 		ImGui::TextUnformatted("Pause duration (minutes)");
@@ -3014,9 +4853,143 @@ static void UI_Settings()
 		{
 			MarkSettingsDirty();
 			SaveSettings();
-			ScanBackupFolder();
+			ScanBackupFolder(true);
 			EnforceGlobalSizeLimit(std::fs::path(g_settings.backupRoot), g_settings.maxBackupSizeMB);
+			StartWatchersFromSettings();
+		}
+
+		ImGui::Dummy(ImVec2(0,4));
+		ImGui::Separator();
+		ImGui::Dummy(ImVec2(0,4));
+
+		BackupPipelineStats pipelineStats = GetBackupPipelineStats();
+
+		ImGui::TextUnformatted("Backup queue");
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Settled changes waiting for a copy thread.\nRejected pushes happen when the queue is full; those files are retried shortly.");
+		ImGui::Text("Copy threads busy: %u / %u", pipelineStats.busyCopyThreads, pipelineStats.copyThreads);
+		ImGui::Text("Depth: %zu / %zu  (high water %zu)", pipelineStats.depth, pipelineStats.capacity, pipelineStats.highWater);
+		ImGui::Text("Queued: %llu  Completed: %llu  Rejected: %llu", (unsigned long long)pipelineStats.pushed, (unsigned long long)pipelineStats.completed, (unsigned long long)pipelineStats.rejected);
+		ImGui::Text("Overflow rescans: %llu  (files queued %llu)", (unsigned long long)pipelineStats.reconcilePasses, (unsigned long long)pipelineStats.reconcileQueued);
+		ImGui::Text("Catch-up scan: %s  (files scanned %llu, queued %llu)", pipelineStats.catchUpRunning ? "running" : "done", (unsigned long long)pipelineStats.catchUpScanned, (unsigned long long)pipelineStats.catchUpQueued);
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Runs whenever watching starts and backs up files changed while the app wasn't running.\nA newly added folder gets a backup of every file that doesn't have one yet.");
+
+		ImGui::Dummy(ImVec2(0,4));
+		ImGui::TextUnformatted("Quiet windows");
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Each file waits for its own quiet window before it is backed up, learned from how it is usually written.\nForced backups hit the max latency while the file was still being written.");
+		ImGui::Text("Settled: %llu  Forced: %llu  Average window: %u ms", (unsigned long long)pipelineStats.settledBackups, (unsigned long long)pipelineStats.forcedBackups, pipelineStats.averageQuietWindowMs);
+
+		std::string histogramText;
+		for (size_t bucketIndex = 0; bucketIndex < kQuietWindowBucketCount; ++bucketIndex)
+		{
+			histogramText += fmt::format("<={}ms: {}  ", kQuietWindowBucketLimits[bucketIndex], pipelineStats.quietWindowHistogram[bucketIndex]);
+		}
+		ImGui::TextUnformatted(histogramText.c_str());
+		ImGui::Text("Temp files skipped: %llu", (unsigned long long)pipelineStats.collapsedTempFiles);
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Files deleted or renamed away before they settled, e.g. the temp file of an editor's atomic save.");
+		ImGui::Text("Unchanged copies skipped: %llu", (unsigned long long)pipelineStats.skippedUnchanged);
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Files that were saved or touched without their contents changing since the latest backup.");
+
+		ImGui::Text("Copies retried: %llu  Possibly torn: %llu", (unsigned long long)pipelineStats.copyRetries, (unsigned long long)pipelineStats.tornBackups);
+		ImGui::SameLine();
+		ImGui::HelpTooltip("A copy is retried when the file changed while it was being copied.\nIf it keeps changing the last copy is kept and marked as possibly torn in the backup list.");
+
+		if (g_settings.deduplicateBackups)
+		{
+			ImGui::Text("Deduplicated backups: %llu (%.1f MB saved)", (unsigned long long)pipelineStats.dedupedBackups, (double)pipelineStats.dedupedBytes / (1024.0 * 1024.0));
+			ImGui::SameLine();
+			ImGui::HelpTooltip("Backups whose contents were already stored, kept as hard links to the stored copy instead of a copy of their own.");
+		}
+
+		if (g_settings.deltaBackups)
+		{
+			ImGui::Text("Delta backups: %llu (%.1f MB saved)", (unsigned long long)pipelineStats.deltaBackups, (double)pipelineStats.deltaBytesSaved / (1024.0 * 1024.0));
+			ImGui::SameLine();
+			ImGui::HelpTooltip("Versions of large files stored as the changes against the version before them.");
+		}
+
+		if (g_settings.compressBackups)
+		{
+			ImGui::Text("Compressed backups: %llu (%.1f MB saved)", (unsigned long long)pipelineStats.compressedBackups, (double)pipelineStats.compressionBytesSaved / (1024.0 * 1024.0));
+			ImGui::SameLine();
+			ImGui::HelpTooltip("Versions stored LZ4 compressed. Already compressed formats (images, archives, media) are stored as they are.");
+		}
+
+		if (g_settings.packSmallBackups)
+		{
+			ImGui::Text("Packed backups: %llu", (unsigned long long)pipelineStats.packedBackups);
+			ImGui::SameLine();
+			ImGui::HelpTooltip("Versions of small files appended to the pack segments in the .packs folder.");
+		}
+
+		uint64_t copyStrategyCounts[(size_t)CopyStrategy::Count] = {};
+		GetCopyStrategyCounts(copyStrategyCounts);
+
+		std::string copyStrategyText = fmt::format("Content hash: {}  Copies by strategy:", GetContentHashImplementationName());
+		for (size_t strategyIndex = 0; strategyIndex < (size_t)CopyStrategy::Count; ++strategyIndex)
+		{
+			if (copyStrategyCounts[strategyIndex] > 0)
+			{
+				copyStrategyText += fmt::format("  {}: {}", GetCopyStrategyName((CopyStrategy)strategyIndex), copyStrategyCounts[strategyIndex]);
+			}
+		}
+		ImGui::TextUnformatted(copyStrategyText.c_str());
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Backups on the same block cloning volume (ReFS) only cost metadata.\nStrategies that fail between two volumes aren't tried again for that pair.");
+
+		if (g_settings.durability != BackupDurability::None)
+		{
+			uint64_t committedWrites = 0;
+			uint64_t flushes = 0;
+			GetDurabilityCounts(committedWrites, flushes);
+
+			ImGui::Text("Flushed to disk: %llu backups in %llu batches", (unsigned long long)committedWrites, (unsigned long long)flushes);
+			ImGui::SameLine();
+			ImGui::HelpTooltip("In batched mode, backups finishing close together are flushed as one batch, each folder once.");
+		}
+
+		if (g_settings.maxCopyMegabytesPerSec > 0 || g_settings.maxCopyOperationsPerSec > 0)
+		{
+			ImGui::Text("Held back by the copy limits: %.1f s", (double)GetBackupThrottledMs() / 1000.0);
+			ImGui::SameLine();
+			ImGui::HelpTooltip("Total time copies have waited on the speed and rate limits.");
+		}
+
+		uint32_t pathCount = 0;
+		uint64_t pathArenaBytes = 0;
+		GetPathPoolUsage(pathCount, pathArenaBytes);
+
+		uint64_t journalRecords = 0;
+		uint64_t indexCheckpoints = 0;
+		GetIndexJournalCounts(journalRecords, indexCheckpoints);
+
+		ImGui::Text("Index: %s in %llu ms", g_isIndexLoadedFromFile ? "loaded from the index file" : "rebuilt by walking the backup folder", (unsigned long long)g_indexLoadMs);
+		ImGui::SameLine();
+		ImGui::HelpTooltip("The index is kept in .lsc\\index.bin under the backup folder, so startup doesn't walk the folder.\nRefresh (F5) always walks it.");
+
+		ImGui::Text("Index journal: %llu changes since the index file was written, %llu index files written", (unsigned long long)journalRecords, (unsigned long long)indexCheckpoints);
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Changes to the index are appended to .lsc\\index.journal and replayed on top of the index file at startup.\nOnce the journal grows large it is folded into a new index file in the background.");
+
+		ImGui::Text("Paths held: %u (%.1f MB)", pathCount, (double)pathArenaBytes / (1024.0 * 1024.0));
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Every original path is stored once, with its lowercase form, and shared by the index, the history and the lists.");
+
+		uint64_t backupRootMeasuredTicks = g_backupRootMeasuredTicks.load();
+		if (backupRootMeasuredTicks != 0)
+		{
+			ImGui::Text("Backup folder: %.1f MB, measured %llu min ago (last correction %+.1f MB)", (double)g_backupRootBytes.load() / (1024.0 * 1024.0), (unsigned long long)((GetTickCount64() - backupRootMeasuredTicks) / 60000), (double)g_backupRootDriftBytes.load() / (1024.0 * 1024.0));
 		}
+		else
+		{
+			ImGui::Text("Backup folder: %.1f MB, estimated from the index", (double)g_backupRootBytes.load() / (1024.0 * 1024.0));
+		}
+		ImGui::SameLine();
+		ImGui::HelpTooltip("Kept up to date from the size of each backup stored and each one removed, so the size limit is checked without walking the backup folder.\nThe folder is walked in the background shortly after a scan and then hourly, to correct whatever the running total missed.");
 	}
 }
 
@@ -3036,14 +5009,28 @@ void AppInit()
 	g_historyDateFilter.mode = DateFilterMode::Today;
 	SetRelativeDayFilterRange(g_historyDateFilter, tmv, 0);
 
-	ScanBackupFolder();
+	// Delta versions rebuilt for the diff tool or an editor in the last run
+	ClearMaterializedBackups();
+
+	ScanBackupFolder(true);
+
+	// Changes accepted but not backed up before the last exit or crash are replayed by the watcher
+	OpenPendingJournal(std::fs::path(AppDataFilePath(L"pending.journal")), g_replayPendingPaths);
+
 	StartWatchersFromSettings();
 }
 
 bool AppLoop()
 {
+	ApplyCompletedCatchUpScans();
 	MaybeSaveSettingsThrottled();
 
+	// The index file loaded at startup turned out not to match its checksum
+	if (PollBackupIndexFileCorrupt())
+	{
+		ScanBackupFolder(false);
+	}
+
 	static uint64_t lastTodayPrefixCheck = 0;
 	if ((GetTickCount64() - lastTodayPrefixCheck) >= 10000)
 	{
@@ -3057,7 +5044,10 @@ bool AppLoop()
 		if (g_todayPrefix != todayPrefix)
 		{
 			g_todayPrefix = todayPrefix;
-			ScanBackupFolder();
+
+			std::shared_lock<std::shared_mutex> lock(g_indexMutex);
+			g_backupsToday = CountBackupsToday_Locked();
+			TrayUpdateStatus(g_backupsToday, g_isPaused.load(std::memory_order_relaxed));
 		}
 
 		lastTodayPrefixCheck = GetTickCount64();
@@ -3268,4 +5258,10 @@ bool AppDraw()
 void AppShutdown()
 {
 	StopWatchers();
+	StopBackupRootReconcile();
+	ClosePendingJournal();
+
+	// Nothing changes the index once the watchers are stopped, whatever it still buffers is the last of it
+	CloseIndexJournal();
+	CloseBackupIndexFile();
 }
@@ -1,6 +1,7 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#if defined(_WIN32)
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -13,18 +14,23 @@
 #include <shlwapi.h>
 #include <shellapi.h>
 #include <objbase.h>
+#endif
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <filesystem>
+#include <functional>
 #include <fstream>
 #include <limits>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <map>
 #include <set>
@@ -55,6 +61,9 @@ struct WatchedFolder
 	bool			includeSubfolders = true;
 	std::wstring	includeFiltersCSV;
 	std::wstring	excludeFiltersCSV;
+
+	// Start of the last completed catch-up scan, zero until the folder has had its baseline scan
+	std::fs::file_time_type	lastScanTime = {};
 };
 
 #endif // MAIN_H
@@ -0,0 +1,283 @@
+#include "main.h"
+#include "objectstore.h"
+#include "contenthash.h"
+
+#include <cstring>
+#include <fstream>
+
+static constexpr size_t kCompareChunkSize = 256 * 1024;
+
+static std::fs::path MakeObjectPath(const std::fs::path& backupRootPath, uint64_t contentHash, uint64_t contentSize)
+{
+	// Fan out on the first byte of the hash so no single folder ends up with every blob
+	std::wstring name = fmt::format(L"{:016x}_{}", contentHash, contentSize);
+	return backupRootPath / kObjectStoreFolderName / name.substr(0, 2) / name;
+}
+
+static bool FilesHaveSameBytes(const std::fs::path& pathA, const std::fs::path& pathB)
+{
+	std::ifstream streamA(pathA, std::ios::binary);
+	std::ifstream streamB(pathB, std::ios::binary);
+
+	if (!streamA.is_open() || !streamB.is_open())
+	{
+		return false;
+	}
+
+	std::vector<char> chunkA(kCompareChunkSize);
+	std::vector<char> chunkB(kCompareChunkSize);
+
+	while (streamA && streamB)
+	{
+		streamA.read(chunkA.data(), (std::streamsize)chunkA.size());
+		streamB.read(chunkB.data(), (std::streamsize)chunkB.size());
+
+		std::streamsize bytesReadA = streamA.gcount();
+		std::streamsize bytesReadB = streamB.gcount();
+
+		if (bytesReadA != bytesReadB || memcmp(chunkA.data(), chunkB.data(), (size_t)bytesReadA) != 0)
+		{
+			return false;
+		}
+	}
+
+	return !streamA.bad() && !streamB.bad() && streamA.eof() && streamB.eof();
+}
+
+// Every version linked to a blob is the same file, written through any of them it would change them all
+// (and no longer match the hash in its name). Editors and diff tools get a read-only file instead.
+static void MakeObjectReadOnly(const std::fs::path& objectPath)
+{
+	std::error_code errorCode;
+	std::fs::permissions(objectPath, std::fs::perms::owner_write | std::fs::perms::group_write | std::fs::perms::others_write, std::fs::perm_options::remove, errorCode);
+}
+
+bool LinkBackupIntoObjectStore(const std::fs::path& backupRootPath, const std::fs::path& backupPath, uint64_t contentHash, uint64_t contentSize)
+{
+	std::error_code errorCode;
+	std::fs::path objectPath = MakeObjectPath(backupRootPath, contentHash, contentSize);
+
+	if (!std::fs::exists(objectPath, errorCode))
+	{
+		// First time this content is seen: the backup itself becomes the blob
+		std::fs::create_directories(objectPath.parent_path(), errorCode);
+		std::fs::create_hard_link(backupPath, objectPath, errorCode);
+
+		if (!errorCode)
+		{
+			MakeObjectReadOnly(objectPath);
+		}
+		return false;
+	}
+
+	if (!FilesHaveSameBytes(backupPath, objectPath))
+	{
+		return false;
+	}
+
+	// Link under a temporary name and rename it over the copy, so the backup path never goes missing
+	std::fs::path linkPath = backupPath;
+	linkPath += L".link";
+
+	std::fs::remove(linkPath, errorCode);
+	std::fs::create_hard_link(objectPath, linkPath, errorCode);
+
+	if (errorCode)
+	{
+		// Out of links on this blob (or the volume has no hard links): the private copy stays
+		return false;
+	}
+
+	std::fs::rename(linkPath, backupPath, errorCode);
+
+	if (errorCode)
+	{
+		std::fs::remove(linkPath, errorCode);
+		return false;
+	}
+
+	// Blobs made before they were kept read-only
+	MakeObjectReadOnly(objectPath);
+	return true;
+}
+
+uint64_t RemoveBackupFile(const std::fs::path& backupRootPath, const std::fs::path& backupPath, const uint64_t* contentHash)
+{
+	std::error_code errorCode;
+	uint64_t fileSize = std::fs::file_size(backupPath, errorCode);
+
+	if (errorCode)
+	{
+		return 0;
+	}
+
+	uintmax_t linkCount = std::fs::hard_link_count(backupPath, errorCode);
+
+	if (errorCode || linkCount <= 1)
+	{
+		std::fs::remove(backupPath, errorCode);
+		return errorCode ? 0 : fileSize;
+	}
+
+	if (linkCount > 2)
+	{
+		// Other versions still link to the blob
+		std::fs::remove(backupPath, errorCode);
+		return 0;
+	}
+
+	// Only the blob is left besides this version, so it goes too
+	uint64_t hash = 0;
+
+	if (contentHash)
+	{
+		hash = *contentHash;
+	}
+	else if (!HashFileContents(backupPath, hash))
+	{
+		std::fs::remove(backupPath, errorCode);
+		return 0;
+	}
+
+	std::fs::remove(backupPath, errorCode);
+
+	if (errorCode)
+	{
+		return 0;
+	}
+
+	std::fs::path objectPath = MakeObjectPath(backupRootPath, hash, fileSize);
+
+	if (std::fs::hard_link_count(objectPath, errorCode) == 1 && !errorCode && std::fs::remove(objectPath, errorCode))
+	{
+		return fileSize;
+	}
+
+	// Linked from outside the object store (or the blob is already gone); RemoveOrphanedObjects
+	// catches any blob left behind
+	return 0;
+}
+
+bool ComputePhysicalBackupBytes(const std::fs::path& backupRootPath, const std::atomic<bool>& cancelRequested, uint64_t& outBytes)
+{
+	std::error_code errorCode;
+	uint64_t total = 0;
+	outBytes = 0;
+
+	std::fs::path objectStorePath = backupRootPath / kObjectStoreFolderName;
+
+	// A walk cut short by an error would pass a partial total off as the measured one
+	for (std::fs::recursive_directory_iterator iterator(backupRootPath, std::fs::directory_options::skip_permission_denied, errorCode), end; ; iterator.increment(errorCode))
+	{
+		if (errorCode || cancelRequested.load(std::memory_order_relaxed))
+		{
+			return false;
+		}
+
+		if (iterator == end)
+		{
+			break;
+		}
+
+		if (iterator->is_directory(errorCode))
+		{
+			if (iterator->path() == objectStorePath)
+			{
+				iterator.disable_recursion_pending();
+			}
+			continue;
+		}
+
+		if (!iterator->is_regular_file(errorCode))
+		{
+			continue;
+		}
+
+		// Files sharing a blob are counted once, through the blob below
+		uintmax_t linkCount = std::fs::hard_link_count(iterator->path(), errorCode);
+		uint64_t fileSize = linkCount <= 1 && !errorCode ? iterator->file_size(errorCode) : 0;
+
+		if (errorCode)
+		{
+			return false;
+		}
+
+		total += fileSize;
+	}
+
+	// No object store at all is fine, nothing was ever deduplicated
+	if (!std::fs::exists(objectStorePath, errorCode))
+	{
+		outBytes = total;
+		return !errorCode;
+	}
+
+	// Orphaned blobs are counted too, they take space until RemoveOrphanedObjects runs
+	for (std::fs::recursive_directory_iterator iterator(objectStorePath, std::fs::directory_options::skip_permission_denied, errorCode), end; ; iterator.increment(errorCode))
+	{
+		if (errorCode || cancelRequested.load(std::memory_order_relaxed))
+		{
+			return false;
+		}
+
+		if (iterator == end)
+		{
+			break;
+		}
+
+		if (iterator->is_regular_file(errorCode))
+		{
+			uint64_t fileSize = iterator->file_size(errorCode);
+
+			if (errorCode)
+			{
+				return false;
+			}
+
+			total += fileSize;
+		}
+	}
+
+	outBytes = total;
+	return true;
+}
+
+uint64_t RemoveOrphanedObjects(const std::fs::path& backupRootPath)
+{
+	std::error_code errorCode;
+	uint64_t freedBytes = 0;
+
+	std::vector<std::fs::path> orphanedObjects;
+
+	for (std::fs::recursive_directory_iterator iterator(backupRootPath / kObjectStoreFolderName, std::fs::directory_options::skip_permission_denied, errorCode), end; iterator != end; iterator.increment(errorCode))
+	{
+		if (errorCode)
+		{
+			break;
+		}
+
+		// No version links to this blob any more
+		if (iterator->is_regular_file(errorCode) && std::fs::hard_link_count(iterator->path(), errorCode) == 1 && !errorCode)
+		{
+			orphanedObjects.push_back(iterator->path());
+		}
+	}
+
+	for (const std::fs::path& objectPath : orphanedObjects)
+	{
+		// A backup may have been linked to it since, it is no orphan then
+		if (std::fs::hard_link_count(objectPath, errorCode) != 1 || errorCode)
+		{
+			continue;
+		}
+
+		uint64_t objectSize = std::fs::file_size(objectPath, errorCode);
+
+		if (!errorCode && std::fs::remove(objectPath, errorCode))
+		{
+			freedBytes += objectSize;
+		}
+	}
+
+	return freedBytes;
+}
@@ -0,0 +1,29 @@
+#ifndef OBJECTSTORE_H
+#define OBJECTSTORE_H
+
+// Content addressed store under <backup root>\.objects. Each distinct content is kept once as a blob
+// named <hash>_<size>; backup versions with that content are hard links to it, so every version keeps
+// its normal path in the backup layout while sharing the bytes on disk. A blob's link count is its
+// reference count: it is deleted once no version links to it any more.
+
+static constexpr const wchar_t* kObjectStoreFolderName = L".objects";
+
+// Replaces the freshly written backup at backupPath by a link to the blob with the same content,
+// or makes it the blob if there is none yet. Blob bytes are compared before linking, so a hash
+// collision can't turn one file's backup into another's. Returns true if an existing blob was reused.
+bool		LinkBackupIntoObjectStore(const std::fs::path& backupRootPath, const std::fs::path& backupPath, uint64_t contentHash, uint64_t contentSize);
+
+// Deletes one backup version and returns the bytes this actually freed on disk: nothing while other
+// versions still share its blob, the blob's size when this was the last of them. contentHash may be
+// null when it isn't known, the file is hashed to find its blob then.
+uint64_t	RemoveBackupFile(const std::fs::path& backupRootPath, const std::fs::path& backupPath, const uint64_t* contentHash);
+
+// Bytes used on disk by the backup root, counting shared content once. Only reads the folder. Returns
+// false, leaving outBytes partial, when cancelRequested cut the walk short.
+bool		ComputePhysicalBackupBytes(const std::fs::path& backupRootPath, const std::atomic<bool>& cancelRequested, uint64_t& outBytes);
+
+// Deletes the blobs no version links to any more and returns the bytes freed. Maintenance, run before
+// the backup root is measured.
+uint64_t	RemoveOrphanedObjects(const std::fs::path& backupRootPath);
+
+#endif // OBJECTSTORE_H
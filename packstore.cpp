@@ -0,0 +1,774 @@
+#include "main.h"
+#include "packstore.h"
+#include "contenthash.h"
+#include "settings.h"
+#include "durability.h"
+
+#include <cstring>
+#include <fstream>
+
+static constexpr uint64_t	kPackSegmentSize = 64ull * 1024 * 1024;
+static constexpr uint32_t	kPackFormatVersion = 1;
+static constexpr char		kPackMagic[8] = { 'L', 'S', 'C', 'P', 'A', 'C', 'K', '1' };
+static constexpr uint32_t	kPackRecordMagic = 0x4b525350;	// "PSRK"
+static constexpr const wchar_t* kPackSegmentExtension = L".lscpack";
+
+enum PackRecordType : uint32_t
+{
+	PackRecord_Version = 1,
+	PackRecord_Tombstone = 2,	// Marks the record at (targetSegmentId, targetOffset) dead
+};
+
+struct PackSegmentHeader
+{
+	char		magic[8];
+	uint32_t	formatVersion;
+	uint32_t	reserved;
+};
+
+struct PackRecordHeader
+{
+	uint32_t	magic;
+	uint32_t	type;
+	uint32_t	keySize;			// UTF-8 key (the backup path relative to the root) follows the header
+	uint32_t	targetSegmentId;
+	uint64_t	targetOffset;
+	uint64_t	dataSize;			// Version bytes follow the key
+	uint64_t	contentHash;
+	int64_t		lastWriteTimeTicks;
+};
+
+struct PackedVersion
+{
+	uint32_t	segmentId = 0;
+	uint64_t	recordOffset = 0;
+	uint64_t	recordSize = 0;
+	uint64_t	dataSize = 0;
+	uint64_t	contentHash = 0;
+	int64_t		lastWriteTimeTicks = 0;
+};
+
+struct PackTombstone
+{
+	uint32_t	targetSegmentId = 0;
+	uint64_t	targetOffset = 0;
+};
+
+struct PackSegment
+{
+	std::fs::path				path;
+	uint64_t					fileSize = 0;
+	uint64_t					deadBytes = 0;
+	std::vector<PackTombstone>	tombstones;		// Kept so compaction can carry the ones still needed
+};
+
+struct PackStore
+{
+	std::mutex							mutex;
+	std::mutex							compactionMutex;	// Held for a whole compaction, outside mutex
+	uint64_t							openCount = 0;		// Tells a compaction the store was reopened under it
+	std::fs::path						rootPath;
+	std::fs::path						folderPath;
+	std::map<uint32_t, PackSegment>		segments;
+	std::umap<std::string, PackedVersion>	versions;
+
+	uint32_t							activeSegmentId = 0;
+	std::ofstream						activeStream;
+};
+
+static PackStore g_packStore;
+
+static std::fs::path MakeSegmentPath(const std::fs::path& folderPath, uint32_t segmentId)
+{
+	return folderPath / fmt::format(L"segment_{:06d}{}", segmentId, kPackSegmentExtension);
+}
+
+static bool MakePackKey_Locked(const std::fs::path& backupPath, std::string& outKey)
+{
+	if (g_packStore.rootPath.empty())
+	{
+		return false;
+	}
+
+	std::fs::path relativePath = backupPath.lexically_relative(g_packStore.rootPath);
+	if (relativePath.empty())
+	{
+		return false;
+	}
+
+	outKey = relativePath.generic_u8string();
+	return true;
+}
+
+static uint64_t RecordSize(const PackRecordHeader& header)
+{
+	return sizeof(PackRecordHeader) + header.keySize + header.dataSize;
+}
+
+static bool OpenActiveSegment_Locked(uint32_t segmentId)
+{
+	g_packStore.activeStream.close();
+
+	PackSegment& segment = g_packStore.segments[segmentId];
+	segment.path = MakeSegmentPath(g_packStore.folderPath, segmentId);
+
+	std::error_code errorCode;
+	bool isNew = !std::fs::exists(segment.path, errorCode);
+
+	g_packStore.activeStream.open(segment.path, std::ios::binary | std::ios::app);
+	if (!g_packStore.activeStream.is_open())
+	{
+		return false;
+	}
+
+	if (isNew)
+	{
+		PackSegmentHeader header = {};
+		memcpy(header.magic, kPackMagic, sizeof(kPackMagic));
+		header.formatVersion = kPackFormatVersion;
+
+		g_packStore.activeStream.write((const char*)&header, sizeof(header));
+		segment.fileSize = sizeof(header);
+	}
+
+	g_packStore.activeSegmentId = segmentId;
+	return true;
+}
+
+static bool AppendRecord_Locked(const PackRecordHeader& header, const std::string& key, const uint8_t* data, uint64_t& outRecordOffset)
+{
+	uint64_t recordSize = RecordSize(header);
+	auto activeIt = g_packStore.segments.find(g_packStore.activeSegmentId);
+
+	// Seal the active segment once full (or after a failed write) and start the next one
+	if (!g_packStore.activeStream.is_open() || activeIt == g_packStore.segments.end() ||
+		(activeIt->second.fileSize > sizeof(PackSegmentHeader) && activeIt->second.fileSize + recordSize > kPackSegmentSize))
+	{
+		uint32_t nextSegmentId = g_packStore.segments.empty() ? 1 : g_packStore.segments.rbegin()->first + 1;
+
+		if (!OpenActiveSegment_Locked(nextSegmentId))
+		{
+			return false;
+		}
+	}
+
+	PackSegment* activeSegment = &g_packStore.segments[g_packStore.activeSegmentId];
+
+	std::ofstream& stream = g_packStore.activeStream;
+	stream.write((const char*)&header, sizeof(header));
+	stream.write(key.data(), (std::streamsize)key.size());
+
+	if (header.dataSize > 0)
+	{
+		stream.write((const char*)data, (std::streamsize)header.dataSize);
+	}
+
+	stream.flush();
+
+	if (!stream)
+	{
+		// Whatever made it out is a torn record, the next load truncates it
+		stream.close();
+		return false;
+	}
+
+	outRecordOffset = activeSegment->fileSize;
+	activeSegment->fileSize += recordSize;
+	return true;
+}
+
+static bool AppendTombstone_Locked(uint32_t targetSegmentId, uint64_t targetOffset)
+{
+	PackRecordHeader header = {};
+	header.magic = kPackRecordMagic;
+	header.type = PackRecord_Tombstone;
+	header.targetSegmentId = targetSegmentId;
+	header.targetOffset = targetOffset;
+
+	uint64_t recordOffset = 0;
+	if (!AppendRecord_Locked(header, std::string(), nullptr, recordOffset))
+	{
+		return false;
+	}
+
+	// The tombstone is only needed while its target's segment exists, it is dead weight from the start
+	PackSegment& activeSegment = g_packStore.segments[g_packStore.activeSegmentId];
+	activeSegment.deadBytes += sizeof(PackRecordHeader);
+	activeSegment.tombstones.push_back(PackTombstone{ targetSegmentId, targetOffset });
+	return true;
+}
+
+static bool AppendVersion_Locked(const std::string& key, const uint8_t* data, uint64_t dataSize, uint64_t contentHash, int64_t lastWriteTimeTicks)
+{
+	PackRecordHeader header = {};
+	header.magic = kPackRecordMagic;
+	header.type = PackRecord_Version;
+	header.keySize = (uint32_t)key.size();
+	header.dataSize = dataSize;
+	header.contentHash = contentHash;
+	header.lastWriteTimeTicks = lastWriteTimeTicks;
+
+	uint64_t recordOffset = 0;
+	if (!AppendRecord_Locked(header, key, data, recordOffset))
+	{
+		return false;
+	}
+
+	PackedVersion version = {};
+	version.segmentId = g_packStore.activeSegmentId;
+	version.recordOffset = recordOffset;
+	version.recordSize = RecordSize(header);
+	version.dataSize = dataSize;
+	version.contentHash = contentHash;
+	version.lastWriteTimeTicks = lastWriteTimeTicks;
+
+	// A second version under the same key (saved within the same second, or moved by compaction) replaces
+	// the first. The first is tombstoned too, or removing the second would bring it back on the next load.
+	// Should that tombstone not make it out, the later record still wins on load as long as it is live.
+	auto versionIt = g_packStore.versions.find(key);
+	if (versionIt != g_packStore.versions.end())
+	{
+		PackedVersion replacedVersion = versionIt->second;
+		versionIt->second = version;
+
+		g_packStore.segments[replacedVersion.segmentId].deadBytes += replacedVersion.recordSize;
+		AppendTombstone_Locked(replacedVersion.segmentId, replacedVersion.recordOffset);
+	}
+	else
+	{
+		g_packStore.versions.emplace(key, version);
+	}
+
+	return true;
+}
+
+// Needs no lock, only the segment's path
+static bool ReadVersionData(const std::fs::path& segmentPath, const PackedVersion& version, std::vector<uint8_t>& outContents)
+{
+	// Appends are flushed as they happen, so the active segment can be read through a separate stream
+	std::ifstream stream(segmentPath, std::ios::binary);
+	if (!stream.is_open())
+	{
+		return false;
+	}
+
+	PackRecordHeader header = {};
+	stream.seekg((std::streamoff)version.recordOffset);
+	stream.read((char*)&header, sizeof(header));
+
+	if (stream.gcount() != (std::streamsize)sizeof(header) || header.magic != kPackRecordMagic || header.dataSize != version.dataSize)
+	{
+		return false;
+	}
+
+	outContents.resize((size_t)version.dataSize);
+	stream.seekg((std::streamoff)(version.recordOffset + sizeof(header) + header.keySize));
+	stream.read((char*)outContents.data(), (std::streamsize)outContents.size());
+
+	return (uint64_t)stream.gcount() == version.dataSize && HashBytes(outContents.data(), outContents.size()) == version.contentHash;
+}
+
+static bool ReadVersionData_Locked(const PackedVersion& version, std::vector<uint8_t>& outContents)
+{
+	auto segmentIt = g_packStore.segments.find(version.segmentId);
+	return segmentIt != g_packStore.segments.end() && ReadVersionData(segmentIt->second.path, version, outContents);
+}
+
+//-----------------------------------------------------------------------------------------------------
+// Loading
+//-----------------------------------------------------------------------------------------------------
+
+struct LoadedRecord
+{
+	uint32_t		segmentId;
+	std::string		key;
+	PackedVersion	version;
+};
+
+static void LoadSegment_Locked(uint32_t segmentId, const std::fs::path& segmentPath, bool isLast, std::vector<LoadedRecord>& outRecords)
+{
+	PackSegment& segment = g_packStore.segments[segmentId];
+	segment.path = segmentPath;
+
+	std::ifstream stream(segmentPath, std::ios::binary);
+	PackSegmentHeader segmentHeader = {};
+	stream.read((char*)&segmentHeader, sizeof(segmentHeader));
+
+	if (stream.gcount() != (std::streamsize)sizeof(segmentHeader) || memcmp(segmentHeader.magic, kPackMagic, sizeof(kPackMagic)) != 0 || segmentHeader.formatVersion != kPackFormatVersion)
+	{
+		// Not ours (or empty), keep it out of the way of new segments but never write to it
+		segment.fileSize = kPackSegmentSize;
+		return;
+	}
+
+	std::error_code errorCode;
+	uint64_t fileSize = std::fs::file_size(segmentPath, errorCode);
+	uint64_t offset = sizeof(segmentHeader);
+
+	while (offset + sizeof(PackRecordHeader) <= fileSize)
+	{
+		PackRecordHeader header = {};
+		stream.seekg((std::streamoff)offset);
+		stream.read((char*)&header, sizeof(header));
+
+		if (stream.gcount() != (std::streamsize)sizeof(header) || header.magic != kPackRecordMagic || RecordSize(header) > fileSize - offset)
+		{
+			break;
+		}
+
+		if (header.type == PackRecord_Tombstone)
+		{
+			segment.tombstones.push_back(PackTombstone{ header.targetSegmentId, header.targetOffset });
+			segment.deadBytes += sizeof(PackRecordHeader);
+		}
+		else if (header.type == PackRecord_Version)
+		{
+			LoadedRecord record = {};
+			record.segmentId = segmentId;
+			record.key.resize(header.keySize);
+			stream.read(record.key.data(), (std::streamsize)header.keySize);
+
+			record.version.segmentId = segmentId;
+			record.version.recordOffset = offset;
+			record.version.recordSize = RecordSize(header);
+			record.version.dataSize = header.dataSize;
+			record.version.contentHash = header.contentHash;
+			record.version.lastWriteTimeTicks = header.lastWriteTimeTicks;
+
+			outRecords.push_back(std::move(record));
+		}
+		else
+		{
+			break;
+		}
+
+		offset += RecordSize(header);
+	}
+
+	stream.close();
+
+	if (offset < fileSize && isLast)
+	{
+		// A record torn by a crash mid append, cut it off so appends continue from a clean end
+		std::fs::resize_file(segmentPath, offset, errorCode);
+		fileSize = offset;
+	}
+
+	segment.fileSize = fileSize;
+}
+
+void OpenPackStore(const std::fs::path& backupRootPath)
+{
+	std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+	g_packStore.activeStream.close();
+	g_packStore.segments.clear();
+	g_packStore.versions.clear();
+	g_packStore.activeSegmentId = 0;
+	++g_packStore.openCount;
+
+	g_packStore.rootPath = backupRootPath;
+	g_packStore.folderPath = backupRootPath.empty() ? std::fs::path() : backupRootPath / kPackFolderName;
+
+	std::error_code errorCode;
+	if (g_packStore.folderPath.empty() || !std::fs::exists(g_packStore.folderPath, errorCode))
+	{
+		return;
+	}
+
+	std::map<uint32_t, std::fs::path> segmentPaths;
+
+	for (const std::fs::directory_entry& directoryEntry : std::fs::directory_iterator(g_packStore.folderPath, errorCode))
+	{
+		std::wstring fileName = directoryEntry.path().filename().wstring();
+		if (directoryEntry.path().extension() != kPackSegmentExtension || fileName.rfind(L"segment_", 0) != 0)
+		{
+			continue;
+		}
+
+		uint32_t segmentId = (uint32_t)wcstoul(fileName.c_str() + 8, nullptr, 10);
+		if (segmentId != 0)
+		{
+			segmentPaths[segmentId] = directoryEntry.path();
+		}
+	}
+
+	std::vector<LoadedRecord> records;
+
+	for (auto segmentIt = segmentPaths.begin(); segmentIt != segmentPaths.end(); ++segmentIt)
+	{
+		LoadSegment_Locked(segmentIt->first, segmentIt->second, std::next(segmentIt) == segmentPaths.end(), records);
+	}
+
+	std::set<std::pair<uint32_t, uint64_t>> deadRecords;
+	for (const auto& [segmentId, segment] : g_packStore.segments)
+	{
+		for (const PackTombstone& tombstone : segment.tombstones)
+		{
+			deadRecords.insert({ tombstone.targetSegmentId, tombstone.targetOffset });
+		}
+	}
+
+	// Segments are read in order, so of two records under one key the later one wins
+	for (LoadedRecord& record : records)
+	{
+		if (deadRecords.count({ record.segmentId, record.version.recordOffset }))
+		{
+			g_packStore.segments[record.segmentId].deadBytes += record.version.recordSize;
+			continue;
+		}
+
+		auto versionIt = g_packStore.versions.find(record.key);
+		if (versionIt != g_packStore.versions.end())
+		{
+			g_packStore.segments[versionIt->second.segmentId].deadBytes += versionIt->second.recordSize;
+			versionIt->second = record.version;
+		}
+		else
+		{
+			g_packStore.versions.emplace(std::move(record.key), record.version);
+		}
+	}
+
+	if (!segmentPaths.empty())
+	{
+		OpenActiveSegment_Locked(segmentPaths.rbegin()->first);
+	}
+}
+
+//-----------------------------------------------------------------------------------------------------
+// Versions
+//-----------------------------------------------------------------------------------------------------
+
+bool IsPackedBackup(const std::fs::path& backupPath)
+{
+	std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+	std::string key;
+	return MakePackKey_Locked(backupPath, key) && g_packStore.versions.count(key) != 0;
+}
+
+std::fs::path GetPackedBackupSegmentPath(const std::fs::path& backupPath)
+{
+	std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+	std::string key;
+	if (!MakePackKey_Locked(backupPath, key))
+	{
+		return {};
+	}
+
+	auto versionIt = g_packStore.versions.find(key);
+	if (versionIt == g_packStore.versions.end())
+	{
+		return {};
+	}
+
+	auto segmentIt = g_packStore.segments.find(versionIt->second.segmentId);
+	return segmentIt != g_packStore.segments.end() ? segmentIt->second.path : std::fs::path();
+}
+
+bool GetPackedBackupInfo(const std::fs::path& backupPath, uint64_t& outContentSize, uint64_t& outContentHash)
+{
+	std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+	std::string key;
+	if (!MakePackKey_Locked(backupPath, key))
+	{
+		return false;
+	}
+
+	auto versionIt = g_packStore.versions.find(key);
+	if (versionIt == g_packStore.versions.end())
+	{
+		return false;
+	}
+
+	outContentSize = versionIt->second.dataSize;
+	outContentHash = versionIt->second.contentHash;
+	return true;
+}
+
+void ForEachPackedBackup(const PackedBackupCallback& onVersion)
+{
+	std::vector<std::pair<std::string, PackedVersion>> versions;
+	std::fs::path rootPath;
+	{
+		std::lock_guard<std::mutex> lock(g_packStore.mutex);
+		versions.assign(g_packStore.versions.begin(), g_packStore.versions.end());
+		rootPath = g_packStore.rootPath;
+	}
+
+	for (const auto& [key, version] : versions)
+	{
+		std::fs::file_time_type lastWriteTime{ std::fs::file_time_type::duration(version.lastWriteTimeTicks) };
+		onVersion(rootPath / std::fs::u8path(key), version.dataSize, version.contentHash, lastWriteTime);
+	}
+}
+
+bool StoreBackupPacked(const std::fs::path& sourcePath, const std::fs::path& backupPath, uint64_t& outContentHash, uint64_t& outStoredBytes)
+{
+	std::error_code errorCode;
+	std::fs::file_time_type sourceWriteTime = std::fs::last_write_time(sourcePath, errorCode);
+	if (errorCode)
+	{
+		return false;
+	}
+
+	std::vector<uint8_t> contents;
+	{
+		std::ifstream stream(sourcePath, std::ios::binary);
+		if (!stream.is_open())
+		{
+			return false;
+		}
+
+		contents.resize(kPackMaxVersionSize + 1);
+		stream.read((char*)contents.data(), (std::streamsize)contents.size());
+
+		if (stream.bad() || (uint64_t)stream.gcount() > kPackMaxVersionSize)
+		{
+			return false;
+		}
+
+		contents.resize((size_t)stream.gcount());
+	}
+
+	outContentHash = HashBytes(contents.data(), contents.size());
+
+	{
+		std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+		std::string key;
+		if (!MakePackKey_Locked(backupPath, key))
+		{
+			return false;
+		}
+
+		std::fs::create_directories(g_packStore.folderPath, errorCode);
+
+		if (!AppendVersion_Locked(key, contents.data(), contents.size(), outContentHash, (int64_t)sourceWriteTime.time_since_epoch().count()))
+		{
+			return false;
+		}
+	}
+
+	// A version saved within the same second as a file of its own would otherwise shadow this one
+	std::fs::remove(backupPath, errorCode);
+
+	outStoredBytes = contents.size();
+	return true;
+}
+
+bool ReadPackedBackup(const std::fs::path& backupPath, std::vector<uint8_t>& outContents)
+{
+	std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+	std::string key;
+	if (!MakePackKey_Locked(backupPath, key))
+	{
+		return false;
+	}
+
+	auto versionIt = g_packStore.versions.find(key);
+	return versionIt != g_packStore.versions.end() && ReadVersionData_Locked(versionIt->second, outContents);
+}
+
+bool RemovePackedBackup(const std::fs::path& backupPath)
+{
+	std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+	std::string key;
+	if (!MakePackKey_Locked(backupPath, key))
+	{
+		return false;
+	}
+
+	auto versionIt = g_packStore.versions.find(key);
+	if (versionIt == g_packStore.versions.end())
+	{
+		return false;
+	}
+
+	PackedVersion version = versionIt->second;
+
+	if (!AppendTombstone_Locked(version.segmentId, version.recordOffset))
+	{
+		return false;
+	}
+
+	g_packStore.versions.erase(versionIt);
+	g_packStore.segments[version.segmentId].deadBytes += version.recordSize;
+	return true;
+}
+
+uint64_t GetPackDeadBytes()
+{
+	std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+	uint64_t deadBytes = 0;
+	for (const auto& [segmentId, segment] : g_packStore.segments)
+	{
+		deadBytes += segment.deadBytes;
+	}
+
+	return deadBytes;
+}
+
+//-----------------------------------------------------------------------------------------------------
+// Compaction
+//-----------------------------------------------------------------------------------------------------
+
+// Moves what is still live in a sealed segment to the active segment and deletes it. Records are read
+// outside the lock and appended one at a time under it, so packing new versions carries on meanwhile.
+// Returns the bytes freed on disk.
+static uint64_t CompactSegment(uint32_t segmentId, uint64_t openCount)
+{
+	std::fs::path segmentPath;
+	uint64_t segmentFileSize = 0;
+	std::vector<std::pair<std::string, PackedVersion>> liveVersions;
+	{
+		std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+		auto segmentIt = g_packStore.segments.find(segmentId);
+		if (g_packStore.openCount != openCount || segmentIt == g_packStore.segments.end())
+		{
+			return 0;
+		}
+
+		segmentPath = segmentIt->second.path;
+		segmentFileSize = segmentIt->second.fileSize;
+
+		for (const auto& [key, version] : g_packStore.versions)
+		{
+			if (version.segmentId == segmentId)
+			{
+				liveVersions.push_back({ key, version });
+			}
+		}
+	}
+
+	uint64_t writtenBytes = 0;
+	std::set<std::fs::path> writtenPaths;
+	std::vector<uint8_t> contents;
+
+	// Live versions move to the active segment under the same key, which takes over from the old record
+	for (const auto& [key, version] : liveVersions)
+	{
+		if (!ReadVersionData(segmentPath, version, contents))
+		{
+			return 0;
+		}
+
+		std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+		if (g_packStore.openCount != openCount)
+		{
+			return 0;
+		}
+
+		// Removed or packed again while it was read, there is nothing left to move
+		auto versionIt = g_packStore.versions.find(key);
+		if (versionIt == g_packStore.versions.end() || versionIt->second.segmentId != segmentId || versionIt->second.recordOffset != version.recordOffset)
+		{
+			continue;
+		}
+
+		if (!AppendVersion_Locked(key, contents.data(), contents.size(), version.contentHash, version.lastWriteTimeTicks))
+		{
+			return 0;
+		}
+
+		writtenBytes += sizeof(PackRecordHeader) + key.size() + contents.size();
+		writtenPaths.insert(g_packStore.segments[g_packStore.activeSegmentId].path);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+		if (g_packStore.openCount != openCount)
+		{
+			return 0;
+		}
+
+		// Tombstones whose target segment outlives this one still have work to do. The segment is sealed,
+		// so no tombstone can be added to it meanwhile.
+		std::vector<PackTombstone> tombstones = g_packStore.segments[segmentId].tombstones;
+
+		for (const PackTombstone& tombstone : tombstones)
+		{
+			if (tombstone.targetSegmentId != segmentId && g_packStore.segments.count(tombstone.targetSegmentId))
+			{
+				if (!AppendTombstone_Locked(tombstone.targetSegmentId, tombstone.targetOffset))
+				{
+					return 0;
+				}
+
+				writtenBytes += sizeof(PackRecordHeader);
+				writtenPaths.insert(g_packStore.segments[g_packStore.activeSegmentId].path);
+			}
+		}
+	}
+
+	// The moved records must be on disk before the only other copy of them goes, whatever the durability
+	// setting: a power loss may cost the newest versions, never ones that were already safe
+	for (const std::fs::path& writtenPath : writtenPaths)
+	{
+		CommitBackupWrite(writtenPath, BackupDurability::PerFile);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_packStore.mutex);
+
+		if (g_packStore.openCount != openCount)
+		{
+			return 0;
+		}
+
+		std::error_code errorCode;
+		if (!std::fs::remove(segmentPath, errorCode))
+		{
+			return 0;
+		}
+
+		g_packStore.segments.erase(segmentId);
+	}
+
+	return segmentFileSize > writtenBytes ? segmentFileSize - writtenBytes : 0;
+}
+
+uint64_t CompactPackSegments(bool reclaimAllDeadBytes)
+{
+	// A second caller finds the work already being done
+	std::unique_lock<std::mutex> compactionLock(g_packStore.compactionMutex, std::try_to_lock);
+	if (!compactionLock.owns_lock())
+	{
+		return 0;
+	}
+
+	std::vector<uint32_t> segmentsToCompact;
+	uint64_t openCount = 0;
+	{
+		std::lock_guard<std::mutex> lock(g_packStore.mutex);
+		openCount = g_packStore.openCount;
+
+		for (const auto& [segmentId, segment] : g_packStore.segments)
+		{
+			bool isWorthCompacting = reclaimAllDeadBytes ? segment.deadBytes > 0 : segment.deadBytes * 2 >= segment.fileSize;
+
+			if (segmentId != g_packStore.activeSegmentId && isWorthCompacting)
+			{
+				segmentsToCompact.push_back(segmentId);
+			}
+		}
+	}
+
+	uint64_t freedBytes = 0;
+
+	for (uint32_t segmentId : segmentsToCompact)
+	{
+		freedBytes += CompactSegment(segmentId, openCount);
+	}
+
+	return freedBytes;
+}
@@ -0,0 +1,44 @@
+#ifndef PACKSTORE_H
+#define PACKSTORE_H
+
+// Pack storage for small versions. Instead of a file of their own in the mirrored backup tree, versions
+// up to kPackMaxVersionSize are appended to segment files under <backup root>\.packs, each record keyed by
+// the backup path the version would otherwise have. The offset index lives in memory and is rebuilt by
+// reading the record headers of the segments, a handful of files however many versions they hold.
+// Removing a version appends a tombstone; once half of a sealed segment is dead, CompactPackSegments
+// copies what is still live into the active segment and deletes it.
+
+static constexpr const wchar_t*	kPackFolderName = L".packs";
+static constexpr uint64_t		kPackMaxVersionSize = 64 * 1024;
+
+// Loads the index of the segments under backupRootPath, replacing whatever was open before
+void			OpenPackStore(const std::fs::path& backupRootPath);
+
+bool			IsPackedBackup(const std::fs::path& backupPath);
+bool			GetPackedBackupInfo(const std::fs::path& backupPath, uint64_t& outContentSize, uint64_t& outContentHash);
+
+// Segment file holding a packed version, for flushing it to disk. Empty if backupPath isn't packed.
+std::fs::path	GetPackedBackupSegmentPath(const std::fs::path& backupPath);
+
+typedef std::function<void(const std::fs::path& backupPath, uint64_t contentSize, uint64_t contentHash, std::fs::file_time_type lastWriteTime)> PackedBackupCallback;
+
+// Calls onVersion for every live packed version
+void			ForEachPackedBackup(const PackedBackupCallback& onVersion);
+
+// Appends sourcePath as the version at backupPath. outContentHash is the ContentHasher hash of its bytes.
+bool			StoreBackupPacked(const std::fs::path& sourcePath, const std::fs::path& backupPath, uint64_t& outContentHash, uint64_t& outStoredBytes);
+
+// Reads a packed version, checked against its recorded hash
+bool			ReadPackedBackup(const std::fs::path& backupPath, std::vector<uint8_t>& outContents);
+
+// Tombstones a packed version. Nothing is freed on disk until its segment is compacted.
+bool			RemovePackedBackup(const std::fs::path& backupPath);
+
+// Bytes of removed versions and tombstones still held in the segments, which compaction gives back
+uint64_t		GetPackDeadBytes();
+
+// Rewrites the sealed segments that are mostly dead, or every sealed one with anything dead in it when
+// reclaimAllDeadBytes is set. Returns the bytes freed on disk.
+uint64_t		CompactPackSegments(bool reclaimAllDeadBytes);
+
+#endif // PACKSTORE_H
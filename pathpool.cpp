@@ -0,0 +1,178 @@
+#include "main.h"
+#include "pathpool.h"
+
+// Characters are carved out of blocks this size; a longer path gets a block of its own
+static constexpr size_t		kArenaBlockChars = 256 * 1024;
+
+// Records are allocated a block at a time so one never moves once its id is handed out, and readers
+// can find it without taking the lock
+static constexpr uint32_t	kRecordBlockShift = 14;
+static constexpr uint32_t	kRecordBlockSize = 1u << kRecordBlockShift;
+static constexpr uint32_t	kMaxRecordBlocks = 16384;
+
+struct PathRecord
+{
+	const wchar_t*	text = nullptr;		// The path followed by its lowercase form, in the arena
+	uint32_t		length = 0;
+	uint32_t		directoryLength = 0;
+	uint32_t		fileNameOffset = 0;
+	uint64_t		hash = 0;
+};
+
+struct PathPool
+{
+	std::shared_mutex							mutex;
+	std::umap<std::wstring_view, PathId>		ids;		// Keys point into the arena
+
+	std::vector<std::unique_ptr<wchar_t[]>>		arenaBlocks;
+	wchar_t*									arenaBlock = nullptr;	// The block being filled
+	size_t										arenaBlockUsed = kArenaBlockChars;
+	uint64_t									arenaBytes = 0;
+
+	std::unique_ptr<PathRecord[]>				recordBlocks[kMaxRecordBlocks];
+	uint32_t									recordCount = 1;	// Id 0 is kInvalidPathId
+};
+
+static PathPool g_pathPool;
+
+static wchar_t* AllocateChars_Locked(size_t charCount)
+{
+	if (charCount > kArenaBlockChars)
+	{
+		g_pathPool.arenaBlocks.push_back(std::make_unique<wchar_t[]>(charCount));
+		g_pathPool.arenaBytes += charCount * sizeof(wchar_t);
+		return g_pathPool.arenaBlocks.back().get();
+	}
+
+	if (g_pathPool.arenaBlockUsed + charCount > kArenaBlockChars)
+	{
+		g_pathPool.arenaBlocks.push_back(std::make_unique<wchar_t[]>(kArenaBlockChars));
+		g_pathPool.arenaBytes += kArenaBlockChars * sizeof(wchar_t);
+		g_pathPool.arenaBlock = g_pathPool.arenaBlocks.back().get();
+		g_pathPool.arenaBlockUsed = 0;
+	}
+
+	wchar_t* chars = g_pathPool.arenaBlock + g_pathPool.arenaBlockUsed;
+	g_pathPool.arenaBlockUsed += charCount;
+	return chars;
+}
+
+static const PathRecord* GetRecord(PathId pathId)
+{
+	if (pathId == kInvalidPathId)
+	{
+		return nullptr;
+	}
+
+	return &g_pathPool.recordBlocks[pathId >> kRecordBlockShift][pathId & (kRecordBlockSize - 1)];
+}
+
+PathId InternPath(std::wstring_view path)
+{
+	if (path.empty())
+	{
+		return kInvalidPathId;
+	}
+
+	{
+		std::shared_lock<std::shared_mutex> lock(g_pathPool.mutex);
+
+		auto idIt = g_pathPool.ids.find(path);
+		if (idIt != g_pathPool.ids.end())
+		{
+			return idIt->second;
+		}
+	}
+
+	std::unique_lock<std::shared_mutex> lock(g_pathPool.mutex);
+
+	auto idIt = g_pathPool.ids.find(path);
+	if (idIt != g_pathPool.ids.end())
+	{
+		return idIt->second;
+	}
+
+	PathId pathId = g_pathPool.recordCount;
+	uint32_t blockIndex = pathId >> kRecordBlockShift;
+
+	if (blockIndex >= kMaxRecordBlocks)
+	{
+		return kInvalidPathId;
+	}
+
+	if (!g_pathPool.recordBlocks[blockIndex])
+	{
+		g_pathPool.recordBlocks[blockIndex] = std::make_unique<PathRecord[]>(kRecordBlockSize);
+	}
+
+	wchar_t* text = AllocateChars_Locked(path.size() * 2);
+	std::copy(path.begin(), path.end(), text);
+	std::transform(path.begin(), path.end(), text + path.size(), [](wchar_t c)
+	{
+		return (wchar_t)towlower(c);
+	});
+
+	PathRecord& record = g_pathPool.recordBlocks[blockIndex][pathId & (kRecordBlockSize - 1)];
+	record.text = text;
+	record.length = (uint32_t)path.size();
+	record.hash = (uint64_t)std::hash<std::wstring_view>()(path);
+
+	// Split like fs::path does: a root directory ("C:\", "/") keeps its separator
+	size_t separatorPos = path.find_last_of(L"\\/");
+	if (separatorPos != std::wstring_view::npos)
+	{
+		bool isRootSeparator = separatorPos == 0 || (separatorPos == 2 && path[1] == L':');
+		record.directoryLength = (uint32_t)(isRootSeparator ? separatorPos + 1 : separatorPos);
+		record.fileNameOffset = (uint32_t)separatorPos + 1;
+	}
+
+	g_pathPool.ids.emplace(std::wstring_view(text, path.size()), pathId);
+	++g_pathPool.recordCount;
+	return pathId;
+}
+
+PathId FindPathId(std::wstring_view path)
+{
+	std::shared_lock<std::shared_mutex> lock(g_pathPool.mutex);
+
+	auto idIt = g_pathPool.ids.find(path);
+	return idIt != g_pathPool.ids.end() ? idIt->second : kInvalidPathId;
+}
+
+std::wstring_view GetPath(PathId pathId)
+{
+	const PathRecord* record = GetRecord(pathId);
+	return record ? std::wstring_view(record->text, record->length) : std::wstring_view();
+}
+
+std::wstring_view GetPathLower(PathId pathId)
+{
+	const PathRecord* record = GetRecord(pathId);
+	return record ? std::wstring_view(record->text + record->length, record->length) : std::wstring_view();
+}
+
+uint64_t GetPathHash(PathId pathId)
+{
+	const PathRecord* record = GetRecord(pathId);
+	return record ? record->hash : 0;
+}
+
+std::wstring_view GetPathDirectory(PathId pathId)
+{
+	const PathRecord* record = GetRecord(pathId);
+	return record ? std::wstring_view(record->text, record->directoryLength) : std::wstring_view();
+}
+
+std::wstring_view GetPathFileName(PathId pathId)
+{
+	const PathRecord* record = GetRecord(pathId);
+	return record ? std::wstring_view(record->text + record->fileNameOffset, record->length - record->fileNameOffset) : std::wstring_view();
+}
+
+void GetPathPoolUsage(uint32_t& outPathCount, uint64_t& outArenaBytes)
+{
+	std::shared_lock<std::shared_mutex> lock(g_pathPool.mutex);
+
+	outPathCount = g_pathPool.recordCount - 1;
+	outArenaBytes = g_pathPool.arenaBytes;
+}
@@ -0,0 +1,31 @@
+#ifndef PATHPOOL_H
+#define PATHPOOL_H
+
+// Interned paths. Every original path the index, the history and the UI hold is stored once, in an
+// arena of large character blocks, and referred to by a 32-bit id; the same path always gets the same
+// id, so comparing two paths is comparing two integers. Along with the path the pool keeps its hash
+// and lowercase form and where its filename starts, so none of those are recomputed per use.
+// Paths are never removed: ids stay valid for the life of the process, and the strings returned
+// point into the arena, which never moves.
+
+typedef uint32_t PathId;
+static constexpr PathId kInvalidPathId = 0;
+
+// Id of path, interning it on first use. The empty path is kInvalidPathId.
+PathId				InternPath(std::wstring_view path);
+
+// Id of path if it has been interned, kInvalidPathId otherwise
+PathId				FindPathId(std::wstring_view path);
+
+std::wstring_view	GetPath(PathId pathId);
+std::wstring_view	GetPathLower(PathId pathId);
+uint64_t			GetPathHash(PathId pathId);
+
+// The parts fs::path::parent_path and fs::path::filename would give
+std::wstring_view	GetPathDirectory(PathId pathId);
+std::wstring_view	GetPathFileName(PathId pathId);
+
+// Paths interned so far, and the arena bytes holding them
+void				GetPathPoolUsage(uint32_t& outPathCount, uint64_t& outArenaBytes);
+
+#endif // PATHPOOL_H
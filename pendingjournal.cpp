@@ -0,0 +1,268 @@
+#include "main.h"
+#include "pendingjournal.h"
+#include "util.h"
+
+// Each record is one line: '+' or '-' followed by the UTF-8 path
+static constexpr char kAcceptedRecord = '+';
+static constexpr char kDoneRecord = '-';
+
+// Records arriving within this window share one write
+static constexpr uint32_t kGroupCommitMs = 20;
+
+// Rewrite the journal with just the outstanding paths once it grows past this
+static constexpr uint64_t kCompactJournalBytes = 4ull * 1024 * 1024;
+
+struct PendingJournal
+{
+	std::mutex							mutex;
+	std::condition_variable				condition;
+	std::string							buffer;
+	std::umap<std::wstring, uint32_t>	outstanding;
+	uint64_t							outstandingTotal = 0;
+	bool								stopRequested = false;
+
+	// Only touched by the writer thread once it is running
+	std::fs::path						path;
+	std::ofstream						stream;
+	uint64_t							fileBytes = 0;
+
+	std::thread							writerThread;
+};
+
+static std::unique_ptr<PendingJournal>	g_pendingJournal;
+
+static void AppendRecord(std::string& outText, char recordType, const std::wstring& filePath)
+{
+	outText.push_back(recordType);
+	outText += WToUTF8(filePath);
+	outText.push_back('\n');
+}
+
+static bool RewriteJournal(PendingJournal& journal, const std::string& contents)
+{
+	journal.stream.close();
+
+	std::fs::path tempPath = journal.path;
+	tempPath += L".tmp";
+
+	{
+		std::ofstream tempStream(tempPath, std::ios::binary | std::ios::trunc);
+		if (!tempStream)
+		{
+			journal.stream.open(journal.path, std::ios::binary | std::ios::app);
+			return false;
+		}
+
+		tempStream.write(contents.data(), (std::streamsize)contents.size());
+		tempStream.flush();
+	}
+
+	std::error_code errorCode;
+	std::fs::rename(tempPath, journal.path, errorCode);
+
+	journal.stream.open(journal.path, std::ios::binary | std::ios::app);
+	journal.fileBytes = errorCode ? journal.fileBytes : (uint64_t)contents.size();
+	return !errorCode;
+}
+
+static void JournalWriterProc(PendingJournal* journal)
+{
+	std::string pendingBytes;
+	std::string compactBytes;
+
+	std::unique_lock<std::mutex> lock(journal->mutex);
+
+	while (true)
+	{
+		journal->condition.wait(lock, [journal]()
+		{
+			return journal->stopRequested || !journal->buffer.empty();
+		});
+
+		if (journal->buffer.empty() && journal->stopRequested)
+		{
+			break;
+		}
+
+		// Group commit: give concurrent callers a moment to add to this batch
+		if (!journal->stopRequested)
+		{
+			lock.unlock();
+			std::this_thread::sleep_for(std::chrono::milliseconds(kGroupCommitMs));
+			lock.lock();
+		}
+
+		pendingBytes.clear();
+		pendingBytes.swap(journal->buffer);
+
+		// The swapped batch and the outstanding counts agree here, so either shortcut is safe
+		bool truncateJournal = journal->outstandingTotal == 0;
+		bool compactJournal = !truncateJournal && journal->fileBytes + pendingBytes.size() > kCompactJournalBytes;
+
+		compactBytes.clear();
+		if (compactJournal)
+		{
+			for (const auto& outstandingPath : journal->outstanding)
+			{
+				for (uint32_t recordIndex = 0; recordIndex < outstandingPath.second; ++recordIndex)
+				{
+					AppendRecord(compactBytes, kAcceptedRecord, outstandingPath.first);
+				}
+			}
+		}
+
+		lock.unlock();
+
+		if (truncateJournal)
+		{
+			journal->stream.close();
+			journal->stream.open(journal->path, std::ios::binary | std::ios::trunc);
+			journal->fileBytes = 0;
+		}
+		else if (!compactJournal || !RewriteJournal(*journal, compactBytes))
+		{
+			journal->stream.write(pendingBytes.data(), (std::streamsize)pendingBytes.size());
+			journal->stream.flush();
+			journal->fileBytes += pendingBytes.size();
+		}
+
+		lock.lock();
+	}
+}
+
+bool OpenPendingJournal(const std::fs::path& journalPath, std::vector<std::wstring>& outReplayPaths)
+{
+	ClosePendingJournal();
+
+	auto journal = std::make_unique<PendingJournal>();
+	journal->path = journalPath;
+
+	// Replay: a path is still outstanding if it was accepted more often than it was marked done
+	std::umap<std::wstring, int32_t> recordCounts;
+	std::vector<std::wstring> recordOrder;
+
+	{
+		std::ifstream readStream(journalPath, std::ios::binary);
+		std::string lineText;
+
+		while (readStream && std::getline(readStream, lineText))
+		{
+			if (lineText.size() < 2 || (lineText[0] != kAcceptedRecord && lineText[0] != kDoneRecord))
+			{
+				// A torn last line from a crash mid write
+				continue;
+			}
+
+			std::wstring filePath = UTF8ToW(lineText.substr(1));
+			auto insertResult = recordCounts.try_emplace(filePath, 0);
+			if (insertResult.second)
+			{
+				recordOrder.push_back(filePath);
+			}
+
+			insertResult.first->second += lineText[0] == kAcceptedRecord ? 1 : -1;
+		}
+	}
+
+	std::string replayBytes;
+	for (const std::wstring& filePath : recordOrder)
+	{
+		if (recordCounts[filePath] > 0)
+		{
+			outReplayPaths.push_back(filePath);
+			journal->outstanding[filePath] = 1;
+			++journal->outstandingTotal;
+			AppendRecord(replayBytes, kAcceptedRecord, filePath);
+		}
+	}
+
+	// Start from a compact file holding just the replayed paths
+	RewriteJournal(*journal, replayBytes);
+	if (!journal->stream.is_open())
+	{
+		return false;
+	}
+
+	journal->writerThread = std::thread(JournalWriterProc, journal.get());
+	g_pendingJournal = std::move(journal);
+	return true;
+}
+
+void ClosePendingJournal()
+{
+	if (!g_pendingJournal)
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_pendingJournal->mutex);
+		g_pendingJournal->stopRequested = true;
+	}
+	g_pendingJournal->condition.notify_all();
+
+	if (g_pendingJournal->writerThread.joinable())
+	{
+		g_pendingJournal->writerThread.join();
+	}
+
+	g_pendingJournal->stream.close();
+	g_pendingJournal.reset();
+}
+
+void JournalPendingAccepted(const std::wstring& filePath)
+{
+	if (!g_pendingJournal)
+	{
+		return;
+	}
+
+	bool wakeWriter = false;
+	{
+		std::lock_guard<std::mutex> lock(g_pendingJournal->mutex);
+
+		wakeWriter = g_pendingJournal->buffer.empty();
+		AppendRecord(g_pendingJournal->buffer, kAcceptedRecord, filePath);
+
+		++g_pendingJournal->outstanding[filePath];
+		++g_pendingJournal->outstandingTotal;
+	}
+
+	if (wakeWriter)
+	{
+		g_pendingJournal->condition.notify_one();
+	}
+}
+
+void JournalPendingDone(const std::wstring& filePath)
+{
+	if (!g_pendingJournal)
+	{
+		return;
+	}
+
+	bool wakeWriter = false;
+	{
+		std::lock_guard<std::mutex> lock(g_pendingJournal->mutex);
+
+		auto foundPath = g_pendingJournal->outstanding.find(filePath);
+		if (foundPath == g_pendingJournal->outstanding.end())
+		{
+			return;
+		}
+
+		if (--foundPath->second == 0)
+		{
+			g_pendingJournal->outstanding.erase(foundPath);
+		}
+		--g_pendingJournal->outstandingTotal;
+
+		wakeWriter = g_pendingJournal->buffer.empty();
+		AppendRecord(g_pendingJournal->buffer, kDoneRecord, filePath);
+	}
+
+	if (wakeWriter)
+	{
+		g_pendingJournal->condition.notify_one();
+	}
+}
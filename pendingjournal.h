@@ -0,0 +1,20 @@
+#ifndef PENDINGJOURNAL_H
+#define PENDINGJOURNAL_H
+
+// Append-only journal of paths that were accepted for backup but not copied yet, so changes still
+// waiting out their quiet window (or sitting in the copy queue) survive an exit or crash.
+// Records are buffered in memory and written by a background thread in groups, so journaling a path
+// costs the caller a string append under a short lock. Once every accepted path has been marked done
+// the file is truncated; it is also compacted down to the outstanding paths if it grows large.
+
+// Opens (creating if needed) the journal and returns the paths left outstanding by the previous run.
+// Those paths count as accepted in this run too, mark them done once handled.
+bool	OpenPendingJournal(const std::fs::path& journalPath, std::vector<std::wstring>& outReplayPaths);
+
+// Flushes anything still buffered and stops the writer thread
+void	ClosePendingJournal();
+
+void	JournalPendingAccepted(const std::wstring& filePath);
+void	JournalPendingDone(const std::wstring& filePath);
+
+#endif // PENDINGJOURNAL_H
@@ -0,0 +1,237 @@
+#include "main.h"
+#include "scanner.h"
+#include "iothrottle.h"
+
+#include <deque>
+
+// Pending directories of one scan thread. The owner pushes and pops at the back, thieves take from the front.
+struct ScanWorkQueue
+{
+	std::mutex							mutex;
+	std::deque<std::fs::path>			pendingDirs;
+};
+
+struct ParallelScanState
+{
+	const ScanOptions*							options = nullptr;
+	std::vector<std::unique_ptr<ScanWorkQueue>>	workQueues;
+
+	// Directories queued or being scanned. Incremented before a directory is published, so it only
+	// reaches zero once the whole tree has been walked.
+	std::atomic<uint64_t>						outstandingDirs = 0;
+
+	std::mutex									idleMutex;
+	std::condition_variable						idleCondition;
+
+	std::chrono::steady_clock::time_point		startTime;
+	std::atomic<uint64_t>						entriesVisited = 0;
+};
+
+// Returns the number of directory entries visited, for throttling
+static size_t ScanSingleDirectory(const std::fs::path& dirPath, bool includeSubfolders, const ScanFileCallback& onFile, std::vector<std::fs::path>& outSubdirs)
+{
+	std::error_code errorCode;
+	size_t entryCount = 0;
+
+	for (auto iterator = std::fs::directory_iterator(dirPath, std::fs::directory_options::skip_permission_denied, errorCode);
+		iterator != std::fs::directory_iterator();
+		iterator.increment(errorCode))
+	{
+		if (errorCode)
+		{
+			errorCode.clear();
+			break;
+		}
+
+		const std::fs::directory_entry& entry = *iterator;
+		++entryCount;
+
+		if (entry.is_directory(errorCode))
+		{
+			if (includeSubfolders && !entry.is_symlink(errorCode))
+			{
+				outSubdirs.push_back(entry.path());
+			}
+			continue;
+		}
+
+		if (!entry.is_regular_file(errorCode))
+		{
+			continue;
+		}
+
+		ScannedFile scannedFile = {};
+		scannedFile.path = entry.path();
+		scannedFile.size = (uint64_t)entry.file_size(errorCode);
+		if (errorCode)
+		{
+			errorCode.clear();
+			continue;
+		}
+
+		scannedFile.lastWriteTime = entry.last_write_time(errorCode);
+		if (errorCode)
+		{
+			errorCode.clear();
+			continue;
+		}
+
+		onFile(scannedFile);
+	}
+
+	return entryCount;
+}
+
+static bool TakePendingDirectory(ParallelScanState* scanState, size_t workerIndex, std::fs::path& outDirPath)
+{
+	{
+		ScanWorkQueue& ownQueue = *scanState->workQueues[workerIndex];
+		std::lock_guard<std::mutex> lock(ownQueue.mutex);
+
+		if (!ownQueue.pendingDirs.empty())
+		{
+			outDirPath = std::move(ownQueue.pendingDirs.back());
+			ownQueue.pendingDirs.pop_back();
+			return true;
+		}
+	}
+
+	size_t queueCount = scanState->workQueues.size();
+	for (size_t offset = 1; offset < queueCount; ++offset)
+	{
+		ScanWorkQueue& victimQueue = *scanState->workQueues[(workerIndex + offset) % queueCount];
+		std::lock_guard<std::mutex> lock(victimQueue.mutex);
+
+		if (!victimQueue.pendingDirs.empty())
+		{
+			outDirPath = std::move(victimQueue.pendingDirs.front());
+			victimQueue.pendingDirs.pop_front();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Keeps the walk at or below the configured entry rate, sleeping in short steps so cancellation is noticed
+static void ThrottleScan(ParallelScanState* scanState, size_t entryCount, const std::atomic<bool>* cancelRequested)
+{
+	uint32_t maxEntriesPerSecond = scanState->options->maxEntriesPerSecond;
+	if (maxEntriesPerSecond == 0 || entryCount == 0)
+	{
+		return;
+	}
+
+	uint64_t entriesVisited = scanState->entriesVisited.fetch_add(entryCount) + entryCount;
+	auto dueTime = scanState->startTime + std::chrono::milliseconds(entriesVisited * 1000 / maxEntriesPerSecond);
+
+	while (!cancelRequested->load())
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (now >= dueTime)
+		{
+			break;
+		}
+
+		std::this_thread::sleep_for((std::min)(std::chrono::duration_cast<std::chrono::milliseconds>(dueTime - now) + std::chrono::milliseconds(1), std::chrono::milliseconds(50)));
+	}
+}
+
+static void ScanThreadProc(ParallelScanState* scanState, size_t workerIndex, const std::atomic<bool>* cancelRequested, const ScanFileCallback* onFile)
+{
+	const ScanOptions& options = *scanState->options;
+
+	// So the walk yields the disk to whatever the user is doing
+	if (options.backgroundPriority)
+	{
+		SetBackgroundIoPriority();
+	}
+
+	std::vector<std::fs::path> foundSubdirs;
+	std::fs::path dirPath;
+
+	while (!cancelRequested->load())
+	{
+		if (!TakePendingDirectory(scanState, workerIndex, dirPath))
+		{
+			if (scanState->outstandingDirs.load() == 0)
+			{
+				break;
+			}
+
+			// Nothing to steal yet, another thread is still listing its directory. Bounded wait so a
+			// missed wakeup or cancellation costs at most a few milliseconds.
+			std::unique_lock<std::mutex> lock(scanState->idleMutex);
+			scanState->idleCondition.wait_for(lock, std::chrono::milliseconds(10));
+			continue;
+		}
+
+		foundSubdirs.clear();
+		size_t entryCount = ScanSingleDirectory(dirPath, options.includeSubfolders, *onFile, foundSubdirs);
+
+		if (!foundSubdirs.empty())
+		{
+			scanState->outstandingDirs.fetch_add(foundSubdirs.size());
+
+			{
+				ScanWorkQueue& ownQueue = *scanState->workQueues[workerIndex];
+				std::lock_guard<std::mutex> lock(ownQueue.mutex);
+
+				for (std::fs::path& subdirPath : foundSubdirs)
+				{
+					ownQueue.pendingDirs.push_back(std::move(subdirPath));
+				}
+			}
+
+			scanState->idleCondition.notify_all();
+		}
+
+		if (scanState->outstandingDirs.fetch_sub(1) == 1)
+		{
+			scanState->idleCondition.notify_all();
+			break;
+		}
+
+		ThrottleScan(scanState, entryCount, cancelRequested);
+	}
+
+#if defined(_WIN32)
+	if (options.backgroundPriority)
+	{
+		SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+	}
+#endif
+}
+
+bool ScanFolderParallel(const std::fs::path& rootPath, const ScanOptions& options, const std::atomic<bool>& cancelRequested, const ScanFileCallback& onFile)
+{
+	uint32_t threadCount = (std::max)(options.threadCount, 1u);
+
+	ParallelScanState scanState;
+	scanState.options = &options;
+	scanState.startTime = std::chrono::steady_clock::now();
+
+	for (uint32_t threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+	{
+		scanState.workQueues.push_back(std::make_unique<ScanWorkQueue>());
+	}
+
+	scanState.outstandingDirs.store(1);
+	scanState.workQueues[0]->pendingDirs.push_back(rootPath);
+
+	std::vector<std::thread> scanThreads;
+	for (uint32_t threadIndex = 1; threadIndex < threadCount; ++threadIndex)
+	{
+		scanThreads.push_back(std::thread(ScanThreadProc, &scanState, (size_t)threadIndex, &cancelRequested, &onFile));
+	}
+
+	// The calling thread takes part in the walk too
+	ScanThreadProc(&scanState, 0, &cancelRequested, &onFile);
+
+	for (std::thread& scanThread : scanThreads)
+	{
+		scanThread.join();
+	}
+
+	return !cancelRequested.load();
+}
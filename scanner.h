@@ -0,0 +1,28 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+
+struct ScannedFile
+{
+	std::fs::path				path;
+	uint64_t					size = 0;
+	std::fs::file_time_type		lastWriteTime = {};
+};
+
+struct ScanOptions
+{
+	bool		includeSubfolders = true;
+	uint32_t	threadCount = 1;
+	uint32_t	maxEntriesPerSecond = 0;	// Directory entries visited per second across all threads, 0 = unthrottled
+	bool		backgroundPriority = false;	// Run the scan threads at background I/O priority (and CPU priority on Windows)
+};
+
+// Invoked concurrently from the scan threads
+typedef std::function<void(const ScannedFile&)> ScanFileCallback;
+
+// Walks rootPath with options.threadCount threads and reports every regular file found. Each thread
+// works depth first through its own list of pending directories and steals the oldest (usually the
+// largest) pending subtree from another thread when it runs dry. Symlinked directories are not followed.
+// Returns false if cancelRequested was raised before the walk finished.
+bool	ScanFolderParallel(const std::fs::path& rootPath, const ScanOptions& options, const std::atomic<bool>& cancelRequested, const ScanFileCallback& onFile);
+
+#endif // SCANNER_H
@@ -6,12 +6,12 @@ Settings				g_settings;
 std::atomic<uint64_t>	g_lastSettingsSaveTick = 0;
 std::atomic<uint64_t>	g_lastSettingsChangeTick = 0;
 
-std::wstring INIPath()
+std::wstring AppDataFilePath(const std::wstring& fileName)
 {
 	wchar_t appDataPath[MAX_PATH] = {};
 	if (FAILED(SHGetFolderPathW(nullptr, CSIDL_APPDATA, nullptr, SHGFP_TYPE_CURRENT, appDataPath)))
 	{
-		return L"settings.ini";
+		return fileName;
 	}
 
 	std::fs::path settingsDir = std::fs::path(appDataPath) / L"LocalSourceControl";
@@ -19,7 +19,12 @@ std::wstring INIPath()
 	std::error_code errorCode;
 	std::fs::create_directories(settingsDir, errorCode);
 
-	return (settingsDir / L"settings.ini").wstring();
+	return (settingsDir / fileName).wstring();
+}
+
+std::wstring INIPath()
+{
+	return AppDataFilePath(L"settings.ini");
 }
 
 static void SanitizeWindowPlacement(Settings& settings)
@@ -140,7 +145,16 @@ void SaveSettings()
 	WriteText("[Backup]\n");
 	WriteText("Root=" + WToUTF8(g_settings.backupRoot) + "\n");
 	WriteText("MaxSizeMB=" + std::to_string(g_settings.maxBackupSizeMB) + "\n");
-	WriteText("MaxBackupsPerFile=" + std::to_string(g_settings.maxBackupsPerFile) + "\n\n");
+	WriteText("MaxBackupsPerFile=" + std::to_string(g_settings.maxBackupsPerFile) + "\n");
+	WriteText("CopyWorkers=" + std::to_string(g_settings.copyWorkerCount) + "\n");
+	WriteText("MaxLatencySec=" + std::to_string(g_settings.maxBackupLatencySec) + "\n");
+	WriteText("MaxCopyMBPerSec=" + std::to_string(g_settings.maxCopyMegabytesPerSec) + "\n");
+	WriteText("MaxCopyFilesPerSec=" + std::to_string(g_settings.maxCopyOperationsPerSec) + "\n");
+	WriteText("Deduplicate=" + std::to_string(g_settings.deduplicateBackups ? 1 : 0) + "\n");
+	WriteText("DeltaVersions=" + std::to_string(g_settings.deltaBackups ? 1 : 0) + "\n");
+	WriteText("Compress=" + std::to_string(g_settings.compressBackups ? 1 : 0) + "\n");
+	WriteText("PackSmallVersions=" + std::to_string(g_settings.packSmallBackups ? 1 : 0) + "\n");
+	WriteText("Durability=" + std::to_string((uint32_t)g_settings.durability) + "\n\n");
 
 	// Diff tool settings (used by Ctrl+D in history)
 	WriteText("[Tools]\n");
@@ -157,7 +171,8 @@ void SaveSettings()
 		WriteText("Path=" + WToUTF8(watchedFolder.path) + "\n");
 		WriteText("IncludeSub=" + std::to_string(watchedFolder.includeSubfolders ? 1 : 0) + "\n");
 		WriteText("Include=" + WToUTF8(watchedFolder.includeFiltersCSV) + "\n");
-		WriteText("Exclude=" + WToUTF8(watchedFolder.excludeFiltersCSV) + "\n\n");
+		WriteText("Exclude=" + WToUTF8(watchedFolder.excludeFiltersCSV) + "\n");
+		WriteText("LastScan=" + std::to_string((long long)watchedFolder.lastScanTime.time_since_epoch().count()) + "\n\n");
 	}
 }
 
@@ -267,6 +282,17 @@ void LoadSettings()
 	loadedSettings.backupRoot = UTF8ToW(GetINIValue(parsedIni, "Backup", "Root", WToUTF8(loadedSettings.backupRoot)));
 	loadedSettings.maxBackupSizeMB = (uint32_t)std::stoul(GetINIValue(parsedIni, "Backup", "MaxSizeMB", std::to_string(loadedSettings.maxBackupSizeMB)));
 	loadedSettings.maxBackupsPerFile = (uint32_t)std::stoul(GetINIValue(parsedIni, "Backup", "MaxBackupsPerFile", std::to_string(loadedSettings.maxBackupsPerFile)));
+	loadedSettings.copyWorkerCount = (uint32_t)std::stoul(GetINIValue(parsedIni, "Backup", "CopyWorkers", std::to_string(loadedSettings.copyWorkerCount)));
+	loadedSettings.maxBackupLatencySec = (uint32_t)std::stoul(GetINIValue(parsedIni, "Backup", "MaxLatencySec", std::to_string(loadedSettings.maxBackupLatencySec)));
+	loadedSettings.maxCopyMegabytesPerSec = (uint32_t)std::stoul(GetINIValue(parsedIni, "Backup", "MaxCopyMBPerSec", std::to_string(loadedSettings.maxCopyMegabytesPerSec)));
+	loadedSettings.maxCopyOperationsPerSec = (uint32_t)std::stoul(GetINIValue(parsedIni, "Backup", "MaxCopyFilesPerSec", std::to_string(loadedSettings.maxCopyOperationsPerSec)));
+	loadedSettings.deduplicateBackups = GetINIValue(parsedIni, "Backup", "Deduplicate", "0") != "0";
+	loadedSettings.deltaBackups = GetINIValue(parsedIni, "Backup", "DeltaVersions", "0") != "0";
+	loadedSettings.compressBackups = GetINIValue(parsedIni, "Backup", "Compress", "0") != "0";
+	loadedSettings.packSmallBackups = GetINIValue(parsedIni, "Backup", "PackSmallVersions", "0") != "0";
+
+	uint32_t durabilityValue = (uint32_t)std::stoul(GetINIValue(parsedIni, "Backup", "Durability", std::to_string((uint32_t)loadedSettings.durability)));
+	loadedSettings.durability = (BackupDurability)(std::min)(durabilityValue, (uint32_t)BackupDurability::Count - 1);
 
 	// Diff tool path
 	loadedSettings.diffToolPath = UTF8ToW(GetINIValue(parsedIni, "Tools", "DiffTool", WToUTF8(loadedSettings.diffToolPath)));
@@ -281,6 +307,7 @@ void LoadSettings()
 		watchedFolder.includeSubfolders = GetINIValue(parsedIni, watchedSection, "IncludeSub", "1") != "0";
 		watchedFolder.includeFiltersCSV = UTF8ToW(GetINIValue(parsedIni, watchedSection, "Include", ""));
 		watchedFolder.excludeFiltersCSV = UTF8ToW(GetINIValue(parsedIni, watchedSection, "Exclude", ""));
+		watchedFolder.lastScanTime = std::fs::file_time_type(std::fs::file_time_type::duration(std::stoll(GetINIValue(parsedIni, watchedSection, "LastScan", "0"))));
 
 		if (!watchedFolder.path.empty())
 		{
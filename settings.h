@@ -1,6 +1,17 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
+static constexpr uint32_t kMaxCopyWorkers = 16;
+
+enum class BackupDurability : uint8_t
+{
+	None,		// Left to the OS cache, a power loss can take the latest versions with it
+	Batched,	// Copies finishing close together are flushed together, each folder once
+	PerFile,	// Every copy is flushed on its own before it is indexed
+
+	Count,
+};
+
 struct Settings
 {
 	int				winX = CW_USEDEFAULT;
@@ -11,6 +22,15 @@ struct Settings
 	std::wstring	backupRoot = L"";
 	uint32_t		maxBackupSizeMB = 1024*10;
 	uint32_t		maxBackupsPerFile = 256;
+	uint32_t		copyWorkerCount = 2;
+	uint32_t		maxBackupLatencySec = 30;
+	uint32_t		maxCopyMegabytesPerSec = 0;
+	uint32_t		maxCopyOperationsPerSec = 0;
+	bool			deduplicateBackups = false;
+	bool			deltaBackups = false;
+	bool			compressBackups = false;
+	bool			packSmallBackups = false;
+	BackupDurability durability = BackupDurability::Batched;
 	std::wstring	diffToolPath;
 	bool			minimizeOnClose = true;
 	uint32_t		pauseMinutes = 10;
@@ -20,6 +40,9 @@ struct Settings
 
 extern Settings	g_settings;
 
+// Path of fileName inside the per-user %APPDATA%\LocalSourceControl folder
+std::wstring	AppDataFilePath(const std::wstring& fileName);
+
 void			LoadSettings();
 void			SaveSettings();
 
@@ -0,0 +1,252 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Intrusive link for TimerWheel. Embed (or derive from) this in the object being scheduled; the wheel
+// never allocates and an object can be re-armed any number of times in O(1).
+struct TimerWheelNode
+{
+	TimerWheelNode*		prev = nullptr;
+	TimerWheelNode*		next = nullptr;
+	uint64_t			deadlineTick = 0;
+	uint32_t			slotIndex = 0;
+	bool				isScheduled = false;
+};
+
+// Hashed timing wheel over millisecond ticks. Deadlines are bucketed into SlotCount slots of
+// ResolutionMs each; a per slot occupancy bitmap finds the next non empty slot without visiting empty
+// ones. Deadlines are honoured exactly: a node only expires once nowTick >= its deadlineTick, the
+// resolution only decides which bucket it waits in. Deadlines further out than one full turn of the
+// wheel are allowed and simply stay in their slot until their turn comes round.
+template<uint32_t SlotCount, uint32_t ResolutionMs>
+class TimerWheel
+{
+	static_assert((SlotCount & (SlotCount - 1)) == 0 && SlotCount >= 64, "SlotCount must be a power of two of at least 64");
+	static_assert(ResolutionMs > 0, "ResolutionMs must be non zero");
+
+public:
+	explicit TimerWheel(uint64_t nowTick)
+	{
+		cursorUnit = nowTick / ResolutionMs;
+	}
+
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+
+	bool		Empty() const	{ return scheduledCount == 0; }
+	size_t		Size() const	{ return scheduledCount; }
+
+	// Schedules or re-arms node
+	void Schedule(TimerWheelNode& node, uint64_t deadlineTick)
+	{
+		if (node.isScheduled)
+		{
+			Unlink(node);
+		}
+
+		// Anything already due goes in the slot the next Expire call starts from
+		uint64_t deadlineUnit = (std::max)(deadlineTick / ResolutionMs, cursorUnit);
+
+		node.deadlineTick = deadlineTick;
+		node.slotIndex = (uint32_t)(deadlineUnit & (SlotCount - 1));
+		node.prev = nullptr;
+		node.next = slotHeads[node.slotIndex];
+
+		if (node.next)
+		{
+			node.next->prev = &node;
+		}
+
+		slotHeads[node.slotIndex] = &node;
+		occupancy[node.slotIndex / 64] |= 1ull << (node.slotIndex % 64);
+		node.isScheduled = true;
+		++scheduledCount;
+	}
+
+	void Cancel(TimerWheelNode& node)
+	{
+		if (node.isScheduled)
+		{
+			Unlink(node);
+		}
+	}
+
+	// Finds the earliest pending deadline. Returns false when nothing is scheduled.
+	bool NextDeadline(uint64_t& outDeadlineTick) const
+	{
+		if (scheduledCount == 0)
+		{
+			return false;
+		}
+
+		// Only deadlines inside the current turn can be found by walking slots in order
+		uint64_t turnEndTick = (cursorUnit + SlotCount) * ResolutionMs;
+
+		uint32_t startSlot = (uint32_t)(cursorUnit & (SlotCount - 1));
+		uint32_t visitedSlots = 0;
+
+		while (visitedSlots < SlotCount)
+		{
+			uint32_t slotIndex = (startSlot + visitedSlots) & (SlotCount - 1);
+			uint32_t distance = 0;
+
+			if (!FindNextOccupiedSlot(slotIndex, distance) || visitedSlots + distance >= SlotCount)
+			{
+				break;
+			}
+
+			visitedSlots += distance;
+			slotIndex = (startSlot + visitedSlots) & (SlotCount - 1);
+
+			uint64_t earliestTick = UINT64_MAX;
+			for (const TimerWheelNode* node = slotHeads[slotIndex]; node; node = node->next)
+			{
+				if (node->deadlineTick < turnEndTick)
+				{
+					earliestTick = (std::min)(earliestTick, node->deadlineTick);
+				}
+			}
+
+			if (earliestTick != UINT64_MAX)
+			{
+				outDeadlineTick = earliestTick;
+				return true;
+			}
+
+			++visitedSlots;
+		}
+
+		// Only far future deadlines remain, fall back to looking at all of them
+		uint64_t earliestTick = UINT64_MAX;
+		for (uint32_t slotIndex = 0; slotIndex < SlotCount; ++slotIndex)
+		{
+			for (const TimerWheelNode* node = slotHeads[slotIndex]; node; node = node->next)
+			{
+				earliestTick = (std::min)(earliestTick, node->deadlineTick);
+			}
+		}
+
+		outDeadlineTick = earliestTick;
+		return true;
+	}
+
+	// Unlinks every node whose deadline has passed and hands it to onExpired(TimerWheelNode&). Only the
+	// slots between the previous call and nowTick are visited. The callback may re-arm the node.
+	template<class ExpiredCallback>
+	void Expire(uint64_t nowTick, ExpiredCallback&& onExpired)
+	{
+		uint64_t nowUnit = nowTick / ResolutionMs;
+		if (nowUnit < cursorUnit)
+		{
+			return;
+		}
+
+		uint64_t unitCount = (std::min)(nowUnit - cursorUnit + 1, (uint64_t)SlotCount);
+
+		// Collect first so a callback that re-arms into a slot we are about to visit isn't fired twice
+		expiredNodes.clear();
+
+		for (uint64_t unitOffset = 0; unitOffset < unitCount && scheduledCount > 0; ++unitOffset)
+		{
+			uint32_t slotIndex = (uint32_t)((cursorUnit + unitOffset) & (SlotCount - 1));
+
+			if (!(occupancy[slotIndex / 64] & (1ull << (slotIndex % 64))))
+			{
+				continue;
+			}
+
+			TimerWheelNode* node = slotHeads[slotIndex];
+			while (node)
+			{
+				TimerWheelNode* nextNode = node->next;
+				if (node->deadlineTick <= nowTick)
+				{
+					Unlink(*node);
+					expiredNodes.push_back(node);
+				}
+				node = nextNode;
+			}
+		}
+
+		cursorUnit = nowUnit;
+
+		for (TimerWheelNode* expiredNode : expiredNodes)
+		{
+			onExpired(*expiredNode);
+		}
+	}
+
+private:
+	void Unlink(TimerWheelNode& node)
+	{
+		if (node.prev)
+		{
+			node.prev->next = node.next;
+		}
+		else
+		{
+			slotHeads[node.slotIndex] = node.next;
+		}
+
+		if (node.next)
+		{
+			node.next->prev = node.prev;
+		}
+
+		if (!slotHeads[node.slotIndex])
+		{
+			occupancy[node.slotIndex / 64] &= ~(1ull << (node.slotIndex % 64));
+		}
+
+		node.prev = nullptr;
+		node.next = nullptr;
+		node.isScheduled = false;
+		--scheduledCount;
+	}
+
+	static uint32_t CountTrailingZeros(uint64_t value)
+	{
+#if defined(_MSC_VER)
+		unsigned long bitIndex = 0;
+		_BitScanForward64(&bitIndex, value);
+		return (uint32_t)bitIndex;
+#else
+		return (uint32_t)__builtin_ctzll(value);
+#endif
+	}
+
+	// Distance (in slots, wrapping) from fromSlot to the first occupied slot at or after it
+	bool FindNextOccupiedSlot(uint32_t fromSlot, uint32_t& outDistance) const
+	{
+		static constexpr uint32_t kWordCount = SlotCount / 64;
+
+		uint32_t wordIndex = fromSlot / 64;
+		uint64_t word = occupancy[wordIndex] & (~0ull << (fromSlot % 64));
+
+		for (uint32_t visitedWords = 0; visitedWords <= kWordCount; ++visitedWords)
+		{
+			if (word)
+			{
+				uint32_t slotIndex = wordIndex * 64 + CountTrailingZeros(word);
+				outDistance = (slotIndex - fromSlot) & (SlotCount - 1);
+				return true;
+			}
+
+			wordIndex = (wordIndex + 1) % kWordCount;
+			word = occupancy[wordIndex];
+		}
+
+		return false;
+	}
+
+	TimerWheelNode*					slotHeads[SlotCount] = {};
+	uint64_t						occupancy[SlotCount / 64] = {};
+	uint64_t						cursorUnit = 0;
+	size_t							scheduledCount = 0;
+	std::vector<TimerWheelNode*>	expiredNodes;
+};
+
+#endif // TIMERWHEEL_H
@@ -101,19 +101,31 @@ bool ContainsAllKeywords(const std::wstring& phrase, const std::wstring& keyword
 		return true;
 	}
 
-	std::wstring haystackLower = ToLower(phrase);
+	return ContainsAllKeywordsLower(ToLower(phrase), SplitKeywordsLower(keywords));
+}
 
-	std::vector<std::wstring> tokens = SplitCSV(keywords);
+// Split once and matched against many lowercase phrases, as when filtering a table
+std::vector<std::wstring> SplitKeywordsLower(const std::wstring& keywords)
+{
+	std::vector<std::wstring> keywordsLower;
 
-	for (const std::wstring& keywordRaw : tokens)
+	for (const std::wstring& keywordRaw : SplitCSV(keywords))
 	{
 		std::wstring keyword = ToLower(Trim(keywordRaw));
-		if (keyword.empty())
+		if (!keyword.empty())
 		{
-			continue;
+			keywordsLower.push_back(std::move(keyword));
 		}
+	}
 
-		if (haystackLower.find(keyword) == std::wstring::npos)
+	return keywordsLower;
+}
+
+bool ContainsAllKeywordsLower(std::wstring_view phraseLower, const std::vector<std::wstring>& keywordsLower)
+{
+	for (const std::wstring& keyword : keywordsLower)
+	{
+		if (phraseLower.find(keyword) == std::wstring_view::npos)
 		{
 			return false;
 		}
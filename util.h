@@ -11,6 +11,8 @@ std::wstring				ToLower(const std::wstring& s);
 std::string					ToLower(const std::string& s);
 std::vector<std::wstring>	SplitCSV(const std::wstring& csv);
 bool						ContainsAllKeywords(const std::wstring& phrase, const std::wstring& keywords);
+std::vector<std::wstring>	SplitKeywordsLower(const std::wstring& keywords);
+bool						ContainsAllKeywordsLower(std::wstring_view phraseLower, const std::vector<std::wstring>& keywordsLower);
 std::wstring				MakeTimestampStr();
 bool						IsPathUnderRoot(const std::wstring& candidatePath, const std::wstring& rootPath);
 
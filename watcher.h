@@ -0,0 +1,44 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+enum class WatchAction
+{
+	Added,
+	Removed,
+	Modified,
+	RenamedOldName,
+	RenamedNewName,
+	Overflow,		// Changes were dropped by the OS, fullPath is the watched folder
+};
+
+struct WatchEvent
+{
+	WatchAction		action = WatchAction::Modified;
+	uint32_t		watchId = 0;
+	std::wstring	fullPath;
+};
+
+static constexpr uint32_t kWatchWaitInfinite = 0xFFFFFFFF;
+
+// OS specific source of change notifications. A single backend multiplexes every watched folder
+// (IOCP on Windows, one epoll set over per-folder inotify instances on Linux) so one thread can
+// service all of them.
+// AddWatch/WaitForEvents/Close are called from the watcher thread, Cancel may be called from any thread.
+class WatchBackend
+{
+public:
+	virtual ~WatchBackend() = default;
+
+	virtual bool	AddWatch(uint32_t watchId, const std::wstring& folderPath, bool includeSubfolders) = 0;
+
+	// Blocks for up to timeoutMs and appends any received changes to outEvents.
+	// Returns false once the backend is cancelled or has no usable watches left.
+	virtual bool	WaitForEvents(uint32_t timeoutMs, std::vector<WatchEvent>& outEvents) = 0;
+
+	virtual void	Cancel() = 0;
+	virtual void	Close() = 0;
+};
+
+std::unique_ptr<WatchBackend>	CreateWatchBackend();
+
+#endif // WATCHER_H
@@ -0,0 +1,377 @@
+#include "main.h"
+#include "watcher.h"
+
+#if defined(__linux__)
+
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <limits.h>
+
+class InotifyWatchBackend : public WatchBackend
+{
+public:
+	InotifyWatchBackend()
+	{
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if (epollFd >= 0 && stopFd >= 0)
+		{
+			epoll_event stopEvent = {};
+			stopEvent.events = EPOLLIN;
+			stopEvent.data.u64 = kStopKey;
+			epoll_ctl(epollFd, EPOLL_CTL_ADD, stopFd, &stopEvent);
+		}
+
+		// Large enough to drain a few thousand events per read() call
+		readBuffer.resize(256 * 1024);
+	}
+
+	~InotifyWatchBackend() override
+	{
+		Close();
+
+		if (stopFd >= 0)
+		{
+			close(stopFd);
+			stopFd = -1;
+		}
+
+		if (epollFd >= 0)
+		{
+			close(epollFd);
+			epollFd = -1;
+		}
+	}
+
+	bool AddWatch(uint32_t watchId, const std::wstring& folderPath, bool includeSubfolders) override
+	{
+		if (epollFd < 0 || stopFd < 0 || stopRequested.load())
+		{
+			return false;
+		}
+
+		// One inotify instance per folder, so each folder gets its own kernel queue and an
+		// IN_Q_OVERFLOW can be attributed to the folder that lost events.
+		auto watch = std::make_unique<FolderWatch>();
+		watch->watchId = watchId;
+		watch->rootPath = std::fs::path(folderPath).u8string();
+		watch->watchSubtree = includeSubfolders;
+
+		watch->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (watch->inotifyFd < 0)
+		{
+			return false;
+		}
+
+		if (!AddDirWatch(*watch, watch->rootPath))
+		{
+			close(watch->inotifyFd);
+			return false;
+		}
+
+		if (watch->watchSubtree)
+		{
+			AddSubtreeWatches(*watch, watch->rootPath, nullptr);
+		}
+
+		epoll_event readEvent = {};
+		readEvent.events = EPOLLIN;
+		readEvent.data.u64 = (uint64_t)watches.size();
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, watch->inotifyFd, &readEvent) != 0)
+		{
+			close(watch->inotifyFd);
+			return false;
+		}
+
+		watches.push_back(std::move(watch));
+		return true;
+	}
+
+	bool WaitForEvents(uint32_t timeoutMs, std::vector<WatchEvent>& outEvents) override
+	{
+		if (epollFd < 0 || stopRequested.load())
+		{
+			return false;
+		}
+
+		epoll_event readyEvents[64] = {};
+
+		int waitTimeout = (timeoutMs == kWatchWaitInfinite) ? -1 : (int)(std::min)(timeoutMs, (uint32_t)INT_MAX);
+		int readyCount = epoll_wait(epollFd, readyEvents, (int)std::size(readyEvents), waitTimeout);
+
+		if (readyCount < 0)
+		{
+			return errno == EINTR;
+		}
+
+		for (int readyIndex = 0; readyIndex < readyCount; ++readyIndex)
+		{
+			uint64_t key = readyEvents[readyIndex].data.u64;
+			if (key == kStopKey || key >= watches.size())
+			{
+				continue;
+			}
+
+			DrainWatch(*watches[key], outEvents);
+		}
+
+		return !stopRequested.load();
+	}
+
+	void Cancel() override
+	{
+		stopRequested.store(true);
+
+		if (stopFd >= 0)
+		{
+			uint64_t wakeValue = 1;
+			ssize_t written = write(stopFd, &wakeValue, sizeof(wakeValue));
+			(void)written;
+		}
+	}
+
+	void Close() override
+	{
+		for (auto& watch : watches)
+		{
+			if (watch->inotifyFd >= 0)
+			{
+				if (epollFd >= 0)
+				{
+					epoll_ctl(epollFd, EPOLL_CTL_DEL, watch->inotifyFd, nullptr);
+				}
+
+				close(watch->inotifyFd);
+				watch->inotifyFd = -1;
+			}
+		}
+
+		watches.clear();
+	}
+
+private:
+	static constexpr uint64_t kStopKey = ~0ull;
+
+	static constexpr uint32_t kWatchMask =
+		IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+	struct FolderWatch
+	{
+		uint32_t								watchId = 0;
+		std::string								rootPath;
+		bool									watchSubtree = true;
+		int										inotifyFd = -1;
+		std::unordered_map<int, std::string>	watchDirs;
+		std::unordered_map<std::string, int>	dirWatches;
+	};
+
+	static std::wstring ToWidePath(const std::string& utf8Path)
+	{
+		return std::fs::u8path(utf8Path).wstring();
+	}
+
+	static bool AddDirWatch(FolderWatch& watch, const std::string& dirPath)
+	{
+		int watchDescriptor = inotify_add_watch(watch.inotifyFd, dirPath.c_str(), kWatchMask);
+		if (watchDescriptor < 0)
+		{
+			return false;
+		}
+
+		watch.watchDirs[watchDescriptor] = dirPath;
+		watch.dirWatches[dirPath] = watchDescriptor;
+		return true;
+	}
+
+	static void RemoveSubtreeWatches(FolderWatch& watch, const std::string& dirPath)
+	{
+		std::string dirPrefix = dirPath + "/";
+
+		for (auto itr = watch.dirWatches.begin(); itr != watch.dirWatches.end();)
+		{
+			if (itr->first == dirPath || itr->first.rfind(dirPrefix, 0) == 0)
+			{
+				inotify_rm_watch(watch.inotifyFd, itr->second);
+				watch.watchDirs.erase(itr->second);
+				itr = watch.dirWatches.erase(itr);
+			}
+			else
+			{
+				++itr;
+			}
+		}
+	}
+
+	// Watches every directory below dirPath. When outEvents is given, files that already exist in the
+	// subtree are reported as added, since they may have been written before the watch was in place.
+	static void AddSubtreeWatches(FolderWatch& watch, const std::string& dirPath, std::vector<WatchEvent>* outEvents)
+	{
+		std::error_code errorCode;
+
+		for (auto iterator = std::fs::recursive_directory_iterator(std::fs::u8path(dirPath), std::fs::directory_options::skip_permission_denied, errorCode);
+			iterator != std::fs::recursive_directory_iterator();
+			iterator.increment(errorCode))
+		{
+			if (errorCode)
+			{
+				errorCode.clear();
+				continue;
+			}
+
+			if (iterator->is_symlink(errorCode))
+			{
+				if (iterator->is_directory(errorCode))
+				{
+					iterator.disable_recursion_pending();
+				}
+				continue;
+			}
+
+			if (iterator->is_directory(errorCode))
+			{
+				AddDirWatch(watch, iterator->path().u8string());
+			}
+			else if (outEvents && iterator->is_regular_file(errorCode))
+			{
+				WatchEvent event = {};
+				event.action = WatchAction::Added;
+				event.watchId = watch.watchId;
+				event.fullPath = iterator->path().wstring();
+				outEvents->push_back(std::move(event));
+			}
+		}
+	}
+
+	// Reads until the instance queue is empty so a burst is handled in as few wakeups as possible
+	void DrainWatch(FolderWatch& watch, std::vector<WatchEvent>& outEvents)
+	{
+		while (watch.inotifyFd >= 0)
+		{
+			ssize_t bytesRead = read(watch.inotifyFd, readBuffer.data(), readBuffer.size());
+			if (bytesRead < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				return;
+			}
+
+			if (bytesRead == 0)
+			{
+				return;
+			}
+
+			ParseEvents(watch, readBuffer.data(), (size_t)bytesRead, outEvents);
+		}
+	}
+
+	static void ParseEvents(FolderWatch& watch, const uint8_t* buffer, size_t bufferSize, std::vector<WatchEvent>& outEvents)
+	{
+		size_t offset = 0;
+		while (offset + sizeof(inotify_event) <= bufferSize)
+		{
+			const inotify_event* notifyEvent = (const inotify_event*)(buffer + offset);
+			offset += sizeof(inotify_event) + notifyEvent->len;
+
+			if (notifyEvent->mask & IN_Q_OVERFLOW)
+			{
+				WatchEvent overflowEvent = {};
+				overflowEvent.action = WatchAction::Overflow;
+				overflowEvent.watchId = watch.watchId;
+				overflowEvent.fullPath = ToWidePath(watch.rootPath);
+				outEvents.push_back(std::move(overflowEvent));
+				continue;
+			}
+
+			if (notifyEvent->mask & IN_IGNORED)
+			{
+				auto foundDir = watch.watchDirs.find(notifyEvent->wd);
+				if (foundDir != watch.watchDirs.end())
+				{
+					watch.dirWatches.erase(foundDir->second);
+					watch.watchDirs.erase(foundDir);
+				}
+				continue;
+			}
+
+			auto foundDir = watch.watchDirs.find(notifyEvent->wd);
+			if (foundDir == watch.watchDirs.end() || notifyEvent->len == 0)
+			{
+				continue;
+			}
+
+			std::string fullPath = foundDir->second + "/" + std::string(notifyEvent->name);
+			bool isDirectory = (notifyEvent->mask & IN_ISDIR) != 0;
+
+			if (isDirectory)
+			{
+				if (!watch.watchSubtree)
+				{
+					continue;
+				}
+
+				if (notifyEvent->mask & (IN_CREATE | IN_MOVED_TO))
+				{
+					if (AddDirWatch(watch, fullPath))
+					{
+						AddSubtreeWatches(watch, fullPath, &outEvents);
+					}
+				}
+				else if (notifyEvent->mask & (IN_DELETE | IN_MOVED_FROM))
+				{
+					RemoveSubtreeWatches(watch, fullPath);
+				}
+				continue;
+			}
+
+			WatchEvent event = {};
+			event.watchId = watch.watchId;
+			event.fullPath = ToWidePath(fullPath);
+
+			if (notifyEvent->mask & IN_CREATE)
+			{
+				event.action = WatchAction::Added;
+			}
+			else if (notifyEvent->mask & (IN_MODIFY | IN_CLOSE_WRITE))
+			{
+				event.action = WatchAction::Modified;
+			}
+			else if (notifyEvent->mask & IN_DELETE)
+			{
+				event.action = WatchAction::Removed;
+			}
+			else if (notifyEvent->mask & IN_MOVED_FROM)
+			{
+				event.action = WatchAction::RenamedOldName;
+			}
+			else if (notifyEvent->mask & IN_MOVED_TO)
+			{
+				event.action = WatchAction::RenamedNewName;
+			}
+			else
+			{
+				continue;
+			}
+
+			outEvents.push_back(std::move(event));
+		}
+	}
+
+	int										epollFd = -1;
+	int										stopFd = -1;
+	std::atomic<bool>						stopRequested = false;
+	std::vector<uint8_t>					readBuffer;
+	std::vector<std::unique_ptr<FolderWatch>>	watches;
+};
+
+std::unique_ptr<WatchBackend> CreateWatchBackend()
+{
+	return std::make_unique<InotifyWatchBackend>();
+}
+
+#endif // __linux__
@@ -0,0 +1,270 @@
+#include "main.h"
+#include "watcher.h"
+
+#if defined(_WIN32)
+
+class Win32WatchBackend : public WatchBackend
+{
+public:
+	Win32WatchBackend()
+	{
+		completionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+	}
+
+	~Win32WatchBackend() override
+	{
+		Close();
+
+		if (completionPort)
+		{
+			CloseHandle(completionPort);
+			completionPort = nullptr;
+		}
+	}
+
+	bool AddWatch(uint32_t watchId, const std::wstring& folderPath, bool includeSubfolders) override
+	{
+		if (!completionPort || stopRequested.load())
+		{
+			return false;
+		}
+
+		auto watch = std::make_unique<DirectoryWatch>();
+		watch->watchId = watchId;
+		watch->rootPath = folderPath;
+		watch->watchSubtree = includeSubfolders;
+
+		watch->directoryHandle = CreateFileW(
+			folderPath.c_str(),
+			FILE_LIST_DIRECTORY,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			nullptr,
+			OPEN_EXISTING,
+			FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+			nullptr);
+
+		if (watch->directoryHandle == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+
+		// The completion key is the slot index so completions are routed without a lookup
+		ULONG_PTR completionKey = (ULONG_PTR)watches.size();
+		if (CreateIoCompletionPort(watch->directoryHandle, completionPort, completionKey, 0) == nullptr)
+		{
+			CloseHandle(watch->directoryHandle);
+			return false;
+		}
+
+		watch->notifyBuffer.resize(64 * 1024);
+
+		if (!IssueRead(*watch))
+		{
+			CloseHandle(watch->directoryHandle);
+			return false;
+		}
+
+		watches.push_back(std::move(watch));
+		return true;
+	}
+
+	bool WaitForEvents(uint32_t timeoutMs, std::vector<WatchEvent>& outEvents) override
+	{
+		if (!completionPort || stopRequested.load())
+		{
+			return false;
+		}
+
+		OVERLAPPED_ENTRY completions[64] = {};
+		ULONG completionCount = 0;
+
+		BOOL dequeued = GetQueuedCompletionStatusEx(completionPort, completions, (ULONG)std::size(completions), &completionCount, (DWORD)timeoutMs, FALSE);
+		if (!dequeued)
+		{
+			return GetLastError() == WAIT_TIMEOUT;
+		}
+
+		for (ULONG completionIndex = 0; completionIndex < completionCount; ++completionIndex)
+		{
+			const OVERLAPPED_ENTRY& completion = completions[completionIndex];
+
+			if (completion.lpCompletionKey == kStopKey || completion.lpCompletionKey >= watches.size())
+			{
+				continue;
+			}
+
+			DirectoryWatch& watch = *watches[completion.lpCompletionKey];
+			watch.readPending = false;
+
+			DWORD bytesReturned = 0;
+			if (!GetOverlappedResult(watch.directoryHandle, &watch.overlapped, &bytesReturned, FALSE))
+			{
+				// Folder removed or the handle went bad. Leave this watch idle, the others carry on.
+				continue;
+			}
+
+			ParseNotifyBuffer(watch, bytesReturned, outEvents);
+
+			if (!stopRequested.load())
+			{
+				IssueRead(watch);
+			}
+		}
+
+		return !stopRequested.load();
+	}
+
+	void Cancel() override
+	{
+		stopRequested.store(true);
+
+		if (completionPort)
+		{
+			PostQueuedCompletionStatus(completionPort, 0, kStopKey, nullptr);
+		}
+	}
+
+	void Close() override
+	{
+		size_t pendingReads = 0;
+
+		for (auto& watch : watches)
+		{
+			if (watch->readPending)
+			{
+				CancelIoEx(watch->directoryHandle, &watch->overlapped);
+				++pendingReads;
+			}
+		}
+
+		// The kernel owns the notify buffers until every cancelled read has completed
+		while (pendingReads > 0 && completionPort)
+		{
+			OVERLAPPED_ENTRY completions[64] = {};
+			ULONG completionCount = 0;
+
+			if (!GetQueuedCompletionStatusEx(completionPort, completions, (ULONG)std::size(completions), &completionCount, 1000, FALSE))
+			{
+				break;
+			}
+
+			for (ULONG completionIndex = 0; completionIndex < completionCount; ++completionIndex)
+			{
+				ULONG_PTR completionKey = completions[completionIndex].lpCompletionKey;
+				if (completionKey < watches.size() && watches[completionKey]->readPending)
+				{
+					watches[completionKey]->readPending = false;
+					--pendingReads;
+				}
+			}
+		}
+
+		for (auto& watch : watches)
+		{
+			if (watch->directoryHandle != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(watch->directoryHandle);
+				watch->directoryHandle = INVALID_HANDLE_VALUE;
+			}
+		}
+
+		watches.clear();
+	}
+
+private:
+	static constexpr ULONG_PTR kStopKey = (ULONG_PTR)-1;
+
+	struct DirectoryWatch
+	{
+		uint32_t				watchId = 0;
+		std::wstring			rootPath;
+		bool					watchSubtree = true;
+		HANDLE					directoryHandle = INVALID_HANDLE_VALUE;
+		OVERLAPPED				overlapped = {};
+		bool					readPending = false;
+		std::vector<uint8_t>	notifyBuffer;
+	};
+
+	static bool IssueRead(DirectoryWatch& watch)
+	{
+		watch.overlapped = {};
+
+		DWORD notifyFlags = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+
+		BOOL readStarted = ReadDirectoryChangesW(
+			watch.directoryHandle,
+			watch.notifyBuffer.data(),
+			(DWORD)watch.notifyBuffer.size(),
+			watch.watchSubtree ? TRUE : FALSE,
+			notifyFlags,
+			nullptr,
+			&watch.overlapped,
+			nullptr);
+
+		if (!readStarted && GetLastError() != ERROR_IO_PENDING)
+		{
+			return false;
+		}
+
+		watch.readPending = true;
+		return true;
+	}
+
+	static void ParseNotifyBuffer(const DirectoryWatch& watch, DWORD bytesReturned, std::vector<WatchEvent>& outEvents)
+	{
+		// A zero sized completion means the notify buffer overflowed and the changes were dropped
+		if (bytesReturned == 0)
+		{
+			WatchEvent overflowEvent = {};
+			overflowEvent.action = WatchAction::Overflow;
+			overflowEvent.watchId = watch.watchId;
+			overflowEvent.fullPath = watch.rootPath;
+			outEvents.push_back(std::move(overflowEvent));
+			return;
+		}
+
+		const FILE_NOTIFY_INFORMATION* notifyInfo = (const FILE_NOTIFY_INFORMATION*)watch.notifyBuffer.data();
+		while (true)
+		{
+			std::wstring relativePath(notifyInfo->FileName, notifyInfo->FileNameLength / sizeof(wchar_t));
+
+			WatchEvent event = {};
+			event.watchId = watch.watchId;
+			event.fullPath = (std::fs::path(watch.rootPath) / std::fs::path(relativePath)).wstring();
+
+			bool isKnownAction = true;
+			switch (notifyInfo->Action)
+			{
+				case FILE_ACTION_ADDED:				event.action = WatchAction::Added;			break;
+				case FILE_ACTION_REMOVED:			event.action = WatchAction::Removed;		break;
+				case FILE_ACTION_MODIFIED:			event.action = WatchAction::Modified;		break;
+				case FILE_ACTION_RENAMED_OLD_NAME:	event.action = WatchAction::RenamedOldName;	break;
+				case FILE_ACTION_RENAMED_NEW_NAME:	event.action = WatchAction::RenamedNewName;	break;
+				default:							isKnownAction = false;						break;
+			}
+
+			if (isKnownAction)
+			{
+				outEvents.push_back(std::move(event));
+			}
+
+			if (notifyInfo->NextEntryOffset == 0)
+			{
+				break;
+			}
+
+			notifyInfo = (const FILE_NOTIFY_INFORMATION*)((const uint8_t*)notifyInfo + notifyInfo->NextEntryOffset);
+		}
+	}
+
+	HANDLE											completionPort = nullptr;
+	std::atomic<bool>								stopRequested = false;
+	std::vector<std::unique_ptr<DirectoryWatch>>	watches;
+};
+
+std::unique_ptr<WatchBackend> CreateWatchBackend()
+{
+	return std::make_unique<Win32WatchBackend>();
+}
+
+#endif // _WIN32